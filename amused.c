@@ -33,20 +33,52 @@
 #include <unistd.h>
 
 #include "amused.h"
+#include "cache.h"
 #include "control.h"
 #include "ev.h"
 #include "log.h"
 #include "playlist.h"
+#include "prefetch.h"
+#include "snapshot.h"
+#include "status.h"
+#include "trace.h"
 #include "xmalloc.h"
 
 char		*csock = NULL;
 int		 debug;
 int		 verbose;
+int		 bufms = 500;
+int		 profile = AUDIO_NORMAL;
+int		 outrate;
 struct imsgev	*iev_player;
+struct amused_stats stats;
 
 const char	*argv0;
 pid_t		 player_pid;
 
+/* the track handed to the player ahead of time */
+static struct {
+	uint32_t	 id;
+	char		*path;
+	struct stat	 sb;
+} prepared;
+
+/*
+ * The file being played, to key the index cache, and the id it was
+ * sent to the player with: an index for any other track is stale.
+ */
+static struct stat	 current_sb;
+static uint32_t		 current_id;
+static uint32_t		 last_id;
+
+static uint32_t
+main_track_id(void)
+{
+	if (++last_id == 0)
+		last_id = 1;
+	return last_id;
+}
+
 enum amused_process {
 	PROC_MAIN,
 	PROC_PLAYER,
@@ -58,6 +90,9 @@ main_shutdown(void)
 	pid_t	pid;
 	int	status;
 
+	snapshot_save();
+	trace_dump();
+
 	/* close pipes. */
 	msgbuf_clear(&iev_player->imsgbuf.w);
 	close(iev_player->imsgbuf.fd);
@@ -91,11 +126,74 @@ main_sig_handler(int sig, int event, void *arg)
 	case SIGINT:
 		main_shutdown();
 		break;
+	case SIGUSR1:
+		trace_dump();
+		break;
 	default:
 		fatalx("unexpected signal %d", sig);
 	}
 }
 
+static void
+main_prepare_reset(void)
+{
+	free(prepared.path);
+	prepared.path = NULL;
+}
+
+/*
+ * The current track is over.  If the player already moved on to the
+ * track that was prepared (id matches) only update the playlist,
+ * otherwise start the right song.
+ */
+static void
+main_playlist_eof(uint32_t id)
+{
+	const char	*song;
+	int		 gapless;
+
+	gapless = id != 0 && id == prepared.id && prepared.path != NULL;
+	if (gapless) {
+		current_sb = prepared.sb;
+		current_id = prepared.id;
+	}
+
+	if (repeat_one) {
+		if (gapless && current_song != NULL &&
+		    !strcmp(current_song, prepared.path)) {
+			main_prepare_reset();
+			main_prepare_next();
+			return;
+		}
+		if (main_play_song(current_song))
+			return;
+	}
+
+	if (repeat_one || consume)
+		playlist_dropcurrent();
+
+	song = playlist_advance();
+	if (gapless && song != NULL && !strcmp(song, prepared.path)) {
+		main_prepare_reset();
+		main_prepare_next();
+	} else {
+		for (; song != NULL; song = playlist_advance()) {
+			if (main_play_song(song))
+				break;
+			playlist_dropcurrent();
+		}
+
+		/* the player went on with a stale track */
+		if (song == NULL && id != 0)
+			main_send_player(IMSG_STOP, -1, NULL, 0);
+	}
+
+	if (play_state == STATE_PLAYING)
+		control_notify(IMSG_CTL_NEXT);
+	else
+		control_notify(IMSG_CTL_STOP);
+}
+
 static void
 main_dispatch_player(int sig, int event, void *d)
 {
@@ -104,8 +202,11 @@ main_dispatch_player(int sig, int event, void *d)
 	struct imsgbuf	*imsgbuf = &iev->imsgbuf;
 	struct imsg	 imsg;
 	struct ibuf	 ibuf;
+	struct player_track track;
+	struct trace_event tev;
 	size_t		 datalen;
 	ssize_t		 n;
+	uint32_t	 id;
 	int		 shut = 0;
 
 	if (event & POLLIN) {
@@ -142,6 +243,7 @@ main_dispatch_player(int sig, int event, void *d)
 				fatalx("IMSG_LEN: got wrong size");
 			if (current_duration < 0)
 				current_duration = -1;
+			status_update();
 			break;
 		case IMSG_ERR:
 			if (imsg_get_ibuf(&imsg, &ibuf) == -1 ||
@@ -159,16 +261,29 @@ main_dispatch_player(int sig, int event, void *d)
 			else
 				control_notify(IMSG_CTL_STOP);
 			break;
+		case IMSG_INDEX:
+			if (imsg_get_data(&imsg, &track, sizeof(track)) == -1)
+				fatalx("IMSG_INDEX: got wrong size");
+			if (track.index.nseek > TRACK_NSEEK)
+				fatalx("IMSG_INDEX: too many seek points");
+			if (play_state != STATE_STOPPED &&
+			    track.id == current_id)
+				cache_store(&current_sb, &track.index);
+			break;
+		case IMSG_TRACE:
+			if (imsg_get_data(&imsg, &tev, sizeof(tev)) == -1)
+				fatalx("IMSG_TRACE: got wrong size");
+			trace_add(&tev);
+			break;
+		case IMSG_STATS:
+			if (imsg_get_data(&imsg, &stats.player,
+			    sizeof(stats.player)) == -1)
+				fatalx("IMSG_STATS: got wrong size");
+			break;
 		case IMSG_EOF:
-			if (repeat_one && main_play_song(current_song))
-				break;
-			else if (repeat_one || consume)
-				playlist_dropcurrent();
-			main_playlist_advance();
-			if (play_state == STATE_PLAYING)
-				control_notify(IMSG_CTL_NEXT);
-			else
-				control_notify(IMSG_CTL_STOP);
+			if (imsg_get_data(&imsg, &id, sizeof(id)) == -1)
+				fatalx("IMSG_EOF: got wrong size");
+			main_playlist_eof(id);
 			break;
 		default:
 			log_debug("%s: error handling imsg %d", __func__,
@@ -187,7 +302,8 @@ main_dispatch_player(int sig, int event, void *d)
 static pid_t
 start_child(enum amused_process proc, int fd)
 {
-	const char	*argv[7];
+	const char	*argv[13];
+	char		 bufarg[16], ratearg[16];
 	int		 argc = 0;
 	pid_t		 pid;
 
@@ -224,6 +340,24 @@ exec:
 		break;
 	}
 
+	(void)snprintf(bufarg, sizeof(bufarg), "%d", bufms);
+	argv[argc++] = "-b";
+	argv[argc++] = bufarg;
+
+	if (profile == AUDIO_LOW) {
+		argv[argc++] = "-l";
+		argv[argc++] = "low";
+	} else if (profile == AUDIO_POWERSAVE) {
+		argv[argc++] = "-l";
+		argv[argc++] = "powersave";
+	}
+
+	if (outrate != 0) {
+		(void)snprintf(ratearg, sizeof(ratearg), "%d", outrate);
+		argv[argc++] = "-r";
+		argv[argc++] = ratearg;
+	}
+
 	if (debug)
 		argv[argc++] = "-d";
 	if (verbose)
@@ -273,6 +407,7 @@ amused_main(void)
 
 	ev_signal(SIGINT, main_sig_handler, NULL);
 	ev_signal(SIGTERM, main_sig_handler, NULL);
+	ev_signal(SIGUSR1, main_sig_handler, NULL);
 
 	iev_player = xmalloc(sizeof(*iev_player));
 	imsg_init(&iev_player->imsgbuf, pipe_main2player[0]);
@@ -285,6 +420,11 @@ amused_main(void)
 		fatal("control socket setup failed %s", csock);
 	control_listen(control_fd);
 
+	cache_init();
+	snapshot_init();
+	status_init();
+	trace_init();
+
 	if (pledge("stdio rpath unix sendfd", NULL) == -1)
 		fatal("pledge");
 
@@ -296,6 +436,7 @@ amused_main(void)
 int
 main(int argc, char **argv)
 {
+	const char *errstr;
 	int ch, proc = -1;
 
 	log_init(1, LOG_DAEMON);	/* Log to stderr until daemonized */
@@ -305,11 +446,31 @@ main(int argc, char **argv)
 	if (argv0 == NULL)
 		argv0 = "amused";
 
-	while ((ch = getopt(argc, argv, "ds:T:v")) != -1) {
+	while ((ch = getopt(argc, argv, "b:dl:r:s:T:v")) != -1) {
 		switch (ch) {
+		case 'b':
+			bufms = strtonum(optarg, 10, 10000, &errstr);
+			if (errstr != NULL)
+				fatalx("buffer size is %s: %s", errstr, optarg);
+			break;
 		case 'd':
 			debug = 1;
 			break;
+		case 'l':
+			if (!strcmp(optarg, "low"))
+				profile = AUDIO_LOW;
+			else if (!strcmp(optarg, "normal"))
+				profile = AUDIO_NORMAL;
+			else if (!strcmp(optarg, "powersave"))
+				profile = AUDIO_POWERSAVE;
+			else
+				fatalx("unknown latency profile: %s", optarg);
+			break;
+		case 'r':
+			outrate = strtonum(optarg, 8000, 384000, &errstr);
+			if (errstr != NULL)
+				fatalx("sample rate is %s: %s", errstr, optarg);
+			break;
 		case 's':
 			free(csock);
 			csock = xstrdup(optarg);
@@ -339,7 +500,7 @@ main(int argc, char **argv)
 	if (proc == PROC_MAIN)
 		amused_main();
 	if (proc == PROC_PLAYER)
-		exit(player(debug, verbose));
+		exit(player(debug, verbose, bufms, profile, outrate));
 
 	if (csock == NULL) {
 		const char *tmpdir;
@@ -365,6 +526,12 @@ spawn_daemon(void)
 void
 imsg_event_add(struct imsgev *iev)
 {
+	uint64_t *max;
+
+	max = iev == iev_player ? &stats.player_queue : &stats.ctl_queue;
+	if (iev->imsgbuf.w.queued > *max)
+		*max = iev->imsgbuf.w.queued;
+
 	iev->events = POLLIN;
 	if (iev->imsgbuf.w.queued)
 		iev->events |= POLLOUT;
@@ -391,34 +558,130 @@ main_send_player(uint16_t type, int fd, const void *data, size_t len)
 	return imsg_compose_event(iev_player, type, 0, 0, fd, data, len);
 }
 
-int
-main_play_song(const char *path)
+static int
+main_open_song(const char *path, struct stat *sb)
 {
-	struct stat sb;
 	int fd;
 
+	/* the failures were logged already */
+	if ((fd = prefetch_take(path, sb)) == PREFETCH_BAD)
+		return -1;
+	if (fd != -1)
+		return fd;
+
 	if ((fd = open(path, O_RDONLY)) == -1) {
 		log_warn("open %s", path);
-		return 0;
+		return -1;
 	}
 
-	if (fstat(fd, &sb) == -1) {
+	if (fstat(fd, sb) == -1) {
 		log_warn("failed to stat %s", path);
 		close(fd);
-		return 0;
+		return -1;
 	}
 
-	if (!S_ISREG(sb.st_mode)) {
+	if (!S_ISREG(sb->st_mode)) {
 		log_info("skipping non-regular file: %s", path);
 		close(fd);
-		return 0;
+		return -1;
 	}
 
+	return fd;
+}
+
+/* the cached entry for the track, if any, is sent with the fd */
+static void
+main_lookup_index(const struct stat *sb, struct player_track *track)
+{
+	if (cache_lookup(sb, &track->index) == -1) {
+		memset(&track->index, 0, sizeof(track->index));
+		track->index.duration = -1;
+	}
+}
+
+int
+main_play_song(const char *path)
+{
+	struct player_track track;
+	struct player_seek seek;
+	struct stat sb;
+	uint32_t trace;
+	int fd;
+
+	trace = trace_track();
+	trace_mark(trace, TRACE_OPEN);
+	if ((fd = main_open_song(path, &sb)) == -1)
+		return 0;
+	trace_mark(trace, TRACE_OPENED);
+
+	memset(&track, 0, sizeof(track));
+	main_lookup_index(&sb, &track);
+	track.id = main_track_id();
+	track.trace = trace;
+	current_sb = sb;
+	current_id = track.id;
+
 	play_state = STATE_PLAYING;
-	main_send_player(IMSG_PLAY, fd, NULL, 0);
+	main_send_player(IMSG_PLAY, fd, &track, sizeof(track));
+	trace_mark(trace, TRACE_SENT);
+
+	/* pick up where the last run of the daemon left */
+	memset(&seek, 0, sizeof(seek));
+	if ((seek.offset = snapshot_resume(path)) > 0)
+		main_send_player(IMSG_CTL_SEEK, -1, &seek, sizeof(seek));
+
+	/* the player drops the prepared track with IMSG_PLAY */
+	main_prepare_reset();
+	main_prepare_next();
 	return 1;
 }
 
+/*
+ * Hand the track that follows the current one to the player, so it
+ * can start it without waiting for us and without a gap.  Has to be
+ * called every time the playlist or the modes change.
+ */
+void
+main_prepare_next(void)
+{
+	struct player_track track;
+	const char	*song;
+	int		 fd = -1;
+
+	/* the tracks after the prepared one may have changed too */
+	prefetch_schedule();
+
+	if (play_state == STATE_STOPPED)
+		return;
+
+	song = playlist_peek();
+	if (song == NULL && prepared.path == NULL)
+		return;
+	if (song != NULL && prepared.path != NULL &&
+	    !strcmp(song, prepared.path))
+		return;
+
+	main_prepare_reset();
+	memset(&track, 0, sizeof(track));
+	track.index.duration = -1;
+	if (song != NULL) {
+		prepared.path = xstrdup(song);
+		track.trace = trace_track();
+		trace_mark(track.trace, TRACE_OPEN);
+		fd = main_open_song(song, &prepared.sb);
+		if (fd != -1) {
+			trace_mark(track.trace, TRACE_OPENED);
+			main_lookup_index(&prepared.sb, &track);
+		} else
+			track.trace = 0;
+	}
+
+	prepared.id = main_track_id();
+	track.id = prepared.id;
+	main_send_player(IMSG_PREPARE, fd, &track, sizeof(track));
+	trace_mark(track.trace, TRACE_SENT);
+}
+
 void
 main_playlist_jump(struct imsgev *iev, struct imsg *imsg)
 {
@@ -538,6 +801,48 @@ err:
 	main_senderr(iev, err);
 }
 
+/*
+ * Every path in the batch is prefixed by its length, NUL included, as
+ * a 16 bit integer in host byte order.
+ */
+void
+main_enqueue_batch(int tx, struct playlist *px, struct imsgev *iev,
+    struct imsg *imsg)
+{
+	struct ibuf	 ibuf;
+	const char	*path, *err = "malformed data";
+	uint32_t	 count = 0;
+	uint16_t	 len;
+
+	if (imsg_get_ibuf(imsg, &ibuf) == -1)
+		goto err;
+
+	while (ibuf_size(&ibuf) > 0) {
+		if (ibuf_get_h16(&ibuf, &len) == -1 ||
+		    len == 0 || len > PATH_MAX || ibuf_size(&ibuf) < len)
+			goto err;
+
+		path = ibuf_data(&ibuf);
+		if (memchr(path, '\0', len) != path + len - 1)
+			goto err;
+
+		if (tx)
+			playlist_push(px, path);
+		else
+			playlist_enqueue(path);
+		count++;
+
+		if (ibuf_skip(&ibuf, len) == -1)
+			goto err;
+	}
+
+	imsg_compose_event(iev, IMSG_CTL_ADD_BATCH, 0, 0, -1,
+	    &count, sizeof(count));
+	return;
+err:
+	main_senderr(iev, err);
+}
+
 void
 main_send_playlist(struct imsgev *iev)
 {
@@ -546,7 +851,7 @@ main_send_playlist(struct imsgev *iev)
 
 	for (i = 0; i < playlist.len; ++i) {
 		memset(&s, 0, sizeof(s));
-		strlcpy(s.path, playlist.songs[i], sizeof(s.path));
+		strlcpy(s.path, playlist_song(&playlist, i), sizeof(s.path));
 		s.status = play_off == i ? STATE_PLAYING : STATE_STOPPED;
 		imsg_compose_event(iev, IMSG_CTL_SHOW, 0, 0, -1, &s,
 		    sizeof(s));
@@ -555,25 +860,106 @@ main_send_playlist(struct imsgev *iev)
 	imsg_compose_event(iev, IMSG_CTL_SHOW, 0, 0, -1, NULL, 0);
 }
 
+static struct ibuf *
+main_list_create(struct imsgev *iev, uint32_t id, size_t first)
+{
+	struct player_list	 hdr;
+	struct ibuf		*wbuf;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.first = first;
+	hdr.current = play_off;
+	hdr.total = playlist.len;
+	hdr.gen = playlist_gen;
+
+	wbuf = imsg_create(&iev->imsgbuf, IMSG_CTL_LIST, id, 0,
+	    MAX_IMSGSIZE - IMSG_HEADER_SIZE);
+	if (wbuf == NULL || imsg_add(wbuf, &hdr, sizeof(hdr)) == -1)
+		fatal("imsg_create");
+	return wbuf;
+}
+
+/*
+ * Like main_send_playlist but compact, and only for the given range.
+ * The replies have the same id as the request.
+ */
 void
-main_send_status(struct imsgev *iev)
+main_send_list(struct imsgev *iev, struct imsg *imsg)
 {
-	struct player_status s;
+	struct player_range	 range;
+	struct ibuf		*wbuf = NULL;
+	const char		*path;
+	size_t			 i, end;
+	uint16_t		 len;
+
+	memset(&range, 0, sizeof(range));
+	if (imsg_get_len(imsg) != 0 &&
+	    imsg_get_data(imsg, &range, sizeof(range)) == -1) {
+		main_senderr(iev, "wrong size");
+		return;
+	}
+
+	end = playlist.len;
+	if (range.offset > end)
+		range.offset = end;
+	if (range.count != 0 && range.count < end - range.offset)
+		end = range.offset + range.count;
+
+	for (i = range.offset; i < end; ++i) {
+		path = playlist_song(&playlist, i);
+		len = strlen(path) + 1;
 
-	memset(&s, 0, sizeof(s));
+		if (wbuf != NULL &&
+		    ibuf_size(wbuf) + sizeof(len) + len > MAX_IMSGSIZE) {
+			imsg_close(&iev->imsgbuf, wbuf);
+			wbuf = NULL;
+		}
+		if (wbuf == NULL)
+			wbuf = main_list_create(iev, imsg_get_id(imsg), i);
+
+		if (imsg_add(wbuf, &len, sizeof(len)) == -1 ||
+		    imsg_add(wbuf, path, len) == -1)
+			fatal("imsg_add");
+	}
+	if (wbuf != NULL)
+		imsg_close(&iev->imsgbuf, wbuf);
+
+	imsg_close(&iev->imsgbuf, main_list_create(iev, imsg_get_id(imsg),
+	    end));
+	imsg_event_add(iev);
+}
+
+void
+main_status(struct player_status *s)
+{
+	memset(s, 0, sizeof(*s));
 
 	if (current_song != NULL)
-		strlcpy(s.path, current_song, sizeof(s.path));
-	s.status = play_state;
-	s.position = current_position;
-	s.duration = current_duration;
-	s.mode.repeat_all = repeat_all;
-	s.mode.repeat_one = repeat_one;
-	s.mode.consume = consume;
+		strlcpy(s->path, current_song, sizeof(s->path));
+	s->status = play_state;
+	s->position = current_position;
+	s->duration = current_duration;
+	s->mode.repeat_all = repeat_all;
+	s->mode.repeat_one = repeat_one;
+	s->mode.consume = consume;
+}
 
+void
+main_send_status(struct imsgev *iev)
+{
+	struct player_status s;
+
+	main_status(&s);
 	imsg_compose_event(iev, IMSG_CTL_STATUS, 0, 0, -1, &s, sizeof(s));
 }
 
+void
+main_send_stats(struct imsgev *iev)
+{
+	imsg_compose_event(iev, IMSG_CTL_STATS, 0, 0, -1, &stats,
+	    sizeof(stats));
+}
+
 void
 main_seek(struct player_seek *s)
 {
@@ -20,19 +20,23 @@
 extern char		*csock;
 extern int		 debug;
 extern int		 verbose;
+extern int		 bufms;
+extern int		 profile;
+extern int		 outrate;
 extern int		 playing;
 extern struct imsgev	*iev_player;
+extern struct amused_stats stats;
 
 #define IMSG_DATA_SIZE(imsg)	((imsg).hdr.len - IMSG_HEADER_SIZE)
 
 enum imsg_type {
-	IMSG_PLAY,		/* fd + filename */
+	IMSG_PLAY,		/* fd + struct player_track */
 	IMSG_RESUME,
 	IMSG_PAUSE,
 	IMSG_STOP,
 	IMSG_POS,
 	IMSG_LEN,
-	IMSG_EOF,
+	IMSG_EOF,		/* id of the prepared track or zero */
 	IMSG_ERR,		/* error string */
 
 	IMSG_CTL_PLAY,		/* with optional filename */
@@ -52,9 +56,22 @@ enum imsg_type {
 	IMSG_CTL_ADD,		/* path to a file */
 	IMSG_CTL_COMMIT,	/* offset of the track to jump to */
 
-	IMSG_CTL_MONITOR,	/* struct player_event */
+	IMSG_CTL_MONITOR,	/* struct player_monitor, optional */
 
 	IMSG_CTL_ERR,
+
+	/*
+	 * Added later: they go last so that the numbers above, which
+	 * the clients of older versions use, don't change.
+	 */
+	IMSG_PREPARE,		/* fd of the following track + player_track */
+	IMSG_INDEX,		/* player_track with the current track index */
+	IMSG_STATS,		/* struct player_stats */
+	IMSG_TRACE,		/* struct trace_event */
+	IMSG_CTL_LIST,		/* struct player_range, optional */
+	IMSG_CTL_ADD_BATCH,	/* paths; the reply is the count */
+	IMSG_CTL_STATS,		/* the reply is struct amused_stats */
+
 	IMSG__LAST,
 };
 
@@ -82,6 +99,28 @@ enum actions {
 	MODE,
 	MONITOR,
 	SEEK,
+	STATS,
+};
+
+#define TRACK_NSEEK	64
+
+/*
+ * What the decoder found out about a track, cached by main so that
+ * it doesn't have to be computed again on the next plays.  The seek
+ * table is decoder-specific: for mp3 it's the byte offset of every
+ * step-th frame.
+ */
+struct track_index {
+	int64_t		duration;	/* in samples, -1 if unknown */
+	uint32_t	step;
+	uint32_t	nseek;
+	int64_t		seek[TRACK_NSEEK];
+};
+
+struct player_track {
+	uint32_t		id;	/* assigned by main, never zero */
+	uint32_t		trace;	/* zero if not traced */
+	struct track_index	index;
 };
 
 struct player_seek {
@@ -90,6 +129,33 @@ struct player_seek {
 	int	percent;
 };
 
+/*
+ * Counters of the player, sent to main every second while playing.
+ * In the histograms, bucket i counts the values below 2^(i+1) usec
+ * and not in the previous ones; the last takes all the rest.
+ */
+#define STATS_HIST	20
+struct player_stats {
+	uint64_t	tracks;
+	uint64_t	wakeups;		/* of poll while playing */
+	uint64_t	written;		/* bytes to the device */
+	uint64_t	short_writes;
+	int64_t		xruns;			/* -1 if unknown */
+	uint64_t	decode[STATS_HIST];	/* time per buffer */
+	uint64_t	start[STATS_HIST];	/* to the first sample */
+};
+
+struct amused_stats {
+	struct player_stats	player;
+	uint64_t		player_queue;	/* most imsgs queued */
+	uint64_t		ctl_queue;	/* same, to a client */
+	uint64_t		clients;
+	uint64_t		monitors;
+	uint64_t		events;		/* notified */
+	uint64_t		fanout;		/* sent to the monitors */
+	uint64_t		coalesced;
+};
+
 struct ctl_command;
 
 #define MODE_ON		+1
@@ -102,6 +168,24 @@ struct player_mode {
 	int	consume;
 };
 
+/* a window of the playlist for IMSG_CTL_LIST; count zero for all */
+struct player_range {
+	uint64_t	offset;
+	uint64_t	count;
+};
+
+/*
+ * Every IMSG_CTL_LIST reply starts with this, followed by the paths
+ * prefixed by their length like in IMSG_CTL_ADD_BATCH.  The last one
+ * has no paths.
+ */
+struct player_list {
+	uint64_t	first;		/* offset of the first path */
+	int64_t		current;	/* -1 if none */
+	uint64_t	total;
+	uint64_t	gen;		/* of the playlist */
+};
+
 struct player_status {
 	char			path[PATH_MAX];
 	int			status;
@@ -110,11 +194,36 @@ struct player_status {
 	struct player_mode	mode;
 };
 
+/*
+ * Subscription of IMSG_CTL_MONITOR: a zero mask means every event.
+ * With a coalesce window, a burst of events of the same type is
+ * delivered only once per window, carrying the latest state.
+ */
+#define MONITOR_EVENT(type)	(1ULL << (type))
+struct player_monitor {
+	uint64_t	mask;
+	uint32_t	coalesce;	/* msec, or zero */
+};
+
+/*
+ * The monitors that subscribe without a struct player_monitor are
+ * from older versions, and get only the fields up to mode.
+ */
+#define PLAYER_EVENT_OLDSIZE	offsetof(struct player_event, current)
 struct player_event {
 	int			 event;
 	int64_t			 position;
 	int64_t			 duration;
 	struct player_mode	 mode;
+	int64_t			 current;	/* offset of the current song */
+	uint64_t		 total;
+
+	/* changes to the playlist, see struct playlist_delta */
+	int			 change;
+	uint64_t		 base;
+	uint64_t		 gen;
+	uint64_t		 first;
+	uint64_t		 count;
 };
 
 struct parse_result {
@@ -122,10 +231,15 @@ struct parse_result {
 	char			**files;
 	FILE			*fp;
 	int			 pretty;
+	int			 json;
+	int			 recursive;
 	int			 monitor[IMSG__LAST];
+	uint32_t		 coalesce;
 	struct player_mode	 mode;
 	struct player_seek	 seek;
 	const char		*status_format;
+	struct player_status	 status;
+	int			 has_status;	/* from the status page */
 	struct ctl_command	*ctl;
 };
 
@@ -146,37 +260,61 @@ int		imsg_compose_event(struct imsgev *, uint16_t, uint32_t,
 		    pid_t, int, const void *, uint16_t);
 int		main_send_player(uint16_t, int, const void *, size_t);
 int		main_play_song(const char *);
+void		main_prepare_next(void);
 void		main_playlist_jump(struct imsgev *, struct imsg *);
 void		main_playlist_resume(void);
 void		main_playlist_advance(void);
 void		main_playlist_previous(void);
 void		main_senderr(struct imsgev *, const char *);
 void		main_enqueue(int, struct playlist *, struct imsgev *, struct imsg *);
+void		main_enqueue_batch(int, struct playlist *, struct imsgev *,
+		    struct imsg *);
 void		main_send_playlist(struct imsgev *);
+void		main_send_list(struct imsgev *, struct imsg *);
+void		main_status(struct player_status *);
 void		main_send_status(struct imsgev *);
+void		main_send_stats(struct imsgev *);
 void		main_seek(struct player_seek *);
 
+/* latency profiles for the audio device, see -l */
+#define AUDIO_NORMAL	0
+#define AUDIO_LOW	1		/* small buffers */
+#define AUDIO_POWERSAVE	2		/* big buffers, few wakeups */
+
 /* audio_*.c */
 int		audio_open(void (*)(void *, int));
-int		audio_setup(unsigned int, unsigned int, unsigned int,
-		    struct pollfd *, int);
+int		audio_formats(void);
+unsigned int	audio_channels(void);
+int		audio_setup(int, unsigned int, unsigned int, int,
+		    size_t *, struct pollfd *, int);
 int		audio_nfds(void);
 int		audio_pollfd(struct pollfd *, int, int);
 int		audio_revents(struct pollfd *, int);
 size_t		audio_write(const void *, size_t);
 int		audio_flush(void);
 int		audio_stop(void);
+int64_t		audio_xruns(void);
+
+/* audio_null.c, for the benchmarks */
+void		audio_null_written(int64_t *, double *);
 
 /* ctl.c */
 __dead void	usage(void);
 __dead void	ctl(int, char **);
 
 /* player.c */
-int	player_setup(unsigned int, unsigned int, unsigned int);
+void	*player_buffer(size_t);
+int	player_formats(void);
+int	player_setup(int, unsigned int, unsigned int);
 void	player_setduration(int64_t);
 void	player_setpos(int64_t);
+const struct track_index *player_index(void);
+void	player_saveindex(const struct track_index *);
+void	player_saveduration(int64_t);
 int	play(const void *, size_t, int64_t *);
-int	player(int, int);
+int	player_bench(int, const char **, const char **);
+void	player_init(int, int, int);
+int	player(int, int, int, int, int);
 
 int	play_oggvorbis(int, const char **);
 int	play_mp3(int, const char **);
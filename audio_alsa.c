@@ -18,21 +18,177 @@
 
 #include <alsa/asoundlib.h>
 
+#include <endian.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "amused.h"
 #include "log.h"
+#include "pcm.h"
+
+#if BYTE_ORDER == BIG_ENDIAN
+#define SND_PCM_FORMAT_S24_3	SND_PCM_FORMAT_S24_3BE
+#else
+#define SND_PCM_FORMAT_S24_3	SND_PCM_FORMAT_S24_3LE
+#endif
+
+static const struct {
+	int			 fmt;
+	snd_pcm_format_t	 alsa;
+} formats[] = {
+	{ PCM_S8,	SND_PCM_FORMAT_S8 },
+	{ PCM_S16,	SND_PCM_FORMAT_S16 },
+	{ PCM_S24_3,	SND_PCM_FORMAT_S24_3 },
+	{ PCM_S24,	SND_PCM_FORMAT_S24 },
+	{ PCM_S32,	SND_PCM_FORMAT_S32 },
+	{ PCM_F32,	SND_PCM_FORMAT_FLOAT },
+};
+
+/* buffer time for each latency profile, in usec */
+static const unsigned int profile_buffer[] = {
+	[AUDIO_NORMAL] =	500000,
+	[AUDIO_LOW] =		40000,
+	[AUDIO_POWERSAVE] =	2000000,
+};
 
 static snd_pcm_t	*pcm;
 static size_t		 bpf;
+static snd_pcm_format_t	 cur_fmt = SND_PCM_FORMAT_UNKNOWN;
+static unsigned int	 cur_rate, cur_chans;
 static void		(*onmove_cb)(void *, int);
+static int64_t		 xruns;
+
+static int		 use_mmap;
+static unsigned int	 buffer_time;	/* 0 means from the profile */
+static unsigned int	 period_time;	/* 0 means a quarter of the buffer */
+static unsigned int	 max_chans = 2;
+static snd_pcm_access_t	 pcm_access = SND_PCM_ACCESS_RW_INTERLEAVED;
+static snd_pcm_uframes_t bufsz, start_thr;
+
+static unsigned int
+envtime(const char *name, unsigned int def)
+{
+	const char	*v, *errstr;
+	unsigned int	 r;
+
+	if ((v = getenv(name)) == NULL || *v == '\0')
+		return def;
+	r = strtonum(v, 1000, 10000000, &errstr);
+	if (errstr != NULL) {
+		log_warnx("%s is %s: %s", name, errstr, v);
+		return def;
+	}
+	return r;
+}
+
+static int
+set_hwparams(snd_pcm_format_t fmt, unsigned int rate, unsigned int channels,
+    int profile)
+{
+	snd_pcm_hw_params_t	*hw;
+	unsigned int		 buft, pert;
+	int			 err, dir = 0;
+
+	snd_pcm_hw_params_alloca(&hw);
+
+	if ((err = snd_pcm_hw_params_any(pcm, hw)) < 0)
+		goto err;
+
+	pcm_access = SND_PCM_ACCESS_RW_INTERLEAVED;
+	if (use_mmap) {
+		err = snd_pcm_hw_params_set_access(pcm, hw,
+		    SND_PCM_ACCESS_MMAP_INTERLEAVED);
+		if (err == 0)
+			pcm_access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
+		else
+			log_debug("mmap access not available, using writei");
+	}
+	if (pcm_access == SND_PCM_ACCESS_RW_INTERLEAVED &&
+	    (err = snd_pcm_hw_params_set_access(pcm, hw, pcm_access)) < 0)
+		goto err;
+
+	if ((err = snd_pcm_hw_params_set_format(pcm, hw, fmt)) < 0 ||
+	    (err = snd_pcm_hw_params_set_channels(pcm, hw, channels)) < 0 ||
+	    (err = snd_pcm_hw_params_set_rate_resample(pcm, hw, 1)) < 0 ||
+	    (err = snd_pcm_hw_params_set_rate(pcm, hw, rate, 0)) < 0)
+		goto err;
+
+	buft = buffer_time != 0 ? buffer_time : profile_buffer[profile];
+	pert = period_time != 0 ? period_time : buft / 4;
+	if ((err = snd_pcm_hw_params_set_buffer_time_near(pcm, hw, &buft,
+	    &dir)) < 0 ||
+	    (err = snd_pcm_hw_params_set_period_time_near(pcm, hw, &pert,
+	    &dir)) < 0)
+		goto err;
+
+	if ((err = snd_pcm_hw_params(pcm, hw)) < 0)
+		goto err;
+
+	log_debug("alsa: %s access, buffer %uus, period %uus",
+	    pcm_access == SND_PCM_ACCESS_MMAP_INTERLEAVED ? "mmap" : "rw",
+	    buft, pert);
+	return 0;
+
+ err:
+	log_warnx("invalid params: %s", snd_strerror(err));
+	return -1;
+}
+
+static int
+set_swparams(void)
+{
+	snd_pcm_sw_params_t	*sw;
+	snd_pcm_uframes_t	 persz;
+	int			 err;
+
+	snd_pcm_sw_params_alloca(&sw);
+
+	if ((err = snd_pcm_get_params(pcm, &bufsz, &persz)) < 0 ||
+	    (err = snd_pcm_sw_params_current(pcm, sw)) < 0)
+		goto err;
+
+	/* start once almost full, wake up every period */
+	start_thr = bufsz - persz;
+	if ((err = snd_pcm_sw_params_set_start_threshold(pcm, sw,
+	    start_thr)) < 0 ||
+	    (err = snd_pcm_sw_params_set_avail_min(pcm, sw, persz)) < 0 ||
+	    (err = snd_pcm_sw_params(pcm, sw)) < 0)
+		goto err;
+
+	return 0;
+
+ err:
+	log_warnx("can't set the software params: %s", snd_strerror(err));
+	return -1;
+}
 
 int
 audio_open(void (*cb)(void *, int))
 {
-	const char	*device = "default";
+	const char	*device, *v, *errstr;
 	int		 err;
 
+	if ((device = getenv("AMUSED_ALSA_DEVICE")) == NULL || *device == '\0')
+		device = "default";
+	use_mmap = (v = getenv("AMUSED_ALSA_MMAP")) != NULL &&
+	    *v != '\0' && strcmp(v, "0") != 0;
+	buffer_time = envtime("AMUSED_ALSA_BUFFER", 0);
+	period_time = envtime("AMUSED_ALSA_PERIOD", 0);
+	if ((v = getenv("AMUSED_ALSA_CHANNELS")) != NULL && *v != '\0') {
+		max_chans = strtonum(v, 2, 8, &errstr);
+		if (errstr != NULL) {
+			log_warnx("AMUSED_ALSA_CHANNELS is %s: %s", errstr, v);
+			max_chans = 2;
+		}
+	}
+	if (period_time != 0 && buffer_time != 0 &&
+	    period_time >= buffer_time) {
+		log_warnx("AMUSED_ALSA_PERIOD must be less than the buffer");
+		period_time = 0;
+	}
+
 	err = snd_pcm_open(&pcm, device, SND_PCM_STREAM_PLAYBACK,
 	    SND_PCM_NONBLOCK);
 	if (err < 0) {
@@ -44,39 +200,83 @@ audio_open(void (*cb)(void *, int))
 	return 0;
 }
 
+/*
+ * The plug layer takes more channels than the card has, dropping
+ * the extra ones, so surround is sent only if asked.  The order is
+ * ALSA's: FL FR RL RR C LFE SL SR.
+ */
+unsigned int
+audio_channels(void)
+{
+	return max_chans;
+}
+
+/* what the device, or the plug layer in front of it, takes */
+int
+audio_formats(void)
+{
+	snd_pcm_hw_params_t	*hw;
+	size_t			 i;
+	int			 err, mask = 0;
+
+	snd_pcm_hw_params_alloca(&hw);
+	if ((err = snd_pcm_hw_params_any(pcm, hw)) < 0) {
+		log_warnx("can't get the hardware params: %s",
+		    snd_strerror(err));
+		return 0;
+	}
+
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i)
+		if (snd_pcm_hw_params_test_format(pcm, hw,
+		    formats[i].alsa) == 0)
+			mask |= formats[i].fmt;
+	return mask;
+}
+
 int
-audio_setup(unsigned int bits, unsigned int rate, unsigned int channels,
-    struct pollfd *pfds, int nfds)
+audio_setup(int pfmt, unsigned int rate, unsigned int channels,
+    int profile, size_t *frames, struct pollfd *pfds, int nfds)
 {
+	size_t			 i;
 	int			 err;
 	snd_pcm_format_t	 fmt;
 
-	if (bits == 8) {
-		fmt = SND_PCM_FORMAT_S8;
-		bpf = 1;
-	} else if (bits == 16) {
-		fmt = SND_PCM_FORMAT_S16;
-		bpf = 2;
-	} else if (bits == 24) {
-		fmt = SND_PCM_FORMAT_S24;
-		bpf = 4;
-	} else if (bits == 32) {
-		fmt = SND_PCM_FORMAT_S32;
-		bpf = 4;
-	} else {
-		log_warnx("can't handle %d bits", bits);
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); ++i)
+		if (formats[i].fmt == pfmt)
+			break;
+	if (i == sizeof(formats) / sizeof(formats[0])) {
+		log_warnx("can't handle %s samples", pcm_name(pfmt));
 		return -1;
 	}
+	fmt = formats[i].alsa;
+	bpf = pcm_width(pfmt);
 
 	bpf *= channels;
 
-	err = snd_pcm_set_params(pcm, fmt, SND_PCM_ACCESS_RW_INTERLEAVED,
-	    channels, rate, 1, 500000 /* 0.5s */);
-	if (err < 0) {
-		log_warnx("invalid params: %s", snd_strerror(err));
+	/* don't restart the stream if the parameters are the same */
+	if (fmt == cur_fmt && rate == cur_rate && channels == cur_chans) {
+		*frames = bufsz;
+		switch (snd_pcm_state(pcm)) {
+		case SND_PCM_STATE_PREPARED:
+		case SND_PCM_STATE_RUNNING:
+			return 0;
+		default:
+			goto prepare;
+		}
+	}
+
+	if (set_hwparams(fmt, rate, channels, profile) == -1 ||
+	    set_swparams() == -1) {
+		cur_fmt = SND_PCM_FORMAT_UNKNOWN;
 		return -1;
 	}
+	*frames = bufsz;
 
+	cur_fmt = fmt;
+	cur_rate = rate;
+	cur_chans = channels;
+
+ prepare:
 	err = snd_pcm_prepare(pcm);
 	if (err < 0) {
 		log_warnx("snd_pcm_prepare failed: %s", snd_strerror(err));
@@ -113,6 +313,61 @@ audio_revents(struct pollfd *pfds, int nfds)
 	return revents;
 }
 
+/*
+ * Copy straight into the device buffer: the kernel doesn't have to
+ * copy the frames once more as with snd_pcm_writei.
+ */
+static size_t
+mmap_write(const uint8_t *buf, snd_pcm_uframes_t len)
+{
+	const snd_pcm_channel_area_t	*areas;
+	snd_pcm_uframes_t		 off, frames, done = 0;
+	snd_pcm_sframes_t		 ret, avail;
+	uint8_t				*dst;
+	int				 err;
+
+	while (done < len) {
+		frames = len - done;
+		err = snd_pcm_mmap_begin(pcm, &areas, &off, &frames);
+		if (err < 0) {
+			log_warnx("snd_pcm_mmap_begin failed: %s",
+			    snd_strerror(err));
+			break;
+		}
+		if (frames == 0)
+			break;
+
+		/* interleaved: all the channels share one area */
+		dst = (uint8_t *)areas[0].addr +
+		    (areas[0].first + off * areas[0].step) / 8;
+		memcpy(dst, buf + done * bpf, frames * bpf);
+
+		ret = snd_pcm_mmap_commit(pcm, off, frames);
+		if (ret < 0) {
+			if (ret == -EPIPE) {
+				log_debug("alsa xrun occurred");
+				xruns++;
+				snd_pcm_recover(pcm, -EPIPE, 1);
+			} else
+				log_warnx("snd_pcm_mmap_commit failed: %s",
+				    snd_strerror(ret));
+			break;
+		}
+		done += ret;
+		if ((snd_pcm_uframes_t)ret != frames)
+			break;
+	}
+
+	/* unlike writei, committing doesn't start the stream */
+	if (done > 0 && snd_pcm_state(pcm) == SND_PCM_STATE_PREPARED &&
+	    (avail = snd_pcm_avail_update(pcm)) >= 0 &&
+	    bufsz - avail >= start_thr &&
+	    (err = snd_pcm_start(pcm)) < 0)
+		log_warnx("snd_pcm_start failed: %s", snd_strerror(err));
+
+	return done;
+}
+
 size_t
 audio_write(const void *buf, size_t len)
 {
@@ -127,6 +382,7 @@ audio_write(const void *buf, size_t len)
 	if (avail < 0) {
 		if (avail == -EPIPE) {
 			log_debug("alsa xrun occurred");
+			xruns++;
 			snd_pcm_recover(pcm, -EPIPE, 1);
 			return 0;
 		}
@@ -138,7 +394,10 @@ audio_write(const void *buf, size_t len)
 	if (len > avail)
 		len = avail;
 
-	ret = snd_pcm_writei(pcm, buf, len);
+	if (pcm_access == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+		ret = mmap_write(buf, len);
+	else
+		ret = snd_pcm_writei(pcm, buf, len);
 	if (ret < 0) {
 		log_warnx("snd_pcm_writei failed: %s", snd_strerror(ret));
 		return 0;
@@ -175,3 +434,9 @@ audio_stop(void)
 
 	return 0;
 }
+
+int64_t
+audio_xruns(void)
+{
+	return xruns;
+}
@@ -22,10 +22,12 @@
 #include <limits.h>
 #include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "amused.h"
 #include "log.h"
+#include "pcm.h"
 
 static void		(*onmove_cb)(void *, int);
 static int		 sp[2]; /* main, audio thread */
@@ -33,8 +35,9 @@ static pthread_t	 at;
 
 static int		 bpf;
 static ao_sample_format	 fmt;
-static char		 buf[BUFSIZ];
+static char		 buf[65536];
 static size_t		 buflen;
+static size_t		 chunk = 4096;	/* handed to ao_play at a time */
 
 static void *
 aworker(void *d)
@@ -122,26 +125,58 @@ audio_open(void (*cb)(void *, int))
 	return 0;
 }
 
+/* libao takes 24 bit samples only packed */
 int
-audio_setup(unsigned int bits, unsigned int rate, unsigned int channels,
-    struct pollfd *pfds, int nfds)
+audio_formats(void)
 {
-	fmt.bits = bits;
+	return PCM_S8 | PCM_S16 | PCM_S24_3;
+}
+
+unsigned int
+audio_channels(void)
+{
+	return 2;
+}
+
+int
+audio_setup(int pfmt, unsigned int rate, unsigned int channels,
+    int profile, size_t *frames, struct pollfd *pfds, int nfds)
+{
+	switch (pfmt) {
+	case PCM_S8:
+		fmt.bits = 8;
+		break;
+	case PCM_S16:
+		fmt.bits = 16;
+		break;
+	case PCM_S24_3:
+		fmt.bits = 24;
+		break;
+	default:
+		log_warnx("can't handle %s samples", pcm_name(pfmt));
+		return -1;
+	}
 	fmt.rate = rate;
 	fmt.channels = channels;
 	fmt.byte_format = AO_FMT_NATIVE;
 	fmt.matrix = NULL;
 
-	if (bits == 8)
-		bpf = 1;
-	else if (bits == 16)
-		bpf = 2;
-	else if (bits == 24 || bits == 32)
-		bpf = 4;
-	else {
-		log_warnx("can't handle %d bits", bits);
-		return -1;
+	bpf = pcm_width(pfmt) * channels;
+
+	/* ao doesn't expose the device buffer, only ours can change */
+	switch (profile) {
+	case AUDIO_LOW:
+		chunk = 1024;
+		break;
+	case AUDIO_POWERSAVE:
+		chunk = sizeof(buf);
+		break;
+	default:
+		chunk = 4096;
+		break;
 	}
+	chunk -= chunk % bpf;
+	*frames = chunk / bpf;
 
 	return 0;
 }
@@ -190,8 +225,8 @@ audio_write(const void *data, size_t len)
 	if (r == 0)
 		return 0;
 
-	if (len > sizeof(buf))
-		len = sizeof(buf);
+	if (len > chunk)
+		len = chunk;
 
 	memcpy(buf, data, len);
 	buflen = len;
@@ -223,3 +258,10 @@ audio_stop(void)
 {
 	return 0;
 }
+
+/* libao doesn't tell */
+int64_t
+audio_xruns(void)
+{
+	return -1;
+}
@@ -0,0 +1,143 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "amused.h"
+#include "log.h"
+#include "pcm.h"
+
+/*
+ * A device that takes the PCM as fast as it's given and throws it
+ * away, to measure the decoders.
+ */
+
+static void		(*onmove)(void *, int);
+static int		 nullfd = -1;
+static size_t		 bpf;
+static unsigned int	 cur_rate;
+static int64_t		 frames;
+static double		 seconds;
+
+int
+audio_open(void (*onmove_cb)(void *, int))
+{
+	/* always writable, so that poll never waits on the device */
+	if ((nullfd = open("/dev/null", O_WRONLY|O_CLOEXEC)) == -1)
+		return -1;
+
+	onmove = onmove_cb;
+	return 0;
+}
+
+int
+audio_formats(void)
+{
+	return PCM_S8 | PCM_S16 | PCM_S24_3 | PCM_S24 | PCM_S32 | PCM_F32;
+}
+
+unsigned int
+audio_channels(void)
+{
+	return 8;
+}
+
+int
+audio_setup(int fmt, unsigned int rate, unsigned int channels,
+    int profile, size_t *bufsz, struct pollfd *pfds, int nfds)
+{
+	bpf = pcm_width(fmt) * channels;
+	cur_rate = rate;
+
+	/* pretend to buffer 100ms */
+	*bufsz = rate / 10;
+	return 0;
+}
+
+int
+audio_nfds(void)
+{
+	return 1;
+}
+
+int
+audio_pollfd(struct pollfd *pfds, int nfds, int events)
+{
+	pfds[0].fd = nullfd;
+	pfds[0].events = events;
+	return 1;
+}
+
+int
+audio_revents(struct pollfd *pfds, int nfds)
+{
+	return pfds[0].revents;
+}
+
+size_t
+audio_write(const void *buf, size_t len)
+{
+	int n;
+
+	n = len / bpf;
+	frames += n;
+	seconds += (double)n / cur_rate;
+	onmove(NULL, n);
+	return len;
+}
+
+int
+audio_flush(void)
+{
+	return 0;
+}
+
+int
+audio_stop(void)
+{
+	return 0;
+}
+
+int64_t
+audio_xruns(void)
+{
+	return 0;
+}
+
+/* frames and seconds of audio played so far */
+void
+audio_null_written(int64_t *f, double *s)
+{
+	*f = frames;
+	*s = seconds;
+}
@@ -18,145 +18,294 @@ extern "C" {
 #include "config.h"
 }
 
-#include <sys/socket.h>
-
+#include <atomic>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <oboe/Oboe.h>
 
 extern "C" {
 #include "amused.h"
 #include "log.h"
+#include "pcm.h"
 }
 
 #define ext extern "C"
 
+/*
+ * How much audio is queued for the callback, in milliseconds, for
+ * AUDIO_NORMAL, AUDIO_LOW and AUDIO_POWERSAVE.
+ */
+static const int ring_ms[] = { 100, 20, 500 };
+
+/*
+ * Single-producer single-consumer ring between the player, that
+ * writes, and the oboe callback that runs in its own thread.  wr and
+ * rd only grow, so the free space is always cap - (wr - rd).
+ */
+static struct {
+	uint8_t			*buf;
+	size_t			 size;		/* allocated */
+	size_t			 cap;		/* in use */
+	std::atomic<size_t>	 wr;
+	std::atomic<size_t>	 rd;
+} ring;
+
 static void		(*onmove_cb)(void *, int);
-static int		 sp[2]; /* main, audio thread */
-static pthread_t	 at;
+static int		 wakeup[2];	/* pipe, the callback writes */
+static std::atomic<bool> waiting;	/* the player wants a wakeup */
+static std::atomic<int64_t> played;	/* frames consumed */
+static std::atomic<int64_t> underruns;	/* callbacks padded with silence */
+static int64_t		 reported;
 
 static int		 bpf;
-static unsigned int	 bits, rate, chan;
-static oboe::AudioFormat fmt;
-static char		 buf[BUFSIZ];
-static size_t		 buflen;
+static unsigned int	 cur_rate, cur_chan;
+static int		 cur_fmt;
+static int		 cur_profile;
+static int		 stopped = 1;
 
 static std::shared_ptr<oboe::AudioStream> stream;
 
-static void *
-aworker(void *d)
+class Feeder : public oboe::AudioStreamDataCallback {
+public:
+	oboe::DataCallbackResult onAudioReady(oboe::AudioStream *,
+	    void *, int32_t) override;
+};
+
+static Feeder		 feeder;
+
+oboe::DataCallbackResult
+Feeder::onAudioReady(oboe::AudioStream *s, void *data, int32_t nframes)
 {
-	unsigned int	 last_bits, last_rate, last_chan;
-	ssize_t		 r;
-	int		 sock = sp[1];
-	char		 ch;
+	uint8_t		*out = (uint8_t *)data;
+	size_t		 rd, avail, len, n, off;
+	char		 ch = 1;
+
+	rd = ring.rd.load(std::memory_order_relaxed);
+	avail = ring.wr.load(std::memory_order_acquire) - rd;
+
+	len = (size_t)nframes * bpf;
+	if (avail > len)
+		avail = len;
+	avail -= avail % bpf;
+
+	off = rd % ring.cap;
+	n = avail < ring.cap - off ? avail : ring.cap - off;
+	memcpy(out, ring.buf + off, n);
+	memcpy(out + n, ring.buf, avail - n);
+
+	/* underrun: pad with silence */
+	if (avail < len) {
+		memset(out + avail, 0, len - avail);
+		underruns.fetch_add(1, std::memory_order_relaxed);
+	}
 
-	stream = nullptr;
-	last_bits = last_rate = last_chan = 0;
-
-	log_info("%s: starting", __func__);
-	for (;;) {
-		ch = 1;
-		if ((r = write(sock, &ch, 1)) == -1)
-			fatal("write");
-		if (r == 0)
-			break;
-
-		if ((r = read(sock, &ch, 1)) == -1)
-			fatal("read");
-		if (r == 0)
-			break;
-
-		if (bits != last_bits ||
-		    rate != last_rate ||
-		    chan != last_chan) {
-			if (stream) {
-				stream->close();
-				stream = nullptr;
-			}
-
-			last_bits = bits;
-			last_rate = rate;
-			last_chan = chan;
-
-			log_debug("setting bits=%d rate=%d chan=%d bpf=%d",
-			    bits, rate, chan, bpf);
-
-			oboe::AudioStreamBuilder streamBuilder;
-			streamBuilder.setFormat(fmt);
-			streamBuilder.setSampleRate(rate);
-			streamBuilder.setChannelCount(chan);
-			oboe::Result result = streamBuilder.openStream(stream);
-			if (result != oboe::Result::OK)
-				fatalx("Error opening stream %s",
-				    oboe::convertToText(result));
-
-			stream->requestStart();
-		}
+	ring.rd.store(rd + avail, std::memory_order_release);
+	played.fetch_add(avail / bpf, std::memory_order_relaxed);
 
-		// oboe works in terms of FRAMES not BYTES!
-		unsigned int len = buflen / bpf;
+	if (avail > 0 && waiting.exchange(false))
+		(void)write(wakeup[1], &ch, 1);
 
-		// XXX should be the timeout in nanoseconds...
-		auto ret = stream->write(buf, len, 1000000000);
-		if (!ret) {
-			fatalx("write failed: %s",
-			    oboe::convertToText(ret.error()));
-		}
+	return oboe::DataCallbackResult::Continue;
+}
+
+static size_t
+ring_space(void)
+{
+	return ring.cap - (ring.wr.load(std::memory_order_relaxed) -
+	    ring.rd.load(std::memory_order_acquire));
+}
+
+/* the callback is not running, so the ring can be reset */
+static void
+ring_reset(void)
+{
+	ring.wr.store(0);
+	ring.rd.store(0);
+}
+
+/* tell the player how many frames were actually played */
+static void
+report(void)
+{
+	int64_t		 now;
+
+	now = played.load(std::memory_order_relaxed);
+	if (now != reported && onmove_cb)
+		onmove_cb(NULL, now - reported);
+	reported = now;
+}
+
+/* wait for the callback to play what's in the ring */
+static void
+ring_wait(void)
+{
+	struct pollfd	 pfd;
+	char		 buf[64];
+
+	pfd.fd = wakeup[0];
+	pfd.events = POLLIN;
+	while (!stopped && ring_space() < ring.cap) {
+		waiting.store(true);
+		if (poll(&pfd, 1, ring_ms[cur_profile]) == -1 &&
+		    errno != EINTR)
+			fatal("poll");
+		while (read(wakeup[0], buf, sizeof(buf)) > 0)
+			/* nop */ ;
+		report();
 	}
+}
+
+static void
+stream_close(void)
+{
+	if (stream == nullptr)
+		return;
+
+	/* the tail of the previous track */
+	ring_wait();
 
-	return nullptr;
+	stream->stop();
+	stream->close();
+	stream = nullptr;
+	stopped = 1;
+	ring_reset();
 }
 
 ext int
 audio_open(void (*cb)(void *, int))
 {
+	int		 i, fl;
+
 	onmove_cb = cb;
 
-	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1) {
-		log_warn("socketpair");
+	if (pipe(wakeup) == -1) {
+		log_warn("pipe");
 		return (-1);
 	}
 
-	if (pthread_create(&at, NULL, aworker, NULL) == -1) {
-		log_warn("pthread_create");
-		return (-1);
+	for (i = 0; i < 2; ++i) {
+		if ((fl = fcntl(wakeup[i], F_GETFL)) == -1 ||
+		    fcntl(wakeup[i], F_SETFL, fl | O_NONBLOCK) == -1) {
+			log_warn("fcntl");
+			return (-1);
+		}
 	}
 
 	return (0);
 }
 
+/* I24 and I32 need Android 12, openStream fails before */
 ext int
-audio_setup(unsigned int p_bits, unsigned int p_rate, unsigned int p_chan,
-    struct pollfd *pfds, int nfds)
+audio_formats(void)
 {
-	bits = p_bits;
-	rate = p_rate;
-	chan = p_chan;
+	return PCM_S16 | PCM_S24_3 | PCM_S32 | PCM_F32;
+}
 
-	if (bits == 8) {
-		log_warnx("would require a conversion layer...");
-		return (-1);
-	} else if (bits == 16) {
-		bpf = 2;
+/* Android wants the surround channels in another order */
+ext unsigned int
+audio_channels(void)
+{
+	return 2;
+}
+
+ext int
+audio_setup(int pfmt, unsigned int rate, unsigned int chan,
+    int profile, size_t *frames, struct pollfd *pfds, int nfds)
+{
+	oboe::AudioStreamBuilder builder;
+	oboe::AudioFormat	 fmt;
+	oboe::Result		 r;
+	size_t			 cap;
+	int			 width;
+
+	if (stream != nullptr && pfmt == cur_fmt && rate == cur_rate &&
+	    chan == cur_chan && profile == cur_profile)
+		goto start;
+
+	switch (pfmt) {
+	case PCM_S16:
+		width = 2;
 		fmt = oboe::AudioFormat::I16;
-	} else if (bits == 24) {
-		bpf = 4;
-		fmt = oboe::AudioFormat::I24;
-	} else if (bits == 32) {
-		// XXX not so sure...
-		bpf = 4;
+		break;
+	case PCM_S24_3:
+		width = 3;
 		fmt = oboe::AudioFormat::I24;
-	} else {
-		log_warnx("can't handle %d bits", bits);
+		break;
+	case PCM_S32:
+		width = 4;
+		fmt = oboe::AudioFormat::I32;
+		break;
+	case PCM_F32:
+		width = 4;
+		fmt = oboe::AudioFormat::Float;
+		break;
+	default:
+		log_warnx("can't handle format %d", pfmt);
+		return (-1);
+	}
+
+	stream_close();
+
+	bpf = width * chan;
+	cap = (size_t)rate * ring_ms[profile] / 1000 * bpf;
+	if (cap > ring.size) {
+		free(ring.buf);
+		ring.cap = ring.size = 0;
+		if ((ring.buf = (uint8_t *)malloc(cap)) == NULL) {
+			log_warn("malloc");
+			return (-1);
+		}
+		ring.size = cap;
+	}
+	ring.cap = cap;
+	ring_reset();
+
+	log_debug("setting fmt=%d rate=%d chan=%d bpf=%d",
+	    pfmt, rate, chan, bpf);
+
+	builder.setFormat(fmt);
+	builder.setSampleRate(rate);
+	builder.setChannelCount(chan);
+	if (profile == AUDIO_POWERSAVE)
+		builder.setPerformanceMode(oboe::PerformanceMode::PowerSaving);
+	else
+		builder.setPerformanceMode(oboe::PerformanceMode::LowLatency);
+	builder.setDataCallback(&feeder);
+	r = builder.openStream(stream);
+	if (r != oboe::Result::OK) {
+		log_warnx("error opening stream: %s", oboe::convertToText(r));
+		stream = nullptr;
 		return (-1);
 	}
 
-	bpf *= chan;
+	/* two bursts is the least that doesn't glitch */
+	if (profile == AUDIO_LOW)
+		stream->setBufferSizeInFrames(stream->getFramesPerBurst() * 2);
+
+	cur_fmt = pfmt;
+	cur_rate = rate;
+	cur_chan = chan;
+	cur_profile = profile;
 
+ start:
+	*frames = ring.cap / bpf + stream->getBufferSizeInFrames();
+
+	if (stopped) {
+		r = stream->requestStart();
+		if (r != oboe::Result::OK) {
+			log_warnx("failed to start the stream: %s",
+			    oboe::convertToText(r));
+			return (-1);
+		}
+		stopped = 0;
+	}
 	return (0);
 }
 
@@ -169,71 +318,103 @@ audio_nfds(void)
 ext int
 audio_pollfd(struct pollfd *pfds, int nfds, int events)
 {
+	char		 ch = 1;
+
 	if (nfds != 1) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	pfds[0].fd = sp[0];
+	pfds[0].fd = wakeup[0];
 	pfds[0].events = POLLIN;
+
+	/*
+	 * Ask for a wakeup, and give it to ourselves if there is
+	 * room already, in case the callback ran in between.
+	 */
+	if (events & POLLOUT) {
+		waiting.store(true);
+		if (ring_space() > 0 && waiting.exchange(false))
+			(void)write(wakeup[1], &ch, 1);
+	}
 	return (0);
 }
 
 ext int
 audio_revents(struct pollfd *pfds, int nfds)
 {
+	char		 buf[64];
+
 	if (nfds != 1) {
 		log_warnx("%s: called with %d nfds", __func__, nfds);
 		return 0;
 	}
 
-	/* don't need to check; if we're here the audio thread is ready */
-	return POLLOUT;
+	if (pfds[0].revents & POLLIN)
+		while (read(wakeup[0], buf, sizeof(buf)) > 0)
+			/* nop */ ;
+
+	report();
+
+	if (ring_space() >= (size_t)bpf)
+		return POLLOUT;
+	return 0;
 }
 
 ext size_t
 audio_write(const void *data, size_t len)
 {
-	char	ch;
-	ssize_t	r;
+	const uint8_t	*p = (const uint8_t *)data;
+	size_t		 wr, space, off, n;
 
-	if ((r = read(sp[0], &ch, 1)) == -1) {
-		log_warn("oboe/%s: read failed", __func__);
-		return 0;
-	}
-	if (r == 0)
+	if (ring.cap == 0)
 		return 0;
 
-	if (len > sizeof(buf))
-		len = sizeof(buf);
-
-	memcpy(buf, data, len);
-	buflen = len;
-
-	ch = 1;
-	if ((r = write(sp[0], &ch, 1)) == -1) {
-		log_warn("oboe/%s: write failed", __func__);
-		return 0;
-	}
-	if (r == 0) {
-		log_warnx("oboe/%s: write got EOF", __func__);
-		return 0;
-	}
+	space = ring_space();
+	if (len > space)
+		len = space;
+	len -= len % bpf;
 
-	if (onmove_cb)
-		onmove_cb(NULL, len / bpf);
+	wr = ring.wr.load(std::memory_order_relaxed);
+	off = wr % ring.cap;
+	n = len < ring.cap - off ? len : ring.cap - off;
+	memcpy(ring.buf + off, p, n);
+	memcpy(ring.buf, p + n, len - n);
+	ring.wr.store(wr + len, std::memory_order_release);
 
+	report();
 	return len;
 }
 
 ext int
 audio_flush(void)
 {
-	return 0; // XXX request flush
+	if (stream == nullptr || stopped)
+		return 0;
+
+	/* once paused the callback is not called anymore */
+	stream->pause();
+	stream->flush();
+	stopped = 1;
+	ring_reset();
+	return 0;
 }
 
 ext int
 audio_stop(void)
 {
-	return 0; // XXX request stop
+	if (stream == nullptr || stopped)
+		return 0;
+
+	stream->stop();
+	stopped = 1;
+	ring_reset();
+	return 0;
+}
+
+/* the ring running dry at the end of the queue counts too */
+ext int64_t
+audio_xruns(void)
+{
+	return underruns.load(std::memory_order_relaxed);
 }
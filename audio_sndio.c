@@ -20,14 +20,18 @@
 #include <limits.h>
 #include <poll.h>
 #include <sndio.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "amused.h"
 #include "log.h"
+#include "pcm.h"
 
 static struct sio_hdl		*hdl;
 static struct sio_par		 par;
 static int			 stopped = 1;
+static int			 cur_profile = -1;
+static int			 cur_fmt;
 
 int
 audio_open(void (*onmove_cb)(void *, int))
@@ -39,17 +43,54 @@ audio_open(void (*onmove_cb)(void *, int))
 	return 0;
 }
 
+/* sndiod converts to what the hardware wants */
 int
-audio_setup(unsigned int bits, unsigned int rate, unsigned int channels,
-    struct pollfd *pfds, int nfds)
+audio_formats(void)
 {
+	return PCM_S8 | PCM_S16 | PCM_S24_3 | PCM_S24 | PCM_S32;
+}
+
+/* sndiod joins the channels the device doesn't have */
+unsigned int
+audio_channels(void)
+{
+	return 8;
+}
+
+int
+audio_setup(int fmt, unsigned int rate, unsigned int channels,
+    int profile, size_t *bufsz, struct pollfd *pfds, int nfds)
+{
+	unsigned int	 bits, bps;
 	int		 fpct;
 
+	switch (fmt) {
+	case PCM_S8:
+		bits = 8;
+		break;
+	case PCM_S16:
+		bits = 16;
+		break;
+	case PCM_S24_3:
+	case PCM_S24:
+		bits = 24;
+		break;
+	case PCM_S32:
+		bits = 32;
+		break;
+	default:
+		log_warnx("can't handle %s samples", pcm_name(fmt));
+		return -1;
+	}
+	bps = pcm_width(fmt);
+
 	fpct = (rate * 5) / 100;
 
 	/* don't stop if the parameters are the same */
-	if (bits == par.bits && channels == par.pchan &&
-	    par.rate - fpct <= rate && rate <= par.rate + fpct) {
+	if (fmt == cur_fmt && channels == par.pchan &&
+	    par.rate - fpct <= rate && rate <= par.rate + fpct &&
+	    profile == cur_profile) {
+		*bufsz = par.bufsz;
 		if (stopped)
 			goto start;
 		return 0;
@@ -61,10 +102,25 @@ audio_setup(unsigned int bits, unsigned int rate, unsigned int channels,
 		stopped = 1;
 	}
 
+	cur_fmt = 0;
 	sio_initpar(&par);
 	par.bits = bits;
+	par.bps = bps;
+	par.sig = 1;
+	par.le = SIO_LE_NATIVE;
+	par.msb = 0;
 	par.rate = rate;
 	par.pchan = channels;
+	switch (profile) {
+	case AUDIO_LOW:
+		par.appbufsz = rate / 20;	/* 50ms */
+		par.round = rate / 200;		/* 5ms */
+		break;
+	case AUDIO_POWERSAVE:
+		par.appbufsz = rate * 2;	/* 2s */
+		par.round = rate / 4;		/* 250ms */
+		break;
+	}
 	if (!sio_setpar(hdl, &par)) {
 		if (errno == EAGAIN) {
 			sio_pollfd(hdl, pfds, POLLOUT);
@@ -72,8 +128,8 @@ audio_setup(unsigned int bits, unsigned int rate, unsigned int channels,
 				fatal("poll");
 			goto again;
 		}
-		log_warnx("invalid params (bits=%u, rate=%u, channels=%u)",
-		    bits, rate, channels);
+		log_warnx("invalid params (fmt=%s, rate=%u, channels=%u)",
+		    pcm_name(fmt), rate, channels);
 		return -1;
 	}
 	if (!sio_getpar(hdl, &par)) {
@@ -81,13 +137,17 @@ audio_setup(unsigned int bits, unsigned int rate, unsigned int channels,
 		return -1;
 	}
 
-	if (par.bits != bits || par.pchan != channels) {
+	if (par.bits != bits || par.bps != bps || par.pchan != channels) {
 		log_warnx("failed to set params");
 		return -1;
 	}
 
 	/* TODO: check sample rate? */
 
+	cur_fmt = fmt;
+	cur_profile = profile;
+	*bufsz = par.bufsz;
+
  start:
 	if (!sio_start(hdl)) {
 		log_warn("sio_start");
@@ -134,3 +194,10 @@ audio_stop(void)
 	stopped = 1;
 	return sio_stop(hdl);
 }
+
+/* sndio doesn't tell */
+int64_t
+audio_xruns(void)
+{
+	return -1;
+}
@@ -0,0 +1,768 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#if defined(__OpenBSD__)
+#include <sys/sysctl.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "amused.h"
+#include "ev.h"
+#include "log.h"
+#include "xmalloc.h"
+
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/*
+ * Load generator for the daemon and amused-web: a number of clients
+ * of each kind issue their request every few milliseconds, or just
+ * listen for the events, all in one process.  The latency of the
+ * events is measured from the last request that caused them.
+ */
+
+enum {
+	B_STATUS,
+	B_JUMP,
+	B_LOAD,
+	B_MONITOR,
+	B_WS,
+	B__LAST,
+};
+
+struct kind {
+	const char	*name;
+	int		 n;
+	int		 ival;		/* msec between the requests */
+	uint64_t	 ops;		/* or events received */
+	uint64_t	 errors;
+	uint64_t	 skipped;	/* still waiting for the last one */
+	uint32_t	*lat;		/* usec */
+	size_t		 nlat;
+	size_t		 caplat;
+};
+
+struct bclient {
+	int		 kind;
+	int		 fd;
+	struct imsgbuf	 ibuf;
+	int64_t		 sent;		/* request in flight, or 0 */
+	struct timeval	 tv;
+
+	/* websocket */
+	char		*buf;
+	size_t		 len;
+	size_t		 cap;
+	int		 upgraded;
+};
+
+static struct kind kinds[B__LAST] = {
+	[B_STATUS] =	{ .name = "status" },
+	[B_JUMP] =	{ .name = "jump" },
+	[B_LOAD] =	{ .name = "load" },
+	[B_MONITOR] =	{ .name = "monitor" },
+	[B_WS] =	{ .name = "websocket" },
+};
+
+static struct bclient	*clients;
+static int		 nclients;
+static const char	*pattern = ".";
+static int		 npaths = 100;
+
+/* when the last request of each kind was sent */
+static int64_t		 last_jump;
+static int64_t		 last_commit;
+
+static __dead void
+bench_usage(void)
+{
+	fprintf(stderr, "usage: %s [-d seconds] [-J pattern] [-j n:msec] "
+	    "[-l n:msec] [-m n]\n"
+	    "\t[-n paths] [-p n:msec] [-s socket] [-W [host:]port] [-w n]\n",
+	    getprogname());
+	exit(1);
+}
+
+static int64_t
+now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		fatal("clock_gettime");
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+record(struct kind *k, int64_t since)
+{
+	int64_t d;
+
+	if (since == 0)
+		return;
+
+	if (k->nlat == k->caplat) {
+		k->caplat = k->caplat ? k->caplat * 2 : 1024;
+		k->lat = xreallocarray(k->lat, k->caplat, sizeof(*k->lat));
+	}
+
+	d = now() - since;
+	k->lat[k->nlat++] = d > UINT32_MAX ? UINT32_MAX : d;
+}
+
+/* the process on the other end of the control socket */
+static pid_t
+peer_pid(int fd)
+{
+#if defined(SO_PEERCRED) && defined(__linux__)
+	struct ucred		cr;
+	socklen_t		len = sizeof(cr);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cr, &len) == -1)
+		return -1;
+	return cr.pid;
+#elif defined(SO_PEERCRED) && defined(__OpenBSD__)
+	struct sockpeercred	cr;
+	socklen_t		len = sizeof(cr);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cr, &len) == -1)
+		return -1;
+	return cr.pid;
+#else
+	return -1;
+#endif
+}
+
+/* cpu time of pid in seconds, or -1 if it can't be known */
+static double
+proc_cputime(pid_t pid)
+{
+#if defined(__linux__)
+	FILE		*fp;
+	char		 path[64], line[1024], *p;
+	unsigned long	 utime, stime;
+
+	if (pid == -1)
+		return -1;
+
+	(void)snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+	p = fgets(line, sizeof(line), fp);
+	fclose(fp);
+
+	/* the name may contain spaces; fields 14 and 15, in ticks */
+	if (p == NULL || (p = strrchr(line, ')')) == NULL ||
+	    sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+	    "%lu %lu", &utime, &stime) != 2)
+		return -1;
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+#elif defined(__OpenBSD__)
+	struct kinfo_proc	 kp;
+	size_t			 len = sizeof(kp);
+	int			 mib[6];
+
+	if (pid == -1)
+		return -1;
+
+	mib[0] = CTL_KERN;
+	mib[1] = KERN_PROC;
+	mib[2] = KERN_PROC_PID;
+	mib[3] = pid;
+	mib[4] = sizeof(kp);
+	mib[5] = 1;
+	if (sysctl(mib, 6, &kp, &len, NULL, 0) == -1 || len == 0)
+		return -1;
+	return kp.p_uutime_sec + kp.p_uutime_usec / 1e6 +
+	    kp.p_ustime_sec + kp.p_ustime_usec / 1e6;
+#else
+	return -1;
+#endif
+}
+
+static int
+connect_unix(const char *path)
+{
+	struct sockaddr_un	 sa;
+	int			 fd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlcpy(sa.sun_path, path, sizeof(sa.sun_path)) >=
+	    sizeof(sa.sun_path))
+		fatalx("socket path too long: %s", path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		fatal("socket");
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+		fatal("can't connect to %s", path);
+	return fd;
+}
+
+static int
+connect_tcp(const char *host, const char *port)
+{
+	struct addrinfo	 hints, *res, *res0;
+	int		 error, fd = -1, save_errno;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(host, port, &hints, &res0)) != 0)
+		fatalx("%s:%s: %s", host, port, gai_strerror(error));
+
+	for (res = res0; res != NULL; res = res->ai_next) {
+		fd = socket(res->ai_family, res->ai_socktype,
+		    res->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (connect(fd, res->ai_addr, res->ai_addrlen) == 0)
+			break;
+		save_errno = errno;
+		close(fd);
+		errno = save_errno;
+		fd = -1;
+	}
+	freeaddrinfo(res0);
+
+	if (fd == -1)
+		fatal("can't connect to %s:%s", host, port);
+	return fd;
+}
+
+static void	client_ev(int, int, void *);
+
+static void
+client_event_add(struct bclient *c)
+{
+	int events = POLLIN;
+
+	if (c->kind != B_WS && c->ibuf.w.queued)
+		events |= POLLOUT;
+	if (ev_add(c->fd, events, client_ev, c) == -1)
+		fatal("ev_add");
+}
+
+static void
+client_compose(struct bclient *c, int type, const void *data, size_t len)
+{
+	if (imsg_compose(&c->ibuf, type, 0, 0, -1, data, len) == -1)
+		fatal("imsg_compose");
+}
+
+/* queue the fake paths of a load, in IMSG_CTL_ADD_BATCH */
+static void
+client_load(struct bclient *c)
+{
+	struct ibuf	*buf = NULL;
+	char		 path[PATH_MAX];
+	ssize_t		 off = -1;
+	uint16_t	 len;
+	int		 i;
+
+	for (i = 0; i < npaths; ++i) {
+		len = snprintf(path, sizeof(path),
+		    "/amused-bench/%d/track%06d.flac", c->fd, i) + 1;
+		if (buf != NULL &&
+		    ibuf_size(buf) + sizeof(len) + len > MAX_IMSGSIZE) {
+			imsg_close(&c->ibuf, buf);
+			buf = NULL;
+		}
+		if (buf == NULL &&
+		    (buf = imsg_create(&c->ibuf, IMSG_CTL_ADD_BATCH, 0, 0,
+		    MAX_IMSGSIZE - IMSG_HEADER_SIZE)) == NULL)
+			fatal("imsg_create");
+		if (imsg_add(buf, &len, sizeof(len)) == -1 ||
+		    imsg_add(buf, path, len) == -1)
+			fatal("imsg_add");
+	}
+	if (buf != NULL)
+		imsg_close(&c->ibuf, buf);
+
+	client_compose(c, IMSG_CTL_COMMIT, &off, sizeof(off));
+	last_commit = now();
+}
+
+static void
+client_tick(int fd, int event, void *arg)
+{
+	struct bclient	*c = arg;
+	struct kind	*k = &kinds[c->kind];
+	char		 path[PATH_MAX];
+
+	if (ev_timer(&c->tv, client_tick, c) == 0)
+		fatal("ev_timer");
+
+	if (c->sent != 0) {
+		k->skipped++;
+		return;
+	}
+
+	c->sent = now();
+	switch (c->kind) {
+	case B_STATUS:
+		client_compose(c, IMSG_CTL_STATUS, NULL, 0);
+		break;
+	case B_JUMP:
+		memset(path, 0, sizeof(path));
+		strlcpy(path, pattern, sizeof(path));
+		client_compose(c, IMSG_CTL_JUMP, path, sizeof(path));
+		last_jump = c->sent;
+		break;
+	case B_LOAD:
+		client_compose(c, IMSG_CTL_BEGIN, NULL, 0);
+		break;
+	}
+	client_event_add(c);
+}
+
+static void
+client_done(struct bclient *c, int err)
+{
+	struct kind *k = &kinds[c->kind];
+
+	k->ops++;
+	if (err)
+		k->errors++;
+	else
+		record(k, c->sent);
+	c->sent = 0;
+}
+
+static void
+client_imsg(struct bclient *c, struct imsg *imsg)
+{
+	struct kind		*k = &kinds[c->kind];
+	struct player_event	 ev;
+	int			 type;
+
+	type = imsg_get_type(imsg);
+	if (type == IMSG_CTL_ERR) {
+		client_done(c, 1);
+		return;
+	}
+
+	switch (c->kind) {
+	case B_STATUS:
+	case B_JUMP:
+		if (type == IMSG_CTL_STATUS)
+			client_done(c, 0);
+		break;
+	case B_LOAD:
+		if (type == IMSG_CTL_BEGIN)
+			client_load(c);
+		else if (type == IMSG_CTL_COMMIT)
+			client_done(c, 0);
+		break;
+	case B_MONITOR:
+		if (type != IMSG_CTL_MONITOR ||
+		    imsg_get_data(imsg, &ev, sizeof(ev)) == -1)
+			break;
+		k->ops++;
+		if (ev.event == IMSG_CTL_JUMP)
+			record(k, last_jump);
+		else if (ev.event == IMSG_CTL_COMMIT)
+			record(k, last_commit);
+		break;
+	}
+}
+
+/* count the events in the frames sent by amused-web */
+static void
+client_ws(struct bclient *c)
+{
+	struct kind	*k = &kinds[c->kind];
+	uint8_t		*p;
+	uint64_t	 plen;
+	size_t		 hlen, i;
+	char		*end;
+
+	if (!c->upgraded) {
+		if ((end = memmem(c->buf, c->len, "\r\n\r\n", 4)) == NULL)
+			return;
+		if (strncmp(c->buf, "HTTP/1.1 101", 12) != 0)
+			fatalx("websocket handshake refused");
+		c->upgraded = 1;
+		hlen = end + 4 - c->buf;
+		memmove(c->buf, c->buf + hlen, c->len - hlen);
+		c->len -= hlen;
+	}
+
+	while (c->len >= 2) {
+		p = (uint8_t *)c->buf;
+		hlen = 2;
+		plen = p[1] & 0x7F;
+		if (plen == 126) {
+			if (c->len < 4)
+				return;
+			plen = (p[2] << 8) | p[3];
+			hlen = 4;
+		} else if (plen == 127) {
+			if (c->len < 10)
+				return;
+			for (plen = 0, i = 2; i < 10; ++i)
+				plen = (plen << 8) | p[i];
+			hlen = 10;
+		}
+		if (p[1] & 0x80)
+			hlen += 4;
+		if (c->len - hlen < plen)
+			return;
+
+		switch (p[0] & 0x0F) {
+		case 0x1:	/* text, one event per line */
+			k->ops++;
+			for (i = 0; i < plen; ++i)
+				if (p[hlen + i] == '\n')
+					k->ops++;
+			record(k, MAX(last_jump, last_commit));
+			break;
+		case 0x8:	/* close */
+			fatalx("websocket closed by amused-web");
+		}
+
+		memmove(c->buf, c->buf + hlen + plen, c->len - hlen - plen);
+		c->len -= hlen + plen;
+	}
+}
+
+static void
+client_ev(int fd, int event, void *arg)
+{
+	struct bclient	*c = arg;
+	struct imsg	 imsg;
+	ssize_t		 n;
+
+	if (c->kind == B_WS) {
+		if (c->cap - c->len < BUFSIZ) {
+			c->cap = c->cap * 2 + BUFSIZ;
+			c->buf = xreallocarray(c->buf, c->cap, 1);
+		}
+		n = read(fd, c->buf + c->len, c->cap - c->len);
+		if (n == -1 && errno == EAGAIN)
+			return;
+		if (n <= 0)
+			fatalx("amused-web closed the connection");
+		c->len += n;
+		client_ws(c);
+		return;
+	}
+
+	if (event & POLLIN) {
+		if ((n = imsg_read(&c->ibuf)) == -1 && errno != EAGAIN)
+			fatal("imsg_read");
+		if (n == 0)
+			fatalx("the daemon closed the connection");
+	}
+	if (event & POLLOUT) {
+		if (msgbuf_write(&c->ibuf.w) <= 0 && errno != EAGAIN)
+			fatal("msgbuf_write");
+	}
+
+	for (;;) {
+		if ((n = imsg_get(&c->ibuf, &imsg)) == -1)
+			fatal("imsg_get");
+		if (n == 0)
+			break;
+		client_imsg(c, &imsg);
+		imsg_free(&imsg);
+	}
+
+	client_event_add(c);
+}
+
+static void
+parse_clients(const char *s, struct kind *k)
+{
+	const char	*errstr;
+	char		*t, *ival;
+
+	t = xstrdup(s);
+	if ((ival = strchr(t, ':')) != NULL)
+		*ival++ = '\0';
+
+	k->n = strtonum(t, 0, 10000, &errstr);
+	if (errstr != NULL)
+		fatalx("number of %s clients is %s: %s", k->name, errstr, t);
+
+	if (ival != NULL) {
+		k->ival = strtonum(ival, 1, 3600000, &errstr);
+		if (errstr != NULL)
+			fatalx("%s interval is %s: %s", k->name, errstr, ival);
+	}
+	free(t);
+}
+
+static int
+latcmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile(struct kind *k, int p)
+{
+	if (k->nlat == 0)
+		return 0;
+	return k->lat[(k->nlat - 1) * p / 100] / 1000.0;
+}
+
+static void
+report(double secs, pid_t pid, double cpu)
+{
+	struct kind	*k;
+	int		 i;
+
+	printf("%-10s %7s %6s %9s %7s %7s %9s %9s %9s %9s\n", "kind",
+	    "clients", "msec", "ops", "errors", "skipped", "p50", "p90",
+	    "p99", "max");
+	for (i = 0; i < B__LAST; ++i) {
+		k = &kinds[i];
+		if (k->n == 0)
+			continue;
+		qsort(k->lat, k->nlat, sizeof(*k->lat), latcmp);
+		printf("%-10s %7d %6d %9llu %7llu %7llu %9.3f %9.3f %9.3f "
+		    "%9.3f\n", k->name, k->n, k->ival,
+		    (unsigned long long)k->ops, (unsigned long long)k->errors,
+		    (unsigned long long)k->skipped, percentile(k, 50),
+		    percentile(k, 90), percentile(k, 99), percentile(k, 100));
+	}
+
+	printf("\n%.1f seconds, latencies in milliseconds\n", secs);
+	if (cpu >= 0)
+		printf("daemon (pid %d) cpu: %.1f%%\n", (int)pid,
+		    100 * cpu / secs);
+	else
+		printf("daemon cpu: unknown\n");
+}
+
+static void
+bench_stop(int fd, int event, void *arg)
+{
+	ev_break();
+}
+
+static void
+raise_nofile(void)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		return;
+	rl.rlim_cur = rl.rlim_max;
+	(void)setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct player_monitor	 mon;
+	struct bclient		*c;
+	struct kind		*k;
+	struct timeval		 tv;
+	const char		*errstr, *host = "localhost", *port = "9090";
+	const char		*tmpdir;
+	char			*sock = NULL, *webaddr = NULL, *s;
+	int64_t			 start;
+	double			 cpu0, cpu1;
+	pid_t			 pid = -1;
+	int			 ch, i, j, duration = 10, fd, def;
+
+	log_init(1, LOG_DAEMON);
+	log_setverbose(0);
+
+	kinds[B_STATUS].ival = 100;
+	kinds[B_JUMP].ival = 1000;
+	kinds[B_LOAD].ival = 5000;
+
+	while ((ch = getopt(argc, argv, "d:J:j:l:m:n:p:s:W:w:")) != -1) {
+		switch (ch) {
+		case 'd':
+			duration = strtonum(optarg, 1, 86400, &errstr);
+			if (errstr != NULL)
+				fatalx("duration is %s: %s", errstr, optarg);
+			break;
+		case 'J':
+			pattern = optarg;
+			break;
+		case 'j':
+			parse_clients(optarg, &kinds[B_JUMP]);
+			break;
+		case 'l':
+			parse_clients(optarg, &kinds[B_LOAD]);
+			break;
+		case 'm':
+			parse_clients(optarg, &kinds[B_MONITOR]);
+			break;
+		case 'n':
+			npaths = strtonum(optarg, 1, 1000000, &errstr);
+			if (errstr != NULL)
+				fatalx("paths are %s: %s", errstr, optarg);
+			break;
+		case 'p':
+			parse_clients(optarg, &kinds[B_STATUS]);
+			break;
+		case 's':
+			free(sock);
+			sock = xstrdup(optarg);
+			break;
+		case 'W':
+			free(webaddr);
+			webaddr = xstrdup(optarg);
+			break;
+		case 'w':
+			parse_clients(optarg, &kinds[B_WS]);
+			break;
+		default:
+			bench_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 0)
+		bench_usage();
+
+	/* with no options, poll the status and watch the events */
+	for (def = 1, i = 0; i < B__LAST; ++i)
+		if (kinds[i].n != 0)
+			def = 0;
+	if (def) {
+		kinds[B_STATUS].n = 10;
+		kinds[B_MONITOR].n = 10;
+	}
+
+	if (sock == NULL) {
+		if ((tmpdir = getenv("TMPDIR")) == NULL)
+			tmpdir = "/tmp";
+		xasprintf(&sock, "%s/amused-%d", tmpdir, getuid());
+	}
+
+	if (webaddr != NULL) {
+		if ((s = strrchr(webaddr, ':')) != NULL) {
+			*s = '\0';
+			host = webaddr;
+			port = s + 1;
+		} else
+			port = webaddr;
+	}
+
+	raise_nofile();
+	signal(SIGPIPE, SIG_IGN);
+	if (ev_init() == -1)
+		fatal("ev_init");
+
+	for (i = 0; i < B__LAST; ++i)
+		nclients += kinds[i].n;
+	clients = xcalloc(nclients, sizeof(*clients));
+
+	for (c = clients, i = 0; i < B__LAST; ++i) {
+		k = &kinds[i];
+		for (j = 0; j < k->n; ++j, ++c) {
+			c->kind = i;
+			if (i == B_WS) {
+				fd = connect_tcp(host, port);
+				dprintf(fd, "GET /ws HTTP/1.1\r\n"
+				    "Host: %s\r\n"
+				    "Upgrade: websocket\r\n"
+				    "Connection: Upgrade\r\n"
+				    "Sec-WebSocket-Key: "
+				    "dGhlIHNhbXBsZSBub25jZQ==\r\n"
+				    "Sec-WebSocket-Version: 13\r\n"
+				    "\r\n", host);
+			} else {
+				fd = connect_unix(sock);
+				if (pid == -1)
+					pid = peer_pid(fd);
+			}
+			if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+				fatal("fcntl");
+			c->fd = fd;
+			imsg_init(&c->ibuf, fd);
+
+			if (i == B_MONITOR) {
+				memset(&mon, 0, sizeof(mon));
+				mon.mask = ~0ULL;
+				client_compose(c, IMSG_CTL_MONITOR, &mon,
+				    sizeof(mon));
+			}
+
+			if (i == B_STATUS || i == B_JUMP || i == B_LOAD) {
+				c->tv.tv_sec = k->ival / 1000;
+				c->tv.tv_usec = (k->ival % 1000) * 1000;
+
+				/* spread the clients over the interval */
+				tv.tv_sec = 0;
+				tv.tv_usec = (int64_t)k->ival * 1000 * j / k->n;
+				while (tv.tv_usec >= 1000000) {
+					tv.tv_sec++;
+					tv.tv_usec -= 1000000;
+				}
+				if (ev_timer(&tv, client_tick, c) == 0)
+					fatal("ev_timer");
+			}
+
+			client_event_add(c);
+		}
+	}
+
+	tv.tv_sec = duration;
+	tv.tv_usec = 0;
+	if (ev_timer(&tv, bench_stop, NULL) == 0)
+		fatal("ev_timer");
+	ev_signal(SIGINT, bench_stop, NULL);
+	ev_signal(SIGTERM, bench_stop, NULL);
+
+	cpu0 = proc_cputime(pid);
+	start = now();
+	ev_loop();
+	cpu1 = proc_cputime(pid);
+
+	report((now() - start) / 1e6, pid,
+	    cpu0 >= 0 && cpu1 >= 0 ? cpu1 - cpu0 : -1);
+	return 0;
+}
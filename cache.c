@@ -0,0 +1,239 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "amused.h"
+#include "cache.h"
+#include "log.h"
+#include "xmalloc.h"
+
+#define CACHE_MAGIC	"amusedix"
+#define CACHE_VERSION	1
+#define CACHE_MAX	1024	/* entries */
+
+struct cache_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	reclen;
+};
+
+struct cache_key {
+	uint64_t	dev;
+	uint64_t	ino;
+	int64_t		size;
+	int64_t		mtime;
+};
+
+/* on-disk record, stored in fixed-size slots after the header */
+struct cache_rec {
+	struct cache_key	key;
+	struct track_index	index;
+};
+
+static int		 cachefd = -1;
+static struct cache_key	 keys[CACHE_MAX];
+static size_t		 nkeys;
+static size_t		 victim;
+
+static void
+cache_key(struct cache_key *key, const struct stat *sb)
+{
+	memset(key, 0, sizeof(*key));
+	key->dev = sb->st_dev;
+	key->ino = sb->st_ino;
+	key->size = sb->st_size;
+	key->mtime = sb->st_mtime;
+}
+
+static off_t
+cache_slot(size_t i)
+{
+	return sizeof(struct cache_hdr) + i * sizeof(struct cache_rec);
+}
+
+static int
+cache_reset(void)
+{
+	struct cache_hdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CACHE_VERSION;
+	hdr.reclen = sizeof(struct cache_rec);
+
+	nkeys = 0;
+	if (ftruncate(cachefd, 0) == -1 ||
+	    pwrite(cachefd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		return -1;
+	return 0;
+}
+
+static int
+cache_load(void)
+{
+	struct cache_hdr hdr;
+	struct cache_rec rec;
+	ssize_t r;
+
+	r = pread(cachefd, &hdr, sizeof(hdr), 0);
+	if (r != sizeof(hdr) ||
+	    memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != CACHE_VERSION ||
+	    hdr.reclen != sizeof(struct cache_rec))
+		return cache_reset();
+
+	for (nkeys = 0; nkeys < CACHE_MAX; ++nkeys) {
+		r = pread(cachefd, &rec, sizeof(rec), cache_slot(nkeys));
+		if (r != sizeof(rec))
+			break;
+		keys[nkeys] = rec.key;
+	}
+	return 0;
+}
+
+/*
+ * Called before pledge: the file is kept open and later only read
+ * and written through pread/pwrite.  On failure the cache is just
+ * disabled.
+ */
+void
+cache_init(void)
+{
+	const char	*dir, *home;
+	char		 path[PATH_MAX];
+	int		 r;
+
+	if ((dir = getenv("XDG_CACHE_HOME")) != NULL && *dir != '\0')
+		r = snprintf(path, sizeof(path), "%s", dir);
+	else if ((home = getenv("HOME")) != NULL && *home != '\0')
+		r = snprintf(path, sizeof(path), "%s/.cache", home);
+	else
+		return;
+	if (r < 0 || (size_t)r >= sizeof(path))
+		return;
+
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+		log_warn("mkdir %s", path);
+		return;
+	}
+
+	if (strlcat(path, "/amused.index", sizeof(path)) >= sizeof(path))
+		return;
+
+	if ((cachefd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) == -1) {
+		log_warn("open %s", path);
+		return;
+	}
+
+	if (cache_load() == -1) {
+		log_warn("can't initialize %s", path);
+		close(cachefd);
+		cachefd = -1;
+		return;
+	}
+
+	log_debug("%s: %zu entries in %s", __func__, nkeys, path);
+}
+
+static ssize_t
+cache_find(const struct cache_key *key, int inode_only)
+{
+	size_t i;
+
+	for (i = 0; i < nkeys; ++i) {
+		if (keys[i].dev != key->dev || keys[i].ino != key->ino)
+			continue;
+		if (inode_only || (keys[i].size == key->size &&
+		    keys[i].mtime == key->mtime))
+			return i;
+	}
+	return -1;
+}
+
+int
+cache_lookup(const struct stat *sb, struct track_index *index)
+{
+	struct cache_key key;
+	struct cache_rec rec;
+	ssize_t i;
+
+	if (cachefd == -1)
+		return -1;
+
+	cache_key(&key, sb);
+	if ((i = cache_find(&key, 0)) == -1)
+		return -1;
+
+	if (pread(cachefd, &rec, sizeof(rec), cache_slot(i)) != sizeof(rec) ||
+	    memcmp(&rec.key, &key, sizeof(key)) != 0 ||
+	    rec.index.nseek > TRACK_NSEEK)
+		return -1;
+
+	memcpy(index, &rec.index, sizeof(*index));
+	return 0;
+}
+
+void
+cache_store(const struct stat *sb, const struct track_index *index)
+{
+	struct cache_rec rec;
+	ssize_t i;
+
+	if (cachefd == -1)
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	cache_key(&rec.key, sb);
+	memcpy(&rec.index, index, sizeof(rec.index));
+
+	/* a file that changed takes the place of its old entry */
+	if ((i = cache_find(&rec.key, 1)) == -1) {
+		if (nkeys < CACHE_MAX)
+			i = nkeys++;
+		else {
+			i = victim;
+			victim = (victim + 1) % CACHE_MAX;
+		}
+	}
+
+	keys[i] = rec.key;
+	if (pwrite(cachefd, &rec, sizeof(rec), cache_slot(i)) != sizeof(rec))
+		log_warn("%s: pwrite", __func__);
+}
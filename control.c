@@ -30,6 +30,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,6 +41,7 @@
 #include "log.h"
 #include "control.h"
 #include "playlist.h"
+#include "status.h"
 
 #define	CONTROL_BACKLOG	5
 
@@ -47,12 +49,24 @@ struct {
 	int		fd;
 	struct playlist	play;
 	int		tx;
+	unsigned int	pause;
 } control_state = {.fd = -1, .tx = -1};
 
 struct ctl_conn {
 	TAILQ_ENTRY(ctl_conn)	entry;
 	int			monitor; /* 1 if client is in monitor mode */
 	struct imsgev		iev;
+
+	/* monitor subscription */
+	uint64_t		mask;
+	uint32_t		coalesce;
+	int			oldev;	/* send only PLAYER_EVENT_OLDSIZE */
+	unsigned int		timer;
+
+	/* changes not yet delivered and the coalesced event */
+	struct playlist_delta	delta;
+	int			haspending;
+	struct player_event	pending;
 };
 
 TAILQ_HEAD(ctl_conns, ctl_conn)	ctl_conns = TAILQ_HEAD_INITIALIZER(ctl_conns);
@@ -113,6 +127,7 @@ control_init(char *path)
 static void
 enable_accept(int fd, int ev, void *bula)
 {
+	control_state.pause = 0;
 	ev_add(control_state.fd, POLLIN, control_accept, NULL);
 }
 
@@ -150,7 +165,8 @@ control_accept(int listenfd, int event, void *bula)
 			struct timeval evtpause = { 1, 0 };
 
 			ev_del(control_state.fd);
-			ev_timer(&evtpause, enable_accept, NULL);
+			control_state.pause = ev_timer(&evtpause,
+			    enable_accept, NULL);
 		} else if (errno != EWOULDBLOCK && errno != EINTR &&
 		    errno != ECONNABORTED)
 			log_warn("%s: accept4", __func__);
@@ -175,6 +191,7 @@ control_accept(int listenfd, int event, void *bula)
 	ev_add(c->iev.imsgbuf.fd, c->iev.events, c->iev.handler, &c->iev);
 
 	TAILQ_INSERT_TAIL(&ctl_conns, c, entry);
+	stats.clients++;
 }
 
 struct ctl_conn *
@@ -221,24 +238,76 @@ control_close(int fd)
 
 	msgbuf_clear(&c->iev.imsgbuf.w);
 	TAILQ_REMOVE(&ctl_conns, c, entry);
+	stats.clients--;
+	if (c->monitor)
+		stats.monitors--;
 
+	ev_timer_cancel(c->timer);
 	ev_del(c->iev.imsgbuf.fd);
 	close(c->iev.imsgbuf.fd);
 
 	/* Some file descriptors are available again. */
-	if (ev_timer_pending()) {
-		ev_timer(NULL, NULL, NULL);
-		ev_add(control_state.fd, POLLIN, control_accept, NULL);
-	}
+	if (ev_timer_cancel(control_state.pause))
+		enable_accept(-1, 0, NULL);
 
 	free(c);
 }
 
+static void
+monitor_send(struct ctl_conn *c, struct player_event *ev)
+{
+	ev->change = c->delta.change;
+	ev->base = c->delta.base;
+	ev->gen = c->delta.gen;
+	ev->first = c->delta.first;
+	ev->count = c->delta.count;
+
+	imsg_compose_event(&c->iev, IMSG_CTL_MONITOR, 0, 0, -1,
+	    ev, c->oldev ? PLAYER_EVENT_OLDSIZE : sizeof(*ev));
+	stats.fanout++;
+
+	memset(&c->delta, 0, sizeof(c->delta));
+	c->delta.base = ev->gen;
+	c->delta.gen = ev->gen;
+}
+
+static void	monitor_flush(int, int, void *);
+
+/* hold back the events of c for the rest of the coalesce window */
+static void
+monitor_arm(struct ctl_conn *c)
+{
+	struct timeval	 tv;
+
+	tv.tv_sec = c->coalesce / 1000;
+	tv.tv_usec = (c->coalesce % 1000) * 1000;
+	c->timer = ev_timer(&tv, monitor_flush, c);
+}
+
+static void
+monitor_flush(int fd, int event, void *arg)
+{
+	struct ctl_conn	*c = arg;
+
+	c->timer = 0;
+	if (!c->haspending)
+		return;
+
+	c->haspending = 0;
+	monitor_send(c, &c->pending);
+	monitor_arm(c);
+}
+
 void
 control_notify(int type)
 {
 	struct ctl_conn *c;
 	struct player_event ev;
+	struct playlist_delta d;
+	int wanted;
+
+	status_update();
+	playlist_delta(&d);
 
 	memset(&ev, 0, sizeof(ev));
 	ev.event = type;
@@ -247,13 +316,39 @@ control_notify(int type)
 	ev.mode.repeat_one = repeat_one;
 	ev.mode.repeat_all = repeat_all;
 	ev.mode.consume = consume;
+	ev.current = play_off;
+	ev.total = playlist.len;
+	stats.events++;
 
 	TAILQ_FOREACH(c, &ctl_conns, entry) {
 		if (!c->monitor)
 			continue;
 
-		imsg_compose_event(&c->iev, IMSG_CTL_MONITOR, 0, 0,
-		    -1, &ev, sizeof(ev));
+		wanted = c->mask == 0 || (c->mask & MONITOR_EVENT(type));
+
+		/* don't let another type of event be swallowed */
+		if (wanted && c->haspending && c->pending.event != type) {
+			c->haspending = 0;
+			monitor_send(c, &c->pending);
+		}
+
+		/* the delta has to reach the client even if filtered */
+		playlist_delta_merge(&c->delta, &d);
+
+		if (!wanted)
+			continue;
+
+		if (c->timer != 0) {
+			if (c->haspending)
+				stats.coalesced++;
+			c->haspending = 1;
+			memcpy(&c->pending, &ev, sizeof(ev));
+			continue;
+		}
+
+		monitor_send(c, &ev);
+		if (c->coalesce != 0)
+			monitor_arm(c);
 	}
 }
 
@@ -275,6 +370,7 @@ control_dispatch_imsg(int fd, int event, void *bula)
 	struct imsg		 imsg;
 	struct player_mode	 mode;
 	struct player_seek	 seek;
+	struct player_monitor	 mon;
 	ssize_t		 	 n, off;
 	int			 type;
 
@@ -357,14 +453,21 @@ control_dispatch_imsg(int fd, int event, void *bula)
 			break;
 		case IMSG_CTL_FLUSH:
 			playlist_truncate();
+			main_prepare_next();
 			control_notify(IMSG_CTL_COMMIT);
 			break;
 		case IMSG_CTL_SHOW:
 			main_send_playlist(&c->iev);
 			break;
+		case IMSG_CTL_LIST:
+			main_send_list(&c->iev, &imsg);
+			break;
 		case IMSG_CTL_STATUS:
 			main_send_status(&c->iev);
 			break;
+		case IMSG_CTL_STATS:
+			main_send_stats(&c->iev);
+			break;
 		case IMSG_CTL_NEXT:
 			control_notify(type);
 			main_send_player(IMSG_STOP, -1, NULL, 0);
@@ -386,6 +489,7 @@ control_dispatch_imsg(int fd, int event, void *bula)
 			consume = new_mode(consume, mode.consume);
 			repeat_all = new_mode(repeat_all, mode.repeat_all);
 			repeat_one = new_mode(repeat_one, mode.repeat_one);
+			main_prepare_next();
 			control_notify(type);
 			break;
 		case IMSG_CTL_BEGIN:
@@ -405,8 +509,23 @@ control_dispatch_imsg(int fd, int event, void *bula)
 			}
 			main_enqueue(control_state.tx != -1,
 			   &control_state.play,&c->iev, &imsg);
-			if (control_state.tx == -1)
+			if (control_state.tx == -1) {
+				main_prepare_next();
 				control_notify(type);
+			}
+			break;
+		case IMSG_CTL_ADD_BATCH:
+			if (control_state.tx != -1 &&
+			    control_state.tx != imsgbuf->fd) {
+				main_senderr(&c->iev, "locked");
+				break;
+			}
+			main_enqueue_batch(control_state.tx != -1,
+			    &control_state.play, &c->iev, &imsg);
+			if (control_state.tx == -1) {
+				main_prepare_next();
+				control_notify(IMSG_CTL_ADD);
+			}
 			break;
 		case IMSG_CTL_COMMIT:
 			if (control_state.tx != imsgbuf->fd) {
@@ -421,12 +540,25 @@ control_dispatch_imsg(int fd, int event, void *bula)
 			memset(&control_state.play, 0,
 			    sizeof(control_state.play));
 			control_state.tx = -1;
+			main_prepare_next();
 			imsg_compose_event(&c->iev, IMSG_CTL_COMMIT, 0, 0, -1,
 			    NULL, 0);
 			control_notify(type);
 			break;
 		case IMSG_CTL_MONITOR:
+			memset(&mon, 0, sizeof(mon));
+			if (imsg_get_len(&imsg) != 0 &&
+			    imsg_get_data(&imsg, &mon, sizeof(mon)) == -1) {
+				main_senderr(&c->iev, "wrong size");
+				break;
+			}
+			if (!c->monitor)
+				stats.monitors++;
 			c->monitor = 1;
+			c->oldev = imsg_get_len(&imsg) == 0;
+			c->mask = mon.mask;
+			c->coalesce = mon.coalesce;
+			playlist_delta_init(&c->delta);
 			break;
 		case IMSG_CTL_SEEK:
 			if (imsg_get_data(&imsg, &seek, sizeof(seek)) == -1) {
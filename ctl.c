@@ -18,6 +18,7 @@
 #include "config.h"
 
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
 
 #include <errno.h>
@@ -34,11 +35,15 @@
 #include "amused.h"
 #include "log.h"
 #include "playlist.h"
+#include "status.h"
+#include "walk.h"
 #include "xmalloc.h"
 
 static struct imsgbuf	*imsgbuf;
 char			 cwd[PATH_MAX];
 
+static void	ctl_open(void);
+
 static int	ctl_noarg(struct parse_result *, int, char **);
 static int	ctl_add(struct parse_result *, int, char **);
 static int	ctl_show(struct parse_result *, int, char **);
@@ -48,15 +53,16 @@ static int	ctl_repeat(struct parse_result *, int, char **);
 static int	ctl_consume(struct parse_result *, int, char **);
 static int	ctl_monitor(struct parse_result *, int, char **);
 static int	ctl_seek(struct parse_result *, int, char **);
+static int	ctl_stats(struct parse_result *, int, char **);
 static int	ctl_status(struct parse_result *, int, char **);
 
 struct ctl_command ctl_commands[] = {
-	{ "add",	ADD,		ctl_add,	"files..."},
+	{ "add",	ADD,		ctl_add,	"[-r] files..."},
 	{ "consume",	MODE,		ctl_consume,	"one|all"},
 	{ "flush",	FLUSH,		ctl_noarg,	""},
 	{ "jump",	JUMP,		ctl_jump,	"pattern"},
 	{ "load",	LOAD,		ctl_load,	"[file]"},
-	{ "monitor",	MONITOR,	ctl_monitor,	"[events]"},
+	{ "monitor",	MONITOR,	ctl_monitor,	"[-c msec] [events]"},
 	{ "next",	NEXT,		ctl_noarg,	""},
 	{ "pause",	PAUSE,		ctl_noarg,	""},
 	{ "play",	PLAY,		ctl_noarg,	""},
@@ -65,6 +71,7 @@ struct ctl_command ctl_commands[] = {
 	{ "restart",	RESTART,	ctl_noarg,	""},
 	{ "seek",	SEEK,		ctl_seek,	"[+-]time[%]"},
 	{ "show",	SHOW,		ctl_show,	"[-p]"},
+	{ "stats",	STATS,		ctl_stats,	"[-j]"},
 	{ "status",	STATUS,		ctl_status,	"[-f fmt]"},
 	{ "stop",	STOP,		ctl_noarg,	""},
 	{ "toggle",	TOGGLE,		ctl_noarg,	""},
@@ -74,7 +81,8 @@ struct ctl_command ctl_commands[] = {
 __dead void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-dv] [-s socket]\n", getprogname());
+	fprintf(stderr, "usage: %s [-dv] [-b msec] [-l profile] "
+	    "[-r rate] [-s socket]\n", getprogname());
 	exit(1);
 }
 
@@ -133,14 +141,13 @@ canonpath(const char *input, char *buf, size_t bufsize)
 	}
 }
 
-static int
-parse(struct parse_result *res, int argc, char **argv)
+static struct ctl_command *
+ctl_lookup(const char *argv0)
 {
 	struct ctl_command	*ctl = NULL;
-	const char		*argv0;
-	int			 i, status;
+	int			 i;
 
-	if ((argv0 = argv[0]) == NULL)
+	if (argv0 == NULL)
 		argv0 = "status";
 
 	for (i = 0; ctl_commands[i].name != NULL; ++i) {
@@ -156,19 +163,76 @@ parse(struct parse_result *res, int argc, char **argv)
 	}
 
 	if (ctl == NULL) {
-		fprintf(stderr, "unknown argument: %s\n", argv[0]);
+		fprintf(stderr, "unknown argument: %s\n", argv0);
 		usage();
 	}
 
+	return ctl;
+}
+
+static int
+parse(struct parse_result *res, int argc, char **argv)
+{
+	struct ctl_command	*ctl;
+	int			 status;
+
+	ctl = ctl_lookup(argv[0]);
 	res->action = ctl->action;
 	res->ctl = ctl;
 
 	status = ctl->main(res, argc, argv);
-	close(imsgbuf->fd);
-	free(imsgbuf);
+	if (imsgbuf != NULL) {
+		close(imsgbuf->fd);
+		free(imsgbuf);
+	}
 	return status;
 }
 
+/*
+ * The paths are sent in as few IMSG_CTL_ADD_BATCH as possible, each
+ * prefixed by its length.  Main replies once per batch.
+ */
+static struct ibuf	*addbuf;
+
+static void
+add_flush(void)
+{
+	if (addbuf == NULL)
+		return;
+	imsg_close(imsgbuf, addbuf);
+	addbuf = NULL;
+}
+
+static void
+add_path(const char *path)
+{
+	uint16_t len;
+
+	len = strlen(path) + 1;
+	if (addbuf != NULL &&
+	    ibuf_size(addbuf) + sizeof(len) + len > MAX_IMSGSIZE) {
+		add_flush();
+		imsg_flush(imsgbuf);
+	}
+
+	if (addbuf == NULL) {
+		addbuf = imsg_create(imsgbuf, IMSG_CTL_ADD_BATCH, 0, 0,
+		    MAX_IMSGSIZE - IMSG_HEADER_SIZE);
+		if (addbuf == NULL)
+			fatal("imsg_create");
+	}
+
+	if (imsg_add(addbuf, &len, sizeof(len)) == -1 ||
+	    imsg_add(addbuf, path, len) == -1)
+		fatal("imsg_add");
+}
+
+static void
+add_walked(const char *path, void *arg)
+{
+	add_path(path);
+}
+
 static int
 load_files(struct parse_result *res, int *ret)
 {
@@ -196,9 +260,9 @@ load_files(struct parse_result *res, int *ret)
 		}
 
 		i++;
-		imsg_compose(imsgbuf, IMSG_CTL_ADD, 0, 0, -1,
-		    path, sizeof(path));
+		add_path(path);
 	}
+	add_flush();
 
 	free(line);
 	if (ferror(res->fp))
@@ -348,6 +412,14 @@ print_monitor_event(struct player_event *ev)
 		printf("%s %lld %lld\n", event_name(ev->event),
 		    (long long)ev->position, (long long)ev->duration);
 		break;
+	case IMSG_CTL_ADD:
+	case IMSG_CTL_COMMIT:
+	case IMSG_CTL_JUMP:
+	case IMSG_CTL_NEXT:
+	case IMSG_CTL_PREV:
+		printf("%s %lld %llu\n", event_name(ev->event),
+		    (long long)ev->current, (unsigned long long)ev->total);
+		break;
 	default:
 		puts(event_name(ev->event));
 		break;
@@ -356,6 +428,113 @@ print_monitor_event(struct player_event *ev)
 	fflush(stdout);
 }
 
+static void
+print_counter(const char *name, uint64_t val, int json)
+{
+	if (json)
+		printf(",\"%s\":%llu", name, (unsigned long long)val);
+	else
+		printf("%s %llu\n", name, (unsigned long long)val);
+}
+
+static void
+print_hist(const char *name, const uint64_t *hist, int json)
+{
+	int i, n = 0;
+
+	if (json) {
+		printf(",\"%s\":[", name);
+		for (i = 0; i < STATS_HIST; ++i)
+			printf("%s%llu", i == 0 ? "" : ",",
+			    (unsigned long long)hist[i]);
+		printf("]");
+		return;
+	}
+
+	/* only the non-empty buckets, by their upper bound in usec */
+	printf("%s", name);
+	for (i = 0; i < STATS_HIST; ++i) {
+		if (hist[i] == 0)
+			continue;
+		if (i == STATS_HIST - 1)
+			printf(" inf:%llu", (unsigned long long)hist[i]);
+		else
+			printf(" %llu:%llu", 2ULL << i,
+			    (unsigned long long)hist[i]);
+		n++;
+	}
+	if (n == 0)
+		printf(" -");
+	printf("\n");
+}
+
+static void
+print_stats(struct amused_stats *st, int json)
+{
+	struct player_stats *ps = &st->player;
+
+	if (json)
+		printf("{\"tracks\":%llu", (unsigned long long)ps->tracks);
+	else
+		printf("tracks %llu\n", (unsigned long long)ps->tracks);
+	print_counter("wakeups", ps->wakeups, json);
+	print_counter("written", ps->written, json);
+	print_counter("short_writes", ps->short_writes, json);
+	if (ps->xruns >= 0)
+		print_counter("xruns", ps->xruns, json);
+	else if (json)
+		printf(",\"xruns\":null");
+	else
+		printf("xruns unknown\n");
+	print_counter("player_queue", st->player_queue, json);
+	print_counter("ctl_queue", st->ctl_queue, json);
+	print_counter("clients", st->clients, json);
+	print_counter("monitors", st->monitors, json);
+	print_counter("events", st->events, json);
+	print_counter("fanout", st->fanout, json);
+	print_counter("coalesced", st->coalesced, json);
+	print_hist("decode", ps->decode, json);
+	print_hist("start", ps->start, json);
+	if (json)
+		printf("}\n");
+}
+
+/* print a chunk of IMSG_CTL_LIST; returns 1 at the end of the list */
+static int
+print_list(struct imsg *imsg, int pretty)
+{
+	struct player_list	 pl;
+	struct ibuf		 ibuf;
+	const char		*path;
+	uint64_t		 i;
+	uint16_t		 len;
+
+	if (imsg_get_ibuf(imsg, &ibuf) == -1 ||
+	    ibuf_get(&ibuf, &pl, sizeof(pl)) == -1)
+		fatalx("data size mismatch");
+
+	if (ibuf_size(&ibuf) == 0)
+		return 1;
+
+	for (i = pl.first; ibuf_size(&ibuf) > 0; ++i) {
+		if (ibuf_get_h16(&ibuf, &len) == -1 || len == 0 ||
+		    ibuf_size(&ibuf) < len)
+			fatalx("received corrupted data");
+		path = ibuf_data(&ibuf);
+		if (path[len - 1] != '\0')
+			fatalx("received corrupted data");
+
+		if (pretty)
+			printf("%c ", (int64_t)i == pl.current ? '>' : ' ');
+		puts(path);
+
+		if (ibuf_skip(&ibuf, len) == -1)
+			fatalx("received corrupted data");
+	}
+
+	return 0;
+}
+
 static int
 ctlaction(struct parse_result *res)
 {
@@ -363,10 +542,16 @@ ctlaction(struct parse_result *res)
 	struct imsg imsg;
 	struct player_status ps;
 	struct player_event ev;
+	struct player_monitor mon;
+	struct amused_stats st;
+	struct stat sb;
 	ssize_t n;
+	size_t nadd = 0;
+	uint32_t count;
 	int i, type, ret = 0, done = 1;
 
-	if (pledge("stdio", NULL) == -1)
+	ctl_open();
+	if (pledge(res->recursive ? "stdio rpath" : "stdio", NULL) == -1)
 		fatal("pledge");
 
 	switch (res->action) {
@@ -393,7 +578,6 @@ ctlaction(struct parse_result *res)
 		imsg_compose(imsgbuf, IMSG_CTL_STOP, 0, 0, -1, NULL, 0);
 		break;
 	case ADD:
-		done = 0;
 		for (i = 0; res->files[i] != NULL; ++i) {
 			memset(path, 0, sizeof(path));
 			if (canonpath(res->files[i], path, sizeof(path))
@@ -402,9 +586,17 @@ ctlaction(struct parse_result *res)
 				continue;
 			}
 
-			imsg_compose(imsgbuf, IMSG_CTL_ADD, 0, 0, -1,
-			    path, sizeof(path));
+			if (res->recursive && stat(path, &sb) == 0 &&
+			    S_ISDIR(sb.st_mode)) {
+				nadd += walk(path, add_walked, NULL);
+				continue;
+			}
+
+			add_path(path);
+			nadd++;
 		}
+		add_flush();
+		done = nadd == 0;
 		ret = i == 0;
 		break;
 	case FLUSH:
@@ -412,12 +604,16 @@ ctlaction(struct parse_result *res)
 		break;
 	case SHOW:
 		done = 0;
-		imsg_compose(imsgbuf, IMSG_CTL_SHOW, 0, 0, -1, NULL, 0);
+		imsg_compose(imsgbuf, IMSG_CTL_LIST, 0, 0, -1, NULL, 0);
 		break;
 	case STATUS:
 		done = 0;
 		imsg_compose(imsgbuf, IMSG_CTL_STATUS, 0, 0, -1, NULL, 0);
 		break;
+	case STATS:
+		done = 0;
+		imsg_compose(imsgbuf, IMSG_CTL_STATS, 0, 0, -1, NULL, 0);
+		break;
 	case NEXT:
 		imsg_compose(imsgbuf, IMSG_CTL_NEXT, 0, 0, -1, NULL, 0);
 		if (verbose) {
@@ -457,8 +653,13 @@ ctlaction(struct parse_result *res)
 		break;
 	case MONITOR:
 		done = 0;
+		memset(&mon, 0, sizeof(mon));
+		for (i = 0; i < IMSG__LAST; ++i)
+			if (res->monitor[i])
+				mon.mask |= MONITOR_EVENT(i);
+		mon.coalesce = res->coalesce;
 		imsg_compose(imsgbuf, IMSG_CTL_MONITOR, 0, 0, -1,
-		    NULL, 0);
+		    &mon, sizeof(mon));
 		break;
 	case RESTART:
 		memset(&res->seek, 0, sizeof(res->seek));
@@ -502,34 +703,23 @@ ctlaction(struct parse_result *res)
 
 			switch (res->action) {
 			case ADD:
-				if (res->files[i] == NULL)
+				if (type != IMSG_CTL_ADD_BATCH)
+					fatalx("invalid message %d", type);
+				if (imsg_get_data(&imsg, &count, sizeof(count))
+				    == -1)
+					fatalx("data size mismatch");
+				if (count > nadd)
 					fatalx("received more replies than "
 					    "files enqueued.");
 
-				if (type == IMSG_CTL_ADD)
-					log_debug("enqueued %s", res->files[i]);
-				else
-					fatalx("invalid message %d", type);
-				i++;
-				done = res->files[i] == NULL;
+				log_debug("enqueued %u files", count);
+				nadd -= count;
+				done = nadd == 0;
 				break;
 			case SHOW:
-				if (imsg_get_len(&imsg) == 0) {
-					done = 1;
-					break;
-				}
-				if (imsg_get_data(&imsg, &ps, sizeof(ps))
-				    == -1)
-					fatalx("data size mismatch");
-				if (ps.path[sizeof(ps.path) - 1] != '\0')
-					fatalx("received corrupted data");
-				if (res->pretty) {
-					char c = ' ';
-					if (ps.status == STATE_PLAYING)
-						c = '>';
-					printf("%c ", c);
-				}
-				puts(ps.path);
+				if (type != IMSG_CTL_LIST)
+					fatalx("invalid message %d", type);
+				done = print_list(&imsg, res->pretty);
 				break;
 			case PLAY:
 			case TOGGLE:
@@ -551,7 +741,7 @@ ctlaction(struct parse_result *res)
 				done = 1;
 				break;
 			case LOAD:
-				if (type == IMSG_CTL_ADD)
+				if (type == IMSG_CTL_ADD_BATCH)
 					break;
 				if (type == IMSG_CTL_COMMIT) {
 					done = 1;
@@ -579,6 +769,17 @@ ctlaction(struct parse_result *res)
 
 				print_monitor_event(&ev);
 				break;
+			case STATS:
+				if (type != IMSG_CTL_STATS)
+					fatalx("invalid message %d", type);
+
+				if (imsg_get_data(&imsg, &st, sizeof(st))
+				    == -1)
+					fatalx("data size mismatch");
+
+				print_stats(&st, res->json);
+				done = 1;
+				break;
 			default:
 				done = 1;
 				break;
@@ -613,8 +814,15 @@ ctl_add(struct parse_result *res, int argc, char **argv)
 {
 	int ch;
 
-	while ((ch = getopt(argc, argv, "")) != -1)
-		ctl_usage(res->ctl);
+	while ((ch = getopt(argc, argv, "r")) != -1) {
+		switch (ch) {
+		case 'r':
+			res->recursive = 1;
+			break;
+		default:
+			ctl_usage(res->ctl);
+		}
+	}
 	argc -= optind;
 	argv += optind;
 
@@ -738,11 +946,20 @@ static int
 ctl_monitor(struct parse_result *res, int argc, char **argv)
 {
 	int ch, n = 0;
-	const char *events;
+	const char *events, *errstr;
 	char *dup, *tmp, *tok;
 
-	while ((ch = getopt(argc, argv, "")) != -1)
-		ctl_usage(res->ctl);
+	while ((ch = getopt(argc, argv, "c:")) != -1) {
+		switch (ch) {
+		case 'c':
+			res->coalesce = strtonum(optarg, 0, 60000, &errstr);
+			if (errstr != NULL)
+				fatalx("window is %s: %s", errstr, optarg);
+			break;
+		default:
+			ctl_usage(res->ctl);
+		}
+	}
 	argc -= optind;
 	argv += optind;
 
@@ -851,6 +1068,29 @@ done:
 	return ctlaction(res);
 }
 
+static int
+ctl_stats(struct parse_result *res, int argc, char **argv)
+{
+	int ch;
+
+	while ((ch = getopt(argc, argv, "j")) != -1) {
+		switch (ch) {
+		case 'j':
+			res->json = 1;
+			break;
+		default:
+			ctl_usage(res->ctl);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 0)
+		ctl_usage(res->ctl);
+
+	return ctlaction(res);
+}
+
 static int
 ctl_status(struct parse_result *res, int argc, char **argv)
 {
@@ -871,6 +1111,11 @@ ctl_status(struct parse_result *res, int argc, char **argv)
 	if (argc > 0)
 		ctl_usage(res->ctl);
 
+	if (res->has_status) {
+		print_status(&res->status, res->status_format);
+		return 0;
+	}
+
 	return ctlaction(res);
 }
 
@@ -976,12 +1221,27 @@ failed:
 	return -1;
 }
 
+/* connect to the daemon, starting it if needed */
+static void
+ctl_open(void)
+{
+	int	fd;
+
+	if (imsgbuf != NULL)
+		return;
+
+	if ((fd = ctl_connect()) == -1)
+		fatal("can't connect");
+
+	imsgbuf = xmalloc(sizeof(*imsgbuf));
+	imsg_init(imsgbuf, fd);
+}
+
 __dead void
 ctl(int argc, char **argv)
 {
 	struct parse_result res;
 	const char *fmt;
-	int ctl_sock;
 
 	memset(&res, 0, sizeof(res));
 	if ((fmt = getenv("AMUSED_STATUS_FORMAT")) == NULL)
@@ -998,17 +1258,25 @@ ctl(int argc, char **argv)
 	if (getcwd(cwd, sizeof(cwd)) == NULL)
 		fatal("getcwd");
 
-	if ((ctl_sock = ctl_connect()) == -1)
-		fatal("can't connect");
-
-	imsgbuf = xmalloc(sizeof(*imsgbuf));
-	imsg_init(imsgbuf, ctl_sock);
-
 	optreset = 1;
 	optind = 1;
 
-	/* we'll drop rpath too later in ctlaction */
-	if (pledge("stdio rpath", NULL) == -1)
+	/*
+	 * Connect, and start the daemon if needed, before parsing the
+	 * command: the pledge can't be widened later.  A running daemon
+	 * publishes its status, so there's no need to ask for it.
+	 */
+	if (pledge("stdio rpath wpath cpath flock unix proc exec", NULL)
+	    == -1)
+		fatal("pledge");
+
+	if (ctl_lookup(argv[0])->action == STATUS &&
+	    status_read(&res.status) == 0)
+		res.has_status = 1;
+	else
+		ctl_open();
+
+	if (pledge(res.has_status ? "stdio" : "stdio rpath", NULL) == -1)
 		fatal("pledge");
 
 	exit(parse(&res, argc, argv));
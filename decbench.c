@@ -0,0 +1,284 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#if HAVE_LIB_DL
+#include <dlfcn.h>
+#endif
+
+#include "amused.h"
+#include "log.h"
+
+/*
+ * Decode the given files with the null backend as fast as possible
+ * and print, for each one, a tab-separated line with the throughput,
+ * the cpu time per second of audio and the allocations done.
+ */
+
+static unsigned long long	nallocs;
+
+#if HAVE_LIB_DL
+/*
+ * Count the allocations of the decoders too, not only ours.  dlsym
+ * may itself allocate before the real calloc is known: that is
+ * served from a small static buffer which is never freed.
+ */
+static void	*(*real_malloc)(size_t);
+static void	*(*real_calloc)(size_t, size_t);
+static void	*(*real_realloc)(void *, size_t);
+static void	 (*real_free)(void *);
+static char	 early[4096];
+static size_t	 earlylen;
+static int	 resolving;
+
+static void
+resolve(void)
+{
+	resolving = 1;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	resolving = 0;
+
+	if (real_malloc == NULL || real_calloc == NULL ||
+	    real_realloc == NULL || real_free == NULL)
+		abort();
+}
+
+void *
+malloc(size_t size)
+{
+	if (real_malloc == NULL)
+		resolve();
+	nallocs++;
+	return real_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	void *p;
+
+	if (real_calloc == NULL) {
+		if (resolving) {
+			size = (nmemb * size + 15) & ~(size_t)15;
+			if (size > sizeof(early) - earlylen)
+				return NULL;
+			p = early + earlylen;
+			earlylen += size;
+			return p;
+		}
+		resolve();
+	}
+	nallocs++;
+	return real_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (real_realloc == NULL)
+		resolve();
+	nallocs++;
+	return real_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	if ((char *)ptr >= early && (char *)ptr < early + sizeof(early))
+		return;
+	if (real_free == NULL)
+		resolve();
+	real_free(ptr);
+}
+#endif
+
+static __dead void
+bench_usage(void)
+{
+	fprintf(stderr, "usage: %s [-b msec] [-n runs] file ...\n",
+	    getprogname());
+	exit(1);
+}
+
+/* throw away what the player sends to main, until it's closed */
+static void
+drain(int *sv)
+{
+	char buf[BUFSIZ];
+
+	switch (fork()) {
+	case -1:
+		fatal("fork");
+	case 0:
+		close(sv[0]);
+		while (read(sv[1], buf, sizeof(buf)) > 0)
+			continue;
+		_exit(0);
+	}
+	close(sv[1]);
+}
+
+static double
+cputime(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		fatal("getrusage");
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static double
+walltime(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		fatal("clock_gettime");
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench(const char *path)
+{
+	const char	*name = "unknown", *errstr = NULL;
+	unsigned long long allocs;
+	double		 cpu, wall, secs0, secs;
+	int64_t		 frames0, frames;
+	int		 fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		log_warn("open %s", path);
+		return -1;
+	}
+
+	audio_null_written(&frames0, &secs0);
+	allocs = nallocs;
+	cpu = cputime();
+	wall = walltime();
+
+	if (player_bench(fd, &name, &errstr) == -1) {
+		log_warnx("%s: %s", path, errstr ? errstr : "failed");
+		return -1;
+	}
+
+	wall = walltime() - wall;
+	cpu = cputime() - cpu;
+	allocs = nallocs - allocs;
+	audio_null_written(&frames, &secs);
+	frames -= frames0;
+	secs -= secs0;
+
+	if (secs <= 0 || wall <= 0) {
+		log_warnx("%s: no audio decoded", path);
+		return -1;
+	}
+
+	printf("%s\t%s\t%lld\t%.3f\t%.0f\t%.6f\t%.1f\t", path, name,
+	    (long long)frames, secs, frames / wall, cpu / secs, secs / wall);
+#if HAVE_LIB_DL
+	printf("%llu\n", allocs);
+#else
+	printf("-\n");
+#endif
+	fflush(stdout);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*errstr;
+	int		 ch, i, bufms = 500, runs = 1, ret = 0;
+	int		 sv[2];
+
+	log_init(1, LOG_DAEMON);
+	log_setverbose(0);
+
+	while ((ch = getopt(argc, argv, "b:n:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bufms = strtonum(optarg, 10, 10000, &errstr);
+			if (errstr != NULL)
+				fatalx("buffer size is %s: %s", errstr, optarg);
+			break;
+		case 'n':
+			runs = strtonum(optarg, 1, 1000, &errstr);
+			if (errstr != NULL)
+				fatalx("runs are %s: %s", errstr, optarg);
+			break;
+		default:
+			bench_usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc == 0)
+		bench_usage();
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sv) == -1)
+		fatal("socketpair");
+	drain(sv);
+	if (sv[0] != 3) {
+		if (dup2(sv[0], 3) == -1)
+			fatal("dup2");
+		close(sv[0]);
+	}
+
+	player_init(bufms, AUDIO_NORMAL, 0);
+
+	printf("file\tformat\tframes\tseconds\tframes/s\tcpu/s\t"
+	    "realtime\tallocs\n");
+	for (; argc > 0; argc--, argv++) {
+		for (i = 0; i < runs; ++i) {
+			if (bench(*argv) == -1)
+				ret = 1;
+		}
+	}
+
+	return ret;
+}
@@ -25,36 +25,87 @@
 
 #include "config.h"
 
+#include <sys/types.h>
+#if HAVE_EPOLL
+#include <sys/epoll.h>
+#elif HAVE_KQUEUE
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "ev.h"
 
+/*
+ * The callbacks are kept in a table indexed by fd, but the kernel is
+ * only told about the fds actually in use, either via epoll(7) or
+ * kqueue(2), or, as a fallback, via a compact array given to poll(2).
+ * The ready fds are collected in a list, so that dispatching costs
+ * proportionally to the number of events and not to the highest fd.
+ */
+
 struct evcb {
 	void		(*cb)(int, int, void *);
 	void		*udata;
+	int		 events;	/* registered events */
+	int		 revents;	/* pending events */
+#if !HAVE_EPOLL && !HAVE_KQUEUE
+	int		 slot;		/* index in pfds */
+#endif
 };
 
-struct evbase {
-	size_t		 len;
+/* the low bits of a timer id are the slot, the others its generation */
+#define TIMER_SLOTBITS	20
+#define TIMER_MAXSLOTS	((1U << TIMER_SLOTBITS) - 1)
+#define TIMER_FREE	SIZE_MAX
 
-	struct pollfd	*pfds;
-	size_t		 pfdlen;
+struct evtimer {
+	struct timespec	 when;
+	void		(*cb)(int, int, void *);
+	void		*udata;
+	size_t		 pos;		/* in the heap, or TIMER_FREE */
+	size_t		 next;		/* next free slot */
+	unsigned int	 gen;
+};
 
+struct evbase {
 	struct evcb	*cbs;
 	size_t		 cblen;
 
+	size_t		 nfds;
+
+	int		*ready;
+	size_t		 nready;
+	size_t		 readycap;
+
+#if HAVE_EPOLL
+	int		 epfd;
+	struct epoll_event *kevs;
+#elif HAVE_KQUEUE
+	int		 kq;
+	struct kevent	*kevs;
+#else
+	struct pollfd	*pfds;
+#endif
+
 	int		 sigpipe[2];
 	struct evcb	 sigcb;
 
-	int		 timeout;
-	struct evcb	 toutcb;
+	struct evtimer	*timers;
+	size_t		 ntimers;
+	size_t		 freetimer;
+
+	size_t		*heap;		/* min-heap of timer slots */
+	size_t		 heaplen;
 };
 
 static struct evbase	*base;
@@ -64,27 +115,285 @@ static int
 ev_resize(size_t len)
 {
 	void	*t;
+#if !HAVE_EPOLL && !HAVE_KQUEUE
 	size_t	 i;
+#endif
 
-	t = recallocarray(base->pfds, base->pfdlen, len, sizeof(*base->pfds));
+	t = recallocarray(base->cbs, base->cblen, len, sizeof(*base->cbs));
 	if (t == NULL)
 		return -1;
-	base->pfds = t;
-	base->pfdlen = len;
+	base->cbs = t;
 
-	for (i = base->len; i < len; ++i)
-		base->pfds[i].fd = -1;
+#if !HAVE_EPOLL && !HAVE_KQUEUE
+	for (i = base->cblen; i < len; ++i)
+		base->cbs[i].slot = -1;
+#endif
 
-	t = recallocarray(base->cbs, base->cblen, len, sizeof(*base->cbs));
+	base->cblen = len;
+	return 0;
+}
+
+/*
+ * Make room for the events of nfds file descriptors.  Each fd can be
+ * reported twice by kqueue, once per filter.
+ */
+static int
+ev_grow(size_t nfds)
+{
+	void	*t;
+	size_t	 cap;
+
+	if (nfds <= base->readycap)
+		return 0;
+
+	cap = base->readycap * 2;
+	if (cap < nfds)
+		cap = nfds;
+
+	if ((t = reallocarray(base->ready, cap, sizeof(*base->ready))) == NULL)
+		return -1;
+	base->ready = t;
+
+#if HAVE_EPOLL
+	t = reallocarray(base->kevs, cap, sizeof(*base->kevs));
+#elif HAVE_KQUEUE
+	t = reallocarray(base->kevs, cap, 2 * sizeof(*base->kevs));
+#else
+	t = reallocarray(base->pfds, cap, sizeof(*base->pfds));
+#endif
 	if (t == NULL)
 		return -1;
-	base->cbs = t;
-	base->cblen = len;
+#if HAVE_EPOLL || HAVE_KQUEUE
+	base->kevs = t;
+#else
+	base->pfds = t;
+#endif
+
+	base->readycap = cap;
+	return 0;
+}
+
+static void
+ev_ready(int fd, int revents)
+{
+	struct evcb	*cb;
+
+	if (fd < 0 || (size_t)fd >= base->cblen)
+		return;
+
+	cb = &base->cbs[fd];
+	if (cb->cb == NULL || !(revents & (POLLIN|POLLOUT|POLLHUP)))
+		return;
+
+	if (cb->revents == 0)
+		base->ready[base->nready++] = fd;
+	cb->revents |= revents;
+}
+
+#if HAVE_EPOLL
+
+static int
+backend_init(void)
+{
+	if ((base->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return -1;
+	return 0;
+}
+
+static int
+backend_add(int fd, int old, int ev)
+{
+	struct epoll_event	 e;
+	int			 op;
+
+	if (old == ev)
+		return 0;
+
+	memset(&e, 0, sizeof(e));
+	e.data.fd = fd;
+	if (ev & POLLIN)
+		e.events |= EPOLLIN;
+	if (ev & POLLOUT)
+		e.events |= EPOLLOUT;
+
+	op = old == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if (epoll_ctl(base->epfd, op, fd, &e) == 0)
+		return 0;
+
+	/* the fd was closed and reused behind our back. */
+	if (op == EPOLL_CTL_ADD && errno == EEXIST)
+		return epoll_ctl(base->epfd, EPOLL_CTL_MOD, fd, &e);
+	if (op == EPOLL_CTL_MOD && errno == ENOENT)
+		return epoll_ctl(base->epfd, EPOLL_CTL_ADD, fd, &e);
+	return -1;
+}
+
+static void
+backend_del(int fd, int old)
+{
+	/* may fail if the fd was already closed. */
+	epoll_ctl(base->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static int
+backend_wait(int timeout)
+{
+	struct epoll_event	*e;
+	int			 i, n, ev;
+
+	n = epoll_wait(base->epfd, base->kevs, base->readycap, timeout);
+	for (i = 0; i < n; ++i) {
+		e = &base->kevs[i];
+		ev = 0;
+		if (e->events & EPOLLIN)
+			ev |= POLLIN;
+		if (e->events & EPOLLOUT)
+			ev |= POLLOUT;
+		if (e->events & EPOLLHUP)
+			ev |= POLLHUP;
+		if (e->events & EPOLLERR)
+			ev |= POLLERR;
+		ev_ready(e->data.fd, ev);
+	}
+	return n;
+}
+
+#elif HAVE_KQUEUE
+
+static int
+backend_init(void)
+{
+	if ((base->kq = kqueue()) == -1)
+		return -1;
+	return 0;
+}
+
+static int
+backend_add(int fd, int old, int ev)
+{
+	struct kevent	 ch[2];
+	int		 n = 0, r;
+
+	if (old == -1)
+		old = 0;
+
+	if ((old & POLLIN) && !(ev & POLLIN))
+		EV_SET(&ch[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	if ((old & POLLOUT) && !(ev & POLLOUT))
+		EV_SET(&ch[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+	if (n > 0) {
+		kevent(base->kq, ch, n, NULL, 0, NULL);
+		n = 0;
+	}
+
+	if (!(old & POLLIN) && (ev & POLLIN))
+		EV_SET(&ch[n++], fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	if (!(old & POLLOUT) && (ev & POLLOUT))
+		EV_SET(&ch[n++], fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+	if (n == 0)
+		return 0;
+
+	do {
+		r = kevent(base->kq, ch, n, NULL, 0, NULL);
+	} while (r == -1 && errno == EINTR);
+	return r == -1 ? -1 : 0;
+}
+
+static void
+backend_del(int fd, int old)
+{
+	struct kevent	 ch[2];
+	int		 n = 0;
+
+	if (old & POLLIN)
+		EV_SET(&ch[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	if (old & POLLOUT)
+		EV_SET(&ch[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+
+	/* may fail if the fd was already closed. */
+	if (n > 0)
+		kevent(base->kq, ch, n, NULL, 0, NULL);
+}
+
+static int
+backend_wait(int timeout)
+{
+	struct timespec	 ts, *tsp = NULL;
+	struct kevent	*e;
+	int		 i, n, ev;
+
+	if (timeout != INFTIM) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		tsp = &ts;
+	}
+
+	n = kevent(base->kq, NULL, 0, base->kevs, base->readycap * 2, tsp);
+	for (i = 0; i < n; ++i) {
+		e = &base->kevs[i];
+		if (e->flags & EV_ERROR)
+			continue;
+		ev = e->filter == EVFILT_WRITE ? POLLOUT : POLLIN;
+		if (e->flags & EV_EOF)
+			ev |= POLLHUP;
+		ev_ready(e->ident, ev);
+	}
+	return n;
+}
+
+#else
+
+static int
+backend_init(void)
+{
+	return 0;
+}
+
+static int
+backend_add(int fd, int old, int ev)
+{
+	struct evcb	*cb = &base->cbs[fd];
 
-	base->len = len;
+	if (old == -1) {
+		cb->slot = base->nfds - 1;
+		base->pfds[cb->slot].fd = fd;
+	}
+	base->pfds[cb->slot].events = ev;
 	return 0;
 }
 
+static void
+backend_del(int fd, int old)
+{
+	struct evcb	*cb = &base->cbs[fd];
+	int		 last = base->nfds;
+
+	/* move the last one in the hole */
+	if (cb->slot != last) {
+		base->pfds[cb->slot] = base->pfds[last];
+		base->cbs[base->pfds[last].fd].slot = cb->slot;
+	}
+	cb->slot = -1;
+}
+
+static int
+backend_wait(int timeout)
+{
+	size_t	 i;
+	int	 n, left;
+
+	n = poll(base->pfds, base->nfds, timeout);
+	for (i = 0, left = n; i < base->nfds && left > 0; ++i) {
+		if (base->pfds[i].revents == 0)
+			continue;
+		left--;
+		ev_ready(base->pfds[i].fd, base->pfds[i].revents);
+	}
+	return n;
+}
+
+#endif
+
 int
 ev_init(void)
 {
@@ -98,11 +407,17 @@ ev_init(void)
 
 	base->sigpipe[0] = -1;
 	base->sigpipe[1] = -1;
-	base->timeout = INFTIM;
+	base->freetimer = TIMER_FREE;
 
-	if (ev_resize(16) == -1) {
-		free(base->pfds);
+	if (ev_resize(16) == -1 || ev_grow(16) == -1 ||
+	    backend_init() == -1) {
 		free(base->cbs);
+		free(base->ready);
+#if HAVE_EPOLL || HAVE_KQUEUE
+		free(base->kevs);
+#else
+		free(base->pfds);
+#endif
 		free(base);
 		base = NULL;
 		return -1;
@@ -114,16 +429,36 @@ ev_init(void)
 int
 ev_add(int fd, int ev, void (*cb)(int, int, void *), void *udata)
 {
-	if (fd >= base->len) {
+	struct evcb	*c;
+
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if ((size_t)fd >= base->cblen) {
 		if (ev_resize(fd + 1) == -1)
 			return -1;
 	}
 
-	base->pfds[fd].fd = fd;
-	base->pfds[fd].events = ev;
+	c = &base->cbs[fd];
+	ev &= POLLIN|POLLOUT;
+
+	if (c->cb == NULL) {
+		if (ev_grow(base->nfds + 1) == -1)
+			return -1;
+		base->nfds++;
+	}
+
+	if (backend_add(fd, c->cb == NULL ? -1 : c->events, ev) == -1) {
+		if (c->cb == NULL)
+			base->nfds--;
+		return -1;
+	}
 
-	base->cbs[fd].cb = cb;
-	base->cbs[fd].udata = udata;
+	c->cb = cb;
+	c->udata = udata;
+	c->events = ev;
 
 	return 0;
 }
@@ -183,40 +518,245 @@ ev_signal(int sig, void (*cb)(int, int, void *), void *udata)
 	return 0;
 }
 
-int
+static int
+timer_before(size_t a, size_t b)
+{
+	struct timespec	*ta = &base->timers[a].when;
+	struct timespec	*tb = &base->timers[b].when;
+
+	if (ta->tv_sec != tb->tv_sec)
+		return ta->tv_sec < tb->tv_sec;
+	return ta->tv_nsec < tb->tv_nsec;
+}
+
+static void
+heap_set(size_t pos, size_t slot)
+{
+	base->heap[pos] = slot;
+	base->timers[slot].pos = pos;
+}
+
+static void
+heap_up(size_t pos)
+{
+	size_t	 slot = base->heap[pos], parent;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (!timer_before(slot, base->heap[parent]))
+			break;
+		heap_set(pos, base->heap[parent]);
+		pos = parent;
+	}
+	heap_set(pos, slot);
+}
+
+static void
+heap_down(size_t pos)
+{
+	size_t	 slot = base->heap[pos], child;
+
+	for (;;) {
+		child = pos * 2 + 1;
+		if (child >= base->heaplen)
+			break;
+		if (child + 1 < base->heaplen &&
+		    timer_before(base->heap[child + 1], base->heap[child]))
+			child++;
+		if (!timer_before(base->heap[child], slot))
+			break;
+		heap_set(pos, base->heap[child]);
+		pos = child;
+	}
+	heap_set(pos, slot);
+}
+
+static void
+timer_remove(size_t slot)
+{
+	struct evtimer	*t = &base->timers[slot];
+	size_t		 pos = t->pos, moved;
+
+	if (--base->heaplen != pos) {
+		moved = base->heap[base->heaplen];
+		heap_set(pos, moved);
+		heap_up(pos);
+		heap_down(base->timers[moved].pos);
+	}
+
+	t->pos = TIMER_FREE;
+	t->cb = NULL;
+	t->udata = NULL;
+	t->gen++;
+	t->next = base->freetimer;
+	base->freetimer = slot;
+}
+
+static struct evtimer *
+timer_byid(unsigned int id)
+{
+	struct evtimer	*t;
+	size_t		 slot;
+
+	slot = id & TIMER_MAXSLOTS;
+	if (slot == 0 || slot > base->ntimers)
+		return NULL;
+
+	t = &base->timers[slot - 1];
+	if (t->pos == TIMER_FREE ||
+	    (t->gen & (UINT_MAX >> TIMER_SLOTBITS)) != id >> TIMER_SLOTBITS)
+		return NULL;
+	return t;
+}
+
+/*
+ * Schedule cb to be called once after tv.  Returns an id that can
+ * be given to ev_timer_cancel() or 0 on failure.
+ */
+unsigned int
 ev_timer(const struct timeval *tv, void (*cb)(int, int, void*), void *udata)
 {
-	base->timeout = INFTIM;
-	if (tv) {
-		base->timeout = tv->tv_sec * 1000;
-		base->timeout += tv->tv_usec / 1000;
+	struct evtimer	*t;
+	size_t		 slot, len;
+	void		*p;
+
+	if (base->freetimer == TIMER_FREE) {
+		if (base->ntimers == TIMER_MAXSLOTS) {
+			errno = ENOMEM;
+			return 0;
+		}
+
+		len = base->ntimers ? base->ntimers * 2 : 8;
+		if (len > TIMER_MAXSLOTS)
+			len = TIMER_MAXSLOTS;
+
+		p = reallocarray(base->heap, len, sizeof(*base->heap));
+		if (p == NULL)
+			return 0;
+		base->heap = p;
+
+		p = recallocarray(base->timers, base->ntimers, len,
+		    sizeof(*base->timers));
+		if (p == NULL)
+			return 0;
+		base->timers = p;
+
+		for (slot = len; slot > base->ntimers; --slot) {
+			base->timers[slot - 1].pos = TIMER_FREE;
+			base->timers[slot - 1].next = base->freetimer;
+			base->freetimer = slot - 1;
+		}
+		base->ntimers = len;
 	}
 
-	base->toutcb.cb = cb;
-	base->toutcb.udata = udata;
+	slot = base->freetimer;
+	t = &base->timers[slot];
+	base->freetimer = t->next;
 
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &t->when);
+	t->when.tv_sec += tv->tv_sec;
+	t->when.tv_nsec += tv->tv_usec * 1000;
+	if (t->when.tv_nsec >= 1000000000) {
+		t->when.tv_sec++;
+		t->when.tv_nsec -= 1000000000;
+	}
+	t->cb = cb;
+	t->udata = udata;
+
+	base->heap[base->heaplen] = slot;
+	heap_up(base->heaplen++);
+
+	return ((t->gen & (UINT_MAX >> TIMER_SLOTBITS)) << TIMER_SLOTBITS) |
+	    (slot + 1);
 }
 
+/* Returns 1 if the timer was pending, 0 otherwise. */
 int
-ev_timer_pending(void)
+ev_timer_cancel(unsigned int id)
 {
-	return base->timeout != INFTIM;
+	struct evtimer	*t;
+
+	if ((t = timer_byid(id)) == NULL)
+		return 0;
+	timer_remove(t - base->timers);
+	return 1;
+}
+
+int
+ev_timer_pending(unsigned int id)
+{
+	return timer_byid(id) != NULL;
+}
+
+/* Milliseconds until the first timer expires, rounded up. */
+static int
+timer_timeout(void)
+{
+	struct timespec	 now, diff;
+	struct evtimer	*t;
+	long long	 ms;
+
+	if (base->heaplen == 0)
+		return INFTIM;
+
+	t = &base->timers[base->heap[0]];
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&t->when, &now, &diff);
+	if (diff.tv_sec < 0)
+		return 0;
+
+	ms = (long long)diff.tv_sec * 1000 + (diff.tv_nsec + 999999) / 1000000;
+	return ms > INT_MAX ? INT_MAX : ms;
+}
+
+static void
+timer_dispatch(void)
+{
+	struct timespec	 now;
+	struct evtimer	*t;
+	void		(*cb)(int, int, void *);
+	void		*udata;
+	size_t		 slot;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while (base->heaplen > 0 && !ev_stop) {
+		slot = base->heap[0];
+		t = &base->timers[slot];
+		if (t->when.tv_sec > now.tv_sec ||
+		    (t->when.tv_sec == now.tv_sec &&
+		    t->when.tv_nsec > now.tv_nsec))
+			break;
+
+		/* remove it first, so that cb can schedule it again */
+		cb = t->cb;
+		udata = t->udata;
+		timer_remove(slot);
+		cb(-1, 0, udata);
+	}
 }
 
 int
 ev_del(int fd)
 {
-	if (fd >= base->len) {
+	struct evcb	*c;
+
+	if (fd < 0 || (size_t)fd >= base->cblen) {
 		errno = ERANGE;
 		return -1;
 	}
 
-	base->pfds[fd].fd = -1;
-	base->pfds[fd].events = 0;
+	c = &base->cbs[fd];
+	if (c->cb == NULL)
+		return 0;
+
+	base->nfds--;
+	backend_del(fd, c->events);
 
-	base->cbs[fd].cb = NULL;
-	base->cbs[fd].udata = NULL;
+	/* drop the events not yet dispatched */
+	c->cb = NULL;
+	c->udata = NULL;
+	c->events = 0;
+	c->revents = 0;
 
 	return 0;
 }
@@ -224,37 +764,28 @@ ev_del(int fd)
 int
 ev_loop(void)
 {
-	struct timespec	 elapsed, beg, end;
-	int		 n, em;
+	struct evcb	*c;
+	int		 fd, ev;
 	size_t		 i;
 
 	while (!ev_stop) {
-		clock_gettime(CLOCK_MONOTONIC, &beg);
-		if ((n = poll(base->pfds, base->len, base->timeout)) == -1) {
+		base->nready = 0;
+
+		if (backend_wait(timer_timeout()) == -1) {
 			if (errno != EINTR)
 				return -1;
 		}
-		clock_gettime(CLOCK_MONOTONIC, &end);
-
-		timespecsub(&end, &beg, &elapsed);
-		em = elapsed.tv_sec * 1000 + elapsed.tv_nsec / 1000000;
-		if (base->timeout != INFTIM) {
-			if (base->timeout - em < 0 || n == 0) {
-				base->timeout = INFTIM;
-				base->toutcb.cb(-1, 0, base->toutcb.udata);
-			} else
-				base->timeout -= em;
-		}
 
-		for (i = 0; i < base->len && n > 0 && !ev_stop; ++i) {
-			if (base->pfds[i].fd == -1)
+		timer_dispatch();
+
+		for (i = 0; i < base->nready; ++i) {
+			fd = base->ready[i];
+			c = &base->cbs[fd];
+			ev = c->revents;
+			c->revents = 0;
+			if (ev == 0 || c->cb == NULL || ev_stop)
 				continue;
-			if (base->pfds[i].revents & (POLLIN|POLLOUT|POLLHUP)) {
-				n--;
-				base->cbs[i].cb(base->pfds[i].fd,
-				    base->pfds[i].revents,
-				    base->cbs[i].udata);
-			}
+			c->cb(fd, ev, c->udata);
 		}
 	}
 
@@ -28,8 +28,10 @@ struct timeval;
 int	ev_init(void);
 int	ev_add(int, int, void(*)(int, int, void *), void *);
 int	ev_signal(int, void(*)(int, int, void * ), void *);
-int	ev_timer(const struct timeval *, void(*)(int, int, void *), void *);
-int	ev_timer_pending(void);
+unsigned int ev_timer(const struct timeval *, void(*)(int, int, void *),
+	    void *);
+int	ev_timer_cancel(unsigned int);
+int	ev_timer_pending(unsigned int);
 int	ev_del(int);
 int	ev_loop(void);
 void	ev_break(void);
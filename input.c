@@ -0,0 +1,265 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "input.h"
+#include "log.h"
+
+/* give back what was already read in blocks of this size */
+#define DROP_CHUNK	(1024 * 1024)
+
+/*
+ * A file truncated while it's mapped raises SIGBUS on the next access
+ * to the pages past the end.  The copy in input_read is the only one,
+ * so the fault is caught there and the file is read(2) from then on,
+ * which just comes short like before.
+ */
+static sigjmp_buf		 bus_jmp;
+static volatile sig_atomic_t	 bus_armed;
+
+static void
+input_sigbus(int sig)
+{
+	struct sigaction sa;
+
+	if (bus_armed)
+		siglongjmp(bus_jmp, 1);
+
+	/* not ours: fault again with the default action */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigaction(sig, &sa, NULL);
+}
+
+static int
+input_catch(void)
+{
+	static int	 done;
+	struct sigaction sa;
+
+	if (done)
+		return 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = input_sigbus;
+	if (sigaction(SIGBUS, &sa, NULL) == -1)
+		return -1;
+	done = 1;
+	return 0;
+}
+
+int
+input_open(struct input *in, int fd)
+{
+	struct stat	 sb;
+	void		*map;
+
+	memset(in, 0, sizeof(*in));
+	in->fd = fd;
+
+	if (fstat(fd, &sb) == -1) {
+		log_warn("%s: fstat", __func__);
+		return -1;
+	}
+
+	if (!S_ISREG(sb.st_mode) || sb.st_size <= 0 ||
+	    (uintmax_t)sb.st_size > SIZE_MAX)
+		return 0;
+
+	if (input_catch() == -1) {
+		log_debug("%s: sigaction: %s", __func__, strerror(errno));
+		return 0;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		log_debug("%s: mmap: %s", __func__, strerror(errno));
+		return 0;
+	}
+
+	in->map = map;
+	in->len = sb.st_size;
+	if (madvise(in->map, in->len, MADV_SEQUENTIAL) == -1)
+		log_debug("%s: madvise: %s", __func__, strerror(errno));
+	return 0;
+}
+
+/*
+ * Release the pages behind the read position: they won't be needed
+ * anymore unless we seek back, and there's no point in keeping big
+ * files in memory.
+ */
+static void
+input_drop(struct input *in)
+{
+	size_t pgsz, end;
+
+	if (in->off < in->dropped) {
+		/* seeked back */
+		in->dropped = 0;
+		return;
+	}
+
+	if (in->off - in->dropped < DROP_CHUNK)
+		return;
+
+	pgsz = getpagesize();
+	end = in->off - (in->off % pgsz);
+	if (end <= in->dropped)
+		return;
+
+	madvise(in->map + in->dropped, end - in->dropped, MADV_DONTNEED);
+#if HAVE_POSIX_FADVISE
+	posix_fadvise(in->fd, in->dropped, end - in->dropped,
+	    POSIX_FADV_DONTNEED);
+#endif
+	in->dropped = end;
+}
+
+size_t
+input_read(struct input *in, void *buf, size_t len)
+{
+	ssize_t r;
+
+	if (in->map == NULL) {
+		r = read(in->fd, buf, len);
+		return r == -1 ? 0 : r;
+	}
+
+	if (len > in->len - in->off)
+		len = in->len - in->off;
+
+	if (sigsetjmp(bus_jmp, 1) != 0) {
+		bus_armed = 0;
+		log_warnx("%s: the file shrank, reading it instead",
+		    __func__);
+		munmap(in->map, in->len);
+		in->map = NULL;
+		if (lseek(in->fd, in->off, SEEK_SET) == -1)
+			return 0;
+		r = read(in->fd, buf, len);
+		return r == -1 ? 0 : r;
+	}
+
+	bus_armed = 1;
+	memcpy(buf, in->map + in->off, len);
+	bus_armed = 0;
+	in->off += len;
+	input_drop(in);
+	return len;
+}
+
+int
+input_seek(struct input *in, int64_t off, int whence)
+{
+	if (in->map == NULL)
+		return lseek(in->fd, off, whence) == -1 ? -1 : 0;
+
+	switch (whence) {
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		off += in->off;
+		break;
+	case SEEK_END:
+		off += in->len;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (off < 0 || (uint64_t)off > in->len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	in->off = off;
+	input_drop(in);
+	return 0;
+}
+
+int64_t
+input_tell(struct input *in)
+{
+	if (in->map == NULL)
+		return lseek(in->fd, 0, SEEK_CUR);
+	return in->off;
+}
+
+int64_t
+input_size(struct input *in)
+{
+	struct stat sb;
+
+	if (in->map == NULL) {
+		if (fstat(in->fd, &sb) == -1)
+			return -1;
+		return sb.st_size;
+	}
+	return in->len;
+}
+
+int
+input_eof(struct input *in)
+{
+	int64_t off;
+
+	if (in->map == NULL) {
+		if ((off = input_tell(in)) == -1)
+			return 1;
+		return off >= input_size(in);
+	}
+	return in->off == in->len;
+}
+
+void
+input_close(struct input *in)
+{
+	if (in->map != NULL)
+		munmap(in->map, in->len);
+	if (in->fd != -1)
+		close(in->fd);
+	memset(in, 0, sizeof(*in));
+	in->fd = -1;
+}
@@ -0,0 +1,51 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef INPUT_H
+#define INPUT_H
+
+/*
+ * Read-only access to the file being played.  Regular files are
+ * mapped in memory, with a fallback on plain read(2) if that's not
+ * possible or if the file is truncated while playing.  The decoders
+ * use it through their I/O callbacks.
+ */
+struct input {
+	int		 fd;
+	uint8_t		*map;
+	size_t		 len;
+	size_t		 off;
+	size_t		 dropped;	/* released up to here */
+};
+
+int	input_open(struct input *, int);
+size_t	input_read(struct input *, void *, size_t);
+int	input_seek(struct input *, int64_t, int);
+int64_t	input_tell(struct input *);
+int64_t	input_size(struct input *);
+int	input_eof(struct input *);
+void	input_close(struct input *);
+
+#endif
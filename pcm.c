@@ -0,0 +1,834 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <endian.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define PCM_SSE2	1
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PCM_AVX2	1
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define PCM_NEON	1
+#endif
+
+#include "pcm.h"
+
+/*
+ * The scalar kernels.  They're also used for the tails the vector
+ * versions leave behind.
+ */
+
+static void
+il8(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	size_t		 i;
+	unsigned int	 c;
+
+	for (i = off; i < off + n; ++i)
+		for (c = 0; c < chans; ++c)
+			*dst++ = src[c][i];
+}
+
+static void
+il16(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	size_t		 i;
+	unsigned int	 c;
+	int16_t		 v;
+
+	for (i = off; i < off + n; ++i) {
+		for (c = 0; c < chans; ++c) {
+			v = src[c][i];
+			memcpy(dst, &v, sizeof(v));
+			dst += sizeof(v);
+		}
+	}
+}
+
+static void
+il16_1(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	const int32_t	*m = src[0] + off;
+	size_t		 i;
+	int16_t		 v;
+
+	for (i = 0; i < n; ++i) {
+		v = m[i];
+		memcpy(dst, &v, sizeof(v));
+		dst += sizeof(v);
+	}
+}
+
+static void
+il16_2(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	const int32_t	*l = src[0] + off, *r = src[1] + off;
+	size_t		 i;
+	int16_t		 v[2];
+
+	for (i = 0; i < n; ++i) {
+		v[0] = l[i];
+		v[1] = r[i];
+		memcpy(dst, v, sizeof(v));
+		dst += sizeof(v);
+	}
+}
+
+static void
+il32(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	size_t		 i;
+	unsigned int	 c;
+
+	for (i = off; i < off + n; ++i) {
+		for (c = 0; c < chans; ++c) {
+			memcpy(dst, &src[c][i], sizeof(int32_t));
+			dst += sizeof(int32_t);
+		}
+	}
+}
+
+static void
+il32_1(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	memcpy(dst, src[0] + off, n * sizeof(int32_t));
+}
+
+static void
+il32_2(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	const int32_t	*l = src[0] + off, *r = src[1] + off;
+	size_t		 i;
+	int32_t		 v[2];
+
+	for (i = 0; i < n; ++i) {
+		v[0] = l[i];
+		v[1] = r[i];
+		memcpy(dst, v, sizeof(v));
+		dst += sizeof(v);
+	}
+}
+
+/*
+ * The source bits and the layout for the kernels that change the
+ * sample size; set by pcm_interleaver and pcm_finterleaver, there's
+ * only one stream at a time.
+ */
+static unsigned int	 cv_bits;
+static int		 cv_fmt;
+
+static inline void
+put24(uint8_t *dst, int32_t v)
+{
+#if BYTE_ORDER == BIG_ENDIAN
+	dst[0] = v >> 16;
+	dst[1] = v >> 8;
+	dst[2] = v;
+#else
+	dst[0] = v;
+	dst[1] = v >> 8;
+	dst[2] = v >> 16;
+#endif
+}
+
+/* store v, a sample of bits, in the layout fmt */
+static inline uint8_t *
+put(uint8_t *dst, int fmt, int32_t v, unsigned int bits)
+{
+	unsigned int	 to;
+	float		 f;
+	int16_t		 v16;
+	int8_t		 v8;
+
+	if (fmt == PCM_F32) {
+		f = v / (float)(1U << (bits - 1));
+		memcpy(dst, &f, sizeof(f));
+		return dst + sizeof(f);
+	}
+
+	to = fmt == PCM_S8 ? 8 : fmt == PCM_S16 ? 16 : fmt == PCM_S32 ? 32 : 24;
+	if (bits > to)
+		v >>= bits - to;
+	else
+		v = (uint32_t)v << (to - bits);
+
+	switch (fmt) {
+	case PCM_S8:
+		v8 = v;
+		*dst = v8;
+		return dst + 1;
+	case PCM_S16:
+		v16 = v;
+		memcpy(dst, &v16, sizeof(v16));
+		return dst + sizeof(v16);
+	case PCM_S24_3:
+		put24(dst, v);
+		return dst + 3;
+	default:
+		memcpy(dst, &v, sizeof(v));
+		return dst + sizeof(v);
+	}
+}
+
+static void
+il24_3(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	size_t		 i;
+	unsigned int	 c;
+
+	for (i = off; i < off + n; ++i) {
+		for (c = 0; c < chans; ++c) {
+			put24(dst, src[c][i]);
+			dst += 3;
+		}
+	}
+}
+
+static void
+ilany(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	size_t		 i;
+	unsigned int	 c;
+
+	for (i = off; i < off + n; ++i)
+		for (c = 0; c < chans; ++c)
+			dst = put(dst, cv_fmt, src[c][i], cv_bits);
+}
+
+/* scale v in the [-1, 1] range to max, clipping what's outside */
+static inline int32_t
+fscale(float v, double max)
+{
+	double		 d = v * max;
+
+	if (d >= max)
+		return max;
+	if (d <= -max - 1)
+		return -max - 1;
+	return d < 0 ? d - 0.5 : d + 0.5;
+}
+
+static void
+filany(uint8_t *dst, const float * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	size_t		 i;
+	unsigned int	 c;
+	int32_t		 v;
+	float		 f;
+
+	for (i = off; i < off + n; ++i) {
+		for (c = 0; c < chans; ++c) {
+			f = src[c][i];
+			switch (cv_fmt) {
+			case PCM_F32:
+				memcpy(dst, &f, sizeof(f));
+				dst += sizeof(f);
+				break;
+			case PCM_S8:
+				dst = put(dst, cv_fmt, fscale(f, 127), 8);
+				break;
+			case PCM_S16:
+				dst = put(dst, cv_fmt, fscale(f, 32767), 16);
+				break;
+			case PCM_S32:
+				v = fscale(f, 2147483647.0);
+				memcpy(dst, &v, sizeof(v));
+				dst += sizeof(v);
+				break;
+			default:
+				dst = put(dst, cv_fmt, fscale(f, 8388607), 24);
+				break;
+			}
+		}
+	}
+}
+
+static void
+fil32_1(uint8_t *dst, const float * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	memcpy(dst, src[0] + off, n * sizeof(float));
+}
+
+#if PCM_SSE2
+static void
+il16_1_sse2(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	const int32_t	*m = src[0] + off;
+	__m128i		 a, b;
+	size_t		 i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm_loadu_si128((const __m128i *)(m + i));
+		b = _mm_loadu_si128((const __m128i *)(m + i + 4));
+		_mm_storeu_si128((__m128i *)dst, _mm_packs_epi32(a, b));
+		dst += 16;
+	}
+	il16_1(dst, src, chans, off + i, n - i);
+}
+
+static void
+il16_2_sse2(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	const int32_t	*l = src[0] + off, *r = src[1] + off;
+	__m128i		 a, b;
+	size_t		 i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm_packs_epi32(_mm_loadu_si128((const __m128i *)(l + i)),
+		    _mm_loadu_si128((const __m128i *)(l + i + 4)));
+		b = _mm_packs_epi32(_mm_loadu_si128((const __m128i *)(r + i)),
+		    _mm_loadu_si128((const __m128i *)(r + i + 4)));
+		_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(a, b));
+		_mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(a, b));
+		dst += 32;
+	}
+	il16_2(dst, src, chans, off + i, n - i);
+}
+
+static void
+il32_2_sse2(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	const int32_t	*l = src[0] + off, *r = src[1] + off;
+	__m128i		 a, b;
+	size_t		 i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		a = _mm_loadu_si128((const __m128i *)(l + i));
+		b = _mm_loadu_si128((const __m128i *)(r + i));
+		_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi32(a, b));
+		_mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi32(a, b));
+		dst += 32;
+	}
+	il32_2(dst, src, chans, off + i, n - i);
+}
+#endif
+
+#if PCM_AVX2
+/*
+ * The 256 bit unpack and pack instructions work on each 128 bit lane
+ * separately, hence the permutations.
+ */
+__attribute__((target("avx2"))) static void
+il16_2_avx2(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	const int32_t	*l = src[0] + off, *r = src[1] + off;
+	__m256i		 a, b, lo, hi;
+	size_t		 i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		a = _mm256_packs_epi32(
+		    _mm256_loadu_si256((const __m256i *)(l + i)),
+		    _mm256_loadu_si256((const __m256i *)(l + i + 8)));
+		b = _mm256_packs_epi32(
+		    _mm256_loadu_si256((const __m256i *)(r + i)),
+		    _mm256_loadu_si256((const __m256i *)(r + i + 8)));
+		a = _mm256_permute4x64_epi64(a, 0xD8);
+		b = _mm256_permute4x64_epi64(b, 0xD8);
+		lo = _mm256_unpacklo_epi16(a, b);
+		hi = _mm256_unpackhi_epi16(a, b);
+		_mm256_storeu_si256((__m256i *)dst,
+		    _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + 32),
+		    _mm256_permute2x128_si256(lo, hi, 0x31));
+		dst += 64;
+	}
+	il16_2(dst, src, chans, off + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+il32_2_avx2(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	const int32_t	*l = src[0] + off, *r = src[1] + off;
+	__m256i		 a, b, lo, hi;
+	size_t		 i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		a = _mm256_loadu_si256((const __m256i *)(l + i));
+		b = _mm256_loadu_si256((const __m256i *)(r + i));
+		lo = _mm256_unpacklo_epi32(a, b);
+		hi = _mm256_unpackhi_epi32(a, b);
+		_mm256_storeu_si256((__m256i *)dst,
+		    _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256((__m256i *)(dst + 32),
+		    _mm256_permute2x128_si256(lo, hi, 0x31));
+		dst += 64;
+	}
+	il32_2(dst, src, chans, off + i, n - i);
+}
+
+static int
+have_avx2(void)
+{
+	static int avx2 = -1;
+
+	if (avx2 == -1) {
+		__builtin_cpu_init();
+		avx2 = __builtin_cpu_supports("avx2");
+	}
+	return avx2;
+}
+#endif
+
+#if PCM_NEON
+static void
+il16_1_neon(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	const int32_t	*m = src[0] + off;
+	int16x8_t	 v;
+	size_t		 i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = vcombine_s16(vqmovn_s32(vld1q_s32(m + i)),
+		    vqmovn_s32(vld1q_s32(m + i + 4)));
+		vst1q_s16((int16_t *)dst, v);
+		dst += 16;
+	}
+	il16_1(dst, src, chans, off + i, n - i);
+}
+
+static void
+il16_2_neon(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	const int32_t	*l = src[0] + off, *r = src[1] + off;
+	int16x8x2_t	 v;
+	size_t		 i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v.val[0] = vcombine_s16(vqmovn_s32(vld1q_s32(l + i)),
+		    vqmovn_s32(vld1q_s32(l + i + 4)));
+		v.val[1] = vcombine_s16(vqmovn_s32(vld1q_s32(r + i)),
+		    vqmovn_s32(vld1q_s32(r + i + 4)));
+		vst2q_s16((int16_t *)dst, v);
+		dst += 32;
+	}
+	il16_2(dst, src, chans, off + i, n - i);
+}
+
+static void
+il32_2_neon(uint8_t *dst, const int32_t * const *src, unsigned int chans,
+    size_t off, size_t n)
+{
+	const int32_t	*l = src[0] + off, *r = src[1] + off;
+	int32x4x2_t	 v;
+	size_t		 i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		v.val[0] = vld1q_s32(l + i);
+		v.val[1] = vld1q_s32(r + i);
+		vst2q_s32((int32_t *)dst, v);
+		dst += 32;
+	}
+	il32_2(dst, src, chans, off + i, n - i);
+}
+#endif
+
+static inline int16_t
+f16(float f)
+{
+	float		 v = f * 32767.0f;
+
+	if (v >= 32767.0f)
+		return 32767;
+	if (v <= -32768.0f)
+		return -32768;
+	return v < 0 ? v - 0.5f : v + 0.5f;
+}
+
+/*
+ * Convert n float samples in the [-1, 1] range to signed 16 bit,
+ * clipping what's outside.  Interleaved input is handed over as a
+ * single channel.
+ */
+static void
+fil16_1(uint8_t *out, const float * const *in, unsigned int chans,
+    size_t off, size_t n)
+{
+	const float	*src = in[0] + off;
+	int16_t		*dst = (int16_t *)out;
+	size_t		 i = 0;
+#if PCM_SSE2
+	const __m128	 k = _mm_set1_ps(32767.0f);
+	__m128i		 a, b;
+
+	for (; i + 8 <= n; i += 8) {
+		a = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i), k));
+		b = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 4), k));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+	}
+#elif PCM_NEON && defined(__aarch64__)
+	int16x8_t	 a;
+
+	for (; i + 8 <= n; i += 8) {
+		a = vcombine_s16(
+		    vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(src + i),
+		    32767.0f))),
+		    vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(src + i + 4),
+		    32767.0f))));
+		vst1q_s16(dst + i, a);
+	}
+#endif
+
+	for (; i < n; ++i)
+		dst[i] = f16(src[i]);
+}
+
+/* the same for a stereo pair of planes */
+static void
+fil16_2(uint8_t *out, const float * const *in, unsigned int chans,
+    size_t off, size_t n)
+{
+	const float	*l = in[0] + off, *r = in[1] + off;
+	int16_t		*dst = (int16_t *)out;
+	size_t		 i = 0;
+#if PCM_SSE2
+	const __m128	 k = _mm_set1_ps(32767.0f);
+	__m128i		 a, b;
+
+	for (; i + 8 <= n; i += 8) {
+		a = _mm_packs_epi32(
+		    _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(l + i), k)),
+		    _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(l + i + 4), k)));
+		b = _mm_packs_epi32(
+		    _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(r + i), k)),
+		    _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(r + i + 4), k)));
+		_mm_storeu_si128((__m128i *)(dst + 2 * i),
+		    _mm_unpacklo_epi16(a, b));
+		_mm_storeu_si128((__m128i *)(dst + 2 * i + 8),
+		    _mm_unpackhi_epi16(a, b));
+	}
+#elif PCM_NEON && defined(__aarch64__)
+	int16x8x2_t	 v;
+
+	for (; i + 8 <= n; i += 8) {
+		v.val[0] = vcombine_s16(
+		    vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(l + i),
+		    32767.0f))),
+		    vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(l + i + 4),
+		    32767.0f))));
+		v.val[1] = vcombine_s16(
+		    vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(r + i),
+		    32767.0f))),
+		    vqmovn_s32(vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(r + i + 4),
+		    32767.0f))));
+		vst2q_s16(dst + 2 * i, v);
+	}
+#endif
+
+	for (; i < n; ++i) {
+		dst[2 * i] = f16(l[i]);
+		dst[2 * i + 1] = f16(r[i]);
+	}
+}
+
+/*
+ * Stereo float to signed 32 bit.  The vector versions clip to the
+ * largest float below 2^31, since SSE2 turns what overflows into
+ * INT32_MIN.
+ */
+static void
+fils32_2(uint8_t *out, const float * const *in, unsigned int chans,
+    size_t off, size_t n)
+{
+	const float	*l = in[0] + off, *r = in[1] + off;
+	size_t		 i = 0;
+	int32_t		 v[2];
+#if PCM_SSE2
+	const __m128	 k = _mm_set1_ps(2147483648.0f);
+	const __m128	 hi = _mm_set1_ps(2147483520.0f);
+	const __m128	 lo = _mm_set1_ps(-2147483648.0f);
+	__m128i		 a, b;
+
+	for (; i + 4 <= n; i += 4) {
+		a = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(
+		    _mm_mul_ps(_mm_loadu_ps(l + i), k), hi), lo));
+		b = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(
+		    _mm_mul_ps(_mm_loadu_ps(r + i), k), hi), lo));
+		_mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi32(a, b));
+		_mm_storeu_si128((__m128i *)(out + 16),
+		    _mm_unpackhi_epi32(a, b));
+		out += 32;
+	}
+#elif PCM_NEON && defined(__aarch64__)
+	int32x4x2_t	 w;
+
+	/* the conversion saturates already */
+	for (; i + 4 <= n; i += 4) {
+		w.val[0] = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(l + i),
+		    2147483648.0f));
+		w.val[1] = vcvtnq_s32_f32(vmulq_n_f32(vld1q_f32(r + i),
+		    2147483648.0f));
+		vst2q_s32((int32_t *)out, w);
+		out += 32;
+	}
+#endif
+
+	for (; i < n; ++i) {
+		v[0] = fscale(l[i], 2147483647.0);
+		v[1] = fscale(r[i], 2147483647.0);
+		memcpy(out, v, sizeof(v));
+		out += sizeof(v);
+	}
+}
+
+/* stereo float to interleaved float */
+static void
+fil32_2(uint8_t *out, const float * const *in, unsigned int chans,
+    size_t off, size_t n)
+{
+	const float	*l = in[0] + off, *r = in[1] + off;
+	size_t		 i = 0;
+	float		 v[2];
+#if PCM_SSE2
+	__m128		 a, b;
+
+	for (; i + 4 <= n; i += 4) {
+		a = _mm_loadu_ps(l + i);
+		b = _mm_loadu_ps(r + i);
+		_mm_storeu_ps((float *)out, _mm_unpacklo_ps(a, b));
+		_mm_storeu_ps((float *)(out + 16), _mm_unpackhi_ps(a, b));
+		out += 32;
+	}
+#elif PCM_NEON
+	float32x4x2_t	 w;
+
+	for (; i + 4 <= n; i += 4) {
+		w.val[0] = vld1q_f32(l + i);
+		w.val[1] = vld1q_f32(r + i);
+		vst2q_f32((float *)out, w);
+		out += 32;
+	}
+#endif
+
+	for (; i < n; ++i) {
+		v[0] = l[i];
+		v[1] = r[i];
+		memcpy(out, v, sizeof(v));
+		out += sizeof(v);
+	}
+}
+
+/* the natural layout for samples of the given bits */
+int
+pcm_format(unsigned int bits)
+{
+	if (bits == 0 || bits > 32)
+		return 0;
+	if (bits <= 8)
+		return PCM_S8;
+	if (bits <= 16)
+		return PCM_S16;
+	if (bits <= 24)
+		return PCM_S24_3;
+	return PCM_S32;
+}
+
+/*
+ * Pick the layout to send to a device that takes the ones in mask
+ * for a source in fmt.  The narrowest lossless one wins, then the
+ * widest of the rest.  Returns 0 if there's nothing in common.
+ */
+int
+pcm_choose(int fmt, int mask)
+{
+	static const int prefs[][6] = {
+		{ PCM_S8, PCM_S16, PCM_S24_3, PCM_S24, PCM_S32, PCM_F32 },
+		{ PCM_S16, PCM_S24_3, PCM_S24, PCM_S32, PCM_F32, PCM_S8 },
+		{ PCM_S24_3, PCM_S24, PCM_S32, PCM_F32, PCM_S16, PCM_S8 },
+		{ PCM_S24, PCM_S24_3, PCM_S32, PCM_F32, PCM_S16, PCM_S8 },
+		{ PCM_S32, PCM_F32, PCM_S24_3, PCM_S24, PCM_S16, PCM_S8 },
+		/* lossy sources: 16 bits are enough */
+		{ PCM_F32, PCM_S16, PCM_S24_3, PCM_S24, PCM_S32, PCM_S8 },
+	};
+	size_t		 i, j;
+
+	for (i = 0; i < sizeof(prefs) / sizeof(prefs[0]); ++i) {
+		if (prefs[i][0] != fmt)
+			continue;
+		for (j = 0; j < sizeof(prefs[i]) / sizeof(prefs[i][0]); ++j)
+			if (mask & prefs[i][j])
+				return prefs[i][j];
+	}
+	return 0;
+}
+
+/* bytes used to store a sample in the given layout */
+size_t
+pcm_width(int fmt)
+{
+	switch (fmt) {
+	case PCM_S8:
+		return 1;
+	case PCM_S16:
+		return 2;
+	case PCM_S24_3:
+		return 3;
+	case PCM_S24:
+	case PCM_S32:
+	case PCM_F32:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+const char *
+pcm_name(int fmt)
+{
+	switch (fmt) {
+	case PCM_S8:
+		return "s8";
+	case PCM_S16:
+		return "s16";
+	case PCM_S24_3:
+		return "s24_3";
+	case PCM_S24:
+		return "s24";
+	case PCM_S32:
+		return "s32";
+	case PCM_F32:
+		return "f32";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+ * Select the best kernel to write planar samples of the given bits
+ * in the layout fmt.  Meant to be called once per stream, not per
+ * block.
+ */
+pcm_interleave_fn
+pcm_interleaver(unsigned int bits, int fmt, unsigned int chans)
+{
+	if (chans == 0 || bits == 0 || bits > 32 || pcm_width(fmt) == 0)
+		return NULL;
+
+	if (fmt == PCM_S8 && bits == 8)
+		return il8;
+
+	if (fmt == PCM_S16 && bits == 16) {
+		if (chans == 1) {
+#if PCM_SSE2
+			return il16_1_sse2;
+#elif PCM_NEON
+			return il16_1_neon;
+#else
+			return il16_1;
+#endif
+		}
+		if (chans == 2) {
+#if PCM_AVX2
+			if (have_avx2())
+				return il16_2_avx2;
+#endif
+#if PCM_SSE2
+			return il16_2_sse2;
+#elif PCM_NEON
+			return il16_2_neon;
+#else
+			return il16_2;
+#endif
+		}
+		return il16;
+	}
+
+	if ((fmt == PCM_S24 && bits == 24) || (fmt == PCM_S32 && bits == 32)) {
+		if (chans == 1)
+			return il32_1;
+		if (chans == 2) {
+#if PCM_AVX2
+			if (have_avx2())
+				return il32_2_avx2;
+#endif
+#if PCM_SSE2
+			return il32_2_sse2;
+#elif PCM_NEON
+			return il32_2_neon;
+#else
+			return il32_2;
+#endif
+		}
+		return il32;
+	}
+
+	if (fmt == PCM_S24_3 && bits == 24)
+		return il24_3;
+
+	cv_bits = bits;
+	cv_fmt = fmt;
+	return ilany;
+}
+
+/* the same for float samples */
+pcm_finterleave_fn
+pcm_finterleaver(int fmt, unsigned int chans)
+{
+	if (chans == 0 || pcm_width(fmt) == 0)
+		return NULL;
+
+	if (chans == 1 && fmt == PCM_S16)
+		return fil16_1;
+	if (chans == 1 && fmt == PCM_F32)
+		return fil32_1;
+	if (chans == 2 && fmt == PCM_S16)
+		return fil16_2;
+	if (chans == 2 && fmt == PCM_S32)
+		return fils32_2;
+	if (chans == 2 && fmt == PCM_F32)
+		return fil32_2;
+
+	cv_fmt = fmt;
+	return filany;
+}
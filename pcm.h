@@ -0,0 +1,58 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef PCM_H
+#define PCM_H
+
+/*
+ * Conversion kernels from the decoders' sample layout to the packed,
+ * interleaved, native-endian frames handed to the audio device.
+ */
+
+/* sample layouts, in host byte order */
+#define PCM_S8		0x01
+#define PCM_S16		0x02
+#define PCM_S24_3	0x04	/* 24 bits packed in three bytes */
+#define PCM_S24		0x08	/* 24 bits in the low part of four bytes */
+#define PCM_S32		0x10
+#define PCM_F32		0x20	/* float in the [-1, 1] range */
+
+/*
+ * Interleave nframes planar samples of every channel, starting at
+ * frame off, into dst.
+ */
+typedef void (*pcm_interleave_fn)(uint8_t *, const int32_t * const *,
+    unsigned int, size_t, size_t);
+typedef void (*pcm_finterleave_fn)(uint8_t *, const float * const *,
+    unsigned int, size_t, size_t);
+
+int			pcm_format(unsigned int);
+int			pcm_choose(int, int);
+size_t			pcm_width(int);
+const char		*pcm_name(int);
+pcm_interleave_fn	pcm_interleaver(unsigned int, int, unsigned int);
+pcm_finterleave_fn	pcm_finterleaver(int, unsigned int);
+
+#endif
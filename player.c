@@ -27,37 +27,306 @@
 #include <stdint.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "amused.h"
 #include "log.h"
+#include "pcm.h"
+#include "resample.h"
+#include "trace.h"
 #include "xmalloc.h"
 
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
 struct pollfd		*player_pfds;
 int			 player_nfds;
 static struct imsgbuf	*imsgbuf;
 
 static int nextfd = -1;
+static int (*nextdec)(int, const char **);
+static int prepfd = -1;
+static int (*prepdec)(int, const char **);
+static uint32_t prepid;
+static uint32_t nextid;
+static uint32_t curid;
+static struct track_index nextindex = { .duration = -1 };
+static struct track_index prepindex = { .duration = -1 };
+static struct track_index curindex = { .duration = -1 };
 static int64_t samples;
 static int64_t duration;
 static unsigned int current_rate;
+static unsigned int device_rate;
+static int current_fmt;
+static unsigned int current_chans;
+
+static uint32_t nexttrace;
+static uint32_t preptrace;
+static uint32_t curtrace;
+static int firstwrite;		/* the track reached the ring */
+static int draining;		/* playing what the last track left */
+
+static struct player_stats pstats;
+static int64_t decoding = -1;	/* since the last play() returned */
+static int64_t starting = -1;	/* since the track was started */
+
+/*
+ * PCM queued between the decoders and the audio device.  Decoders
+ * fill it and the device is fed only once it's (almost) full, so
+ * that it isn't polled for every small chunk and decoding spikes are
+ * absorbed.  The size is always a multiple of the frame size.
+ */
+static struct {
+	uint8_t	*buf;
+	size_t	 size;		/* allocated */
+	size_t	 cap;		/* in use for the current format */
+	size_t	 len;
+	size_t	 r;
+	size_t	 bpf;
+	size_t	 fed;		/* written since the last device write */
+	int	 ms;
+	int	 profile;
+	int	 formats;	/* taken by the device */
+	unsigned int outrate;	/* fixed device rate, or 0 */
+	int	 resampling;
+} ring;
 
 volatile sig_atomic_t halted;
 
+static int64_t
+player_usec(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		fatal("clock_gettime");
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void
+player_hist(uint64_t *hist, int64_t usec)
+{
+	int i;
+
+	for (i = 0; i < STATS_HIST - 1 && usec >= 2; ++i)
+		usec >>= 1;
+	hist[i]++;
+}
+
+static void
+player_trace(uint32_t track, int stage)
+{
+	struct trace_event ev;
+
+	if (track == 0)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.usec = player_usec();
+	ev.track = track;
+	ev.stage = stage;
+	ev.proc = TRACE_PLAYER;
+	imsg_compose(imsgbuf, IMSG_TRACE, 0, 0, -1, &ev, sizeof(ev));
+}
+
+static void
+player_sendstats(void)
+{
+	pstats.xruns = audio_xruns();
+	imsg_compose(imsgbuf, IMSG_STATS, 0, 0, -1, &pstats, sizeof(pstats));
+}
+
 static void
 player_signal_handler(int signo)
 {
 	halted = 1;
 }
 
+static size_t
+ring_write(const uint8_t *buf, size_t len)
+{
+	size_t w, n;
+
+	if (len > ring.cap - ring.len)
+		len = ring.cap - ring.len;
+
+	w = (ring.r + ring.len) % ring.cap;
+	n = MIN(len, ring.cap - w);
+	memcpy(ring.buf + w, buf, n);
+	memcpy(ring.buf, buf + n, len - n);
+
+	ring.len += len;
+	ring.fed += len;
+	return len;
+}
+
+static void
+ring_write_audio(void)
+{
+	size_t w, n;
+
+	while (ring.len > 0) {
+		n = MIN(ring.len, ring.cap - ring.r);
+		w = audio_write(ring.buf + ring.r, n);
+		ring.r = (ring.r + w) % ring.cap;
+		ring.len -= w;
+		pstats.written += w;
+		if (firstwrite && w > 0) {
+			player_trace(curtrace, TRACE_WRITTEN);
+			firstwrite = 0;
+		}
+		if (w < n) {
+			pstats.short_writes++;
+			break;
+		}
+	}
+}
+
+static void
+ring_discard(void)
+{
+	ring.len = 0;
+	ring.r = 0;
+	ring.fed = 0;
+	if (ring.resampling)
+		resample_reset();
+}
+
+/* play what's left in the ring, without handling any message */
+static void
+ring_drain(void)
+{
+	int revents;
+
+	while (ring.len > 0) {
+		audio_pollfd(player_pfds + 1, player_nfds, POLLOUT);
+		if (poll(player_pfds + 1, player_nfds, INFTIM) == -1)
+			fatal("poll");
+		pstats.wakeups++;
+
+		revents = audio_revents(player_pfds + 1, player_nfds);
+		if (revents & POLLHUP) {
+			if (errno == EAGAIN)
+				continue;
+			fatal("audio hang-up");
+		}
+		if (revents & POLLOUT)
+			ring_write_audio();
+	}
+}
+
+/*
+ * Output buffer of the decoders, shared since only one runs at a
+ * time.  It grows to the largest size asked so far and is kept.
+ */
+void *
+player_buffer(size_t len)
+{
+	static void *buf;
+	static size_t size;
+
+	if (len > size) {
+		free(buf);
+		buf = xmalloc(len);
+		size = len;
+	}
+	return buf;
+}
+
+/* the layouts the device takes, for the decoders that can choose */
+int
+player_formats(void)
+{
+	return ring.formats;
+}
+
+/*
+ * Set up the device for a stream of the given layout, rate and
+ * channels.  Returns the layout the decoder has to write, which is
+ * the closest to fmt that the device takes, or -1.
+ */
 int
-player_setup(unsigned int bits, unsigned int rate, unsigned int channels)
+player_setup(int fmt, unsigned int rate, unsigned int channels)
 {
-	log_debug("%s: bits=%u, rate=%u, channels=%u", __func__,
-	    bits, rate, channels);
+	size_t bpf, cap, frames = 0;
+	unsigned int devrate;
+	int out, mask, changed, resampling;
+
+	log_debug("%s: fmt=%s, rate=%u, channels=%u", __func__,
+	    pcm_name(fmt), rate, channels);
+	player_trace(curtrace, TRACE_SETUP);
+
+	mask = ring.formats;
+ again:
+	if ((out = pcm_choose(fmt, mask)) == 0) {
+		log_warnx("no sample format to play %s", pcm_name(fmt));
+		return -1;
+	}
+
+	/*
+	 * With a fixed output rate the device is left alone when only
+	 * the rate of the tracks changes.
+	 */
+	devrate = rate;
+	resampling = 0;
+	if (ring.outrate != 0 && ring.outrate != rate) {
+		if (resample_setup(out, channels, rate, ring.outrate) == 0) {
+			devrate = ring.outrate;
+			resampling = 1;
+		} else
+			log_warnx("playing at %u Hz", rate);
+	}
+
+	/* the tail of the previous track is in the old format */
+	changed = out != current_fmt || devrate != device_rate ||
+	    channels != current_chans;
+	if (changed)
+		ring_drain();
+
+	/* don't carry the history over to a later track */
+	if (ring.resampling && !resampling)
+		resample_reset();
 
 	current_rate = rate;
-	return audio_setup(bits, rate, channels, player_pfds + 1, player_nfds);
+	current_fmt = out;
+	current_chans = channels;
+	device_rate = devrate;
+	ring.resampling = resampling;
+	if (audio_setup(out, devrate, channels, ring.profile, &frames,
+	    player_pfds + 1, player_nfds) == -1) {
+		/* try the next best */
+		mask &= ~out;
+		current_fmt = 0;
+		goto again;
+	}
+
+	if (changed) {
+		/*
+		 * The device is fed once half of the ring is free, so
+		 * make it at least twice what the device buffers.
+		 */
+		bpf = pcm_width(out) * channels;
+		cap = MAX((size_t)devrate * ring.ms / 1000, 1024);
+		cap = MAX(cap, frames * 2) * bpf;
+		log_debug("%s: device buffer %zu frames, ring %zu frames",
+		    __func__, frames, cap / bpf);
+		if (cap > ring.size) {
+			free(ring.buf);
+			ring.buf = xmalloc(cap);
+			ring.size = cap;
+		}
+		ring_discard();
+		ring.cap = cap;
+		ring.bpf = bpf;
+	}
+
+	player_trace(curtrace, TRACE_CONFIGURED);
+	return out;
 }
 
 void
@@ -71,22 +340,84 @@ player_setduration(int64_t d)
 	imsg_flush(imsgbuf);
 }
 
+/* convert frames played by the device to frames of the track */
+static int64_t
+player_frames(int64_t frames)
+{
+	static int64_t rem;
+
+	if (!ring.resampling)
+		return frames;
+
+	frames = frames * current_rate + rem;
+	rem = frames % device_rate;
+	return frames / device_rate;
+}
+
 static void
 player_onmove(void *arg, int delta)
 {
 	static int64_t reported;
 	int64_t sec;
 
-	samples += delta;
+	samples += player_frames(delta);
 	if (llabs(samples - reported) >= current_rate) {
 		reported = samples;
 		sec = samples / current_rate;
 
 		imsg_compose(imsgbuf, IMSG_POS, 0, 0, -1, &sec, sizeof(sec));
+		player_sendstats();
 		imsg_flush(imsgbuf);
 	}
 }
 
+/* what main had cached about the current track, if anything */
+const struct track_index *
+player_index(void)
+{
+	if (curindex.duration < 0)
+		return NULL;
+	return &curindex;
+}
+
+/* hand the index over to main, which will cache it */
+void
+player_saveindex(const struct track_index *index)
+{
+	struct player_track track;
+
+	memcpy(&curindex, index, sizeof(curindex));
+
+	/* main may have moved on already: tell which track it's for */
+	memset(&track, 0, sizeof(track));
+	track.id = curid;
+	memcpy(&track.index, index, sizeof(track.index));
+	imsg_compose(imsgbuf, IMSG_INDEX, 0, 0, -1, &track, sizeof(track));
+	imsg_flush(imsgbuf);
+}
+
+void
+player_saveduration(int64_t d)
+{
+	struct track_index index;
+
+	if (curindex.duration == d)
+		return;
+
+	memset(&index, 0, sizeof(index));
+	index.duration = d;
+	player_saveindex(&index);
+}
+
+static void
+player_getindex(struct imsg *imsg, struct player_track *track)
+{
+	if (imsg_get_data(imsg, track, sizeof(*track)) == -1)
+		fatalx("%s: wrong size", __func__);
+	if (track->index.nseek > TRACK_NSEEK)
+		fatalx("%s: too many seek points", __func__);
+}
+
 void
 player_setpos(int64_t pos)
 {
@@ -94,11 +425,75 @@ player_setpos(int64_t pos)
 	player_onmove(NULL, 0);
 }
 
+static int
+player_sniff(int fd, int (**dec)(int, const char **), const char **errstr)
+{
+	static char buf[512];
+	ssize_t r;
+
+	r = read(fd, buf, sizeof(buf));
+
+	/* 8 byte is the larger magic number */
+	if (r < 8) {
+		*errstr = "read failed";
+		return -1;
+	}
+
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		*errstr = "lseek failed";
+		return -1;
+	}
+
+	if (memcmp(buf, "fLaC", 4) == 0)
+		*dec = play_flac;
+	else if (memcmp(buf, "ID3", 3) == 0 ||
+	    memcmp(buf, "\xFF\xFB", 2) == 0)
+		*dec = play_mp3;
+	else if (memmem(buf, r, "OpusHead", 8) != NULL)
+		*dec = play_opus;
+	else if (memmem(buf, r, "OggS", 4) != NULL)
+		*dec = play_oggvorbis;
+	else {
+		*errstr = "unknown file type";
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Keep the following track ready so that it can start as soon as the
+ * current one ends.  The file type is sniffed now, which also brings
+ * the first block of the file in memory.  A later failure will be
+ * reported when the track is actually played.
+ */
+static void
+player_prepare(int fd, const struct player_track *track)
+{
+	const char *errstr;
+
+	if (prepfd != -1)
+		close(prepfd);
+
+	prepfd = fd;
+	prepdec = NULL;
+	prepid = track->id;
+	preptrace = prepfd != -1 ? track->trace : 0;
+	memcpy(&prepindex, &track->index, sizeof(prepindex));
+	player_trace(preptrace, TRACE_RECV);
+
+	if (prepfd != -1 && player_sniff(prepfd, &prepdec, &errstr) == -1)
+		log_debug("%s: %s", __func__, errstr);
+	else
+		player_trace(preptrace, TRACE_SNIFFED);
+}
+
 /* process only one message */
 static int
 player_dispatch(int64_t *s, int wait)
 {
 	struct player_seek seek;
+	struct player_track track;
 	struct pollfd	pfd;
 	struct imsg	imsg;
 	ssize_t		n;
@@ -132,8 +527,22 @@ again:
 			fatalx("track already enqueued");
 		if ((nextfd = imsg_get_fd(&imsg)) == -1)
 			fatalx("%s: got invalid file descriptor", __func__);
+		player_getindex(&imsg, &track);
+		memcpy(&nextindex, &track.index, sizeof(nextindex));
+		nextdec = NULL;
+		nextid = track.id;
+		nexttrace = track.trace;
+		player_trace(nexttrace, TRACE_RECV);
 		log_debug("song enqueued");
-		ret = IMSG_STOP;
+
+		/* main will prepare the next track again */
+		memset(&track, 0, sizeof(track));
+		track.index.duration = -1;
+		player_prepare(-1, &track);
+		break;
+	case IMSG_PREPARE:
+		player_getindex(&imsg, &track);
+		player_prepare(imsg_get_fd(&imsg), &track);
 		break;
 	case IMSG_RESUME:
 	case IMSG_PAUSE:
@@ -173,55 +582,77 @@ player_senderr(const char *errstr)
 	imsg_flush(imsgbuf);
 }
 
+/*
+ * Tell main that the track is over.  If a following track was
+ * prepared, it's started right away without waiting for main: the
+ * id lets main know which track the player moved on to.
+ */
 static void
 player_sendeof(void)
 {
-	imsg_compose(imsgbuf, IMSG_EOF, 0, 0, -1, NULL, 0);
+	uint32_t id = 0;
+
+	if (nextfd == -1 && prepfd != -1) {
+		nextfd = prepfd;
+		nextdec = prepdec;
+		id = prepid;
+		nextid = prepid;
+		nexttrace = preptrace;
+		memcpy(&nextindex, &prepindex, sizeof(nextindex));
+
+		prepfd = -1;
+		prepdec = NULL;
+		preptrace = 0;
+	}
+
+	player_sendstats();
+	imsg_compose(imsgbuf, IMSG_EOF, 0, 0, -1, &id, sizeof(id));
 	imsg_flush(imsgbuf);
 }
 
 static int
 player_playnext(const char **errstr)
 {
-	static char buf[512];
-	ssize_t r;
+	int (*dec)(int, const char **) = nextdec;
 	int fd = nextfd;
 
 	assert(nextfd != -1);
 	nextfd = -1;
-
-	/* reset samples and set position to zero */
+	nextdec = NULL;
+	memcpy(&curindex, &nextindex, sizeof(curindex));
+	curid = nextid;
+	nextid = 0;
+
+	starting = player_usec();
+	decoding = -1;
+	curtrace = nexttrace;
+	nexttrace = 0;
+	firstwrite = 0;
+	player_trace(curtrace, TRACE_START);
+
+	/*
+	 * Reset samples and set position to zero.  What's still in
+	 * the ring belongs to the previous track, it'll be played
+	 * before this one starts.
+	 */
 	samples = 0;
 	imsg_compose(imsgbuf, IMSG_POS, 0, 0, -1, &samples, sizeof(samples));
 	imsg_flush(imsgbuf);
-
-	r = read(fd, buf, sizeof(buf));
-
-	/* 8 byte is the larger magic number */
-	if (r < 8) {
-		*errstr = "read failed";
-		goto err;
+	if (ring.len > 0) {
+		samples = -(int64_t)(ring.len / ring.bpf);
+		if (ring.resampling)
+			samples = samples * current_rate / device_rate;
 	}
 
-	if (lseek(fd, 0, SEEK_SET) == -1) {
-		*errstr = "lseek failed";
-		goto err;
+	if (dec == NULL) {
+		if (player_sniff(fd, &dec, errstr) == -1) {
+			close(fd);
+			return -1;
+		}
+		player_trace(curtrace, TRACE_SNIFFED);
 	}
 
-	if (memcmp(buf, "fLaC", 4) == 0)
-		return play_flac(fd, errstr);
-	if (memcmp(buf, "ID3", 3) == 0 ||
-	    memcmp(buf, "\xFF\xFB", 2) == 0)
-		return play_mp3(fd, errstr);
-	if (memmem(buf, r, "OpusHead", 8) != NULL)
-		return play_opus(fd, errstr);
-	if (memmem(buf, r, "OggS", 4) != NULL)
-		return play_oggvorbis(fd, errstr);
-
-	*errstr = "unknown file type";
-err:
-	close(fd);
-	return -1;
+	return dec(fd, errstr);
 }
 
 static int
@@ -229,7 +660,9 @@ player_pause(int64_t *s)
 {
 	int r;
 
-	r = player_dispatch(s, 1);
+	/* a track may be prepared while paused */
+	while ((r = player_dispatch(s, 1)) == IMSG_PREPARE)
+		continue;
 	return r == IMSG_RESUME || r == IMSG_CTL_SEEK;
 }
 
@@ -237,6 +670,11 @@ static int
 player_shouldstop(int64_t *s, int wait)
 {
 	switch (player_dispatch(s, wait)) {
+	case IMSG_PLAY:
+		/* the tail of the last track is played before it */
+		if (draining)
+			break;
+		return 1;
 	case IMSG_PAUSE:
 		if (player_pause(s))
 			break;
@@ -248,64 +686,172 @@ player_shouldstop(int64_t *s, int wait)
 	return 0;
 }
 
-int
-play(const void *buf, size_t len, int64_t *s)
+/*
+ * Feed the audio device from the ring.  If block is set, waits for
+ * the device to be writable.  Returns 0 if playback has to stop.
+ */
+static int
+player_output(int64_t *s, int block)
 {
-	size_t w;
 	int revents, r, wait;
 
-	*s = -1;
-	while (len != 0) {
-		audio_pollfd(player_pfds + 1, player_nfds, POLLOUT);
-		r = poll(player_pfds, player_nfds + 1, INFTIM);
-		if (r == -1)
-			fatal("poll");
+	audio_pollfd(player_pfds + 1, player_nfds, POLLOUT);
+	r = poll(player_pfds, player_nfds + 1, block ? INFTIM : 0);
+	if (r == -1)
+		fatal("poll");
+	pstats.wakeups++;
+
+	wait = player_pfds[0].revents & (POLLHUP|POLLIN);
+	if (player_shouldstop(s, wait)) {
+		ring_discard();
+		audio_flush();
+		return 0;
+	}
 
-		wait = player_pfds[0].revents & (POLLHUP|POLLIN);
-		if (player_shouldstop(s, wait)) {
-			audio_flush();
-			return 0;
-		}
+	revents = audio_revents(player_pfds + 1, player_nfds);
+	if (revents & POLLHUP) {
+		if (errno == EAGAIN)
+			return 1;
+		fatal("audio hang-up");
+	}
+	if (revents & POLLOUT)
+		ring_write_audio();
 
-		revents = audio_revents(player_pfds + 1, player_nfds);
-		if (revents & POLLHUP) {
-			if (errno == EAGAIN)
-				continue;
-			fatal("audio hang-up");
-		}
-		if (revents & POLLOUT) {
-			w = audio_write(buf, len);
-			len -= w;
-			buf += w;
-		}
+	return 1;
+}
+
+static int
+play_ring(const void *buf, size_t len, int64_t *s)
+{
+	const uint8_t *p = buf;
+	size_t w;
+	int full;
+
+	*s = -1;
+	for (;;) {
+		w = ring_write(p, len);
+		p += w;
+		len -= w;
+
+		/*
+		 * Keep decoding while there's room, but don't let the
+		 * device go too long without data.
+		 */
+		if (len == 0 && ring.fed < ring.cap / 4)
+			return 1;
+		ring.fed = 0;
+
+		/* once full, let the device consume half of the ring */
+		full = len != 0;
+		do {
+			if (!player_output(s, full))
+				return 0;
+			if (*s != -1) {
+				/* what's queued is stale now */
+				ring_discard();
+				return 1;
+			}
+		} while (full && ring.len > ring.cap / 2);
+
+		if (len == 0)
+			return 1;
 	}
+}
+
+static int
+play_resample(const void *buf, size_t len, int64_t *s)
+{
+	const uint8_t *p = buf, *out;
+	size_t n, outlen;
+
+	if (!ring.resampling)
+		return play_ring(buf, len, s);
 
+	*s = -1;
+	while (len > 0) {
+		n = resample(p, len, &out, &outlen);
+		if (n == 0)
+			break;
+		p += n;
+		len -= n;
+
+		if (outlen > 0 && !play_ring(out, outlen, s))
+			return 0;
+		if (*s != -1)
+			break;
+	}
 	return 1;
 }
 
+/*
+ * Called by the decoders for every buffer: the time since the
+ * previous call returned is what decoding it took.
+ */
 int
-player(int debug, int verbose)
+play(const void *buf, size_t len, int64_t *s)
 {
+	int64_t now;
 	int r;
 
-	log_init(debug, LOG_DAEMON);
-	log_setverbose(verbose);
+	now = player_usec();
+	if (starting != -1) {
+		firstwrite = 1;
+		player_hist(pstats.start, now - starting);
+		pstats.tracks++;
+		starting = -1;
+	} else if (decoding != -1)
+		player_hist(pstats.decode, now - decoding);
+
+	r = play_resample(buf, len, s);
+	decoding = player_usec();
+	return r;
+}
 
-	setproctitle("player");
-	log_procinit("player");
+/*
+ * Play the track in fd to the end and drain the ring, without going
+ * through main.  Used by the benchmarks with the null backend.
+ */
+int
+player_bench(int fd, const char **name, const char **errstr)
+{
+	if (player_sniff(fd, &nextdec, errstr) == -1) {
+		close(fd);
+		return -1;
+	}
 
-#if 0
-	{
-		static int attached;
+	if (nextdec == play_flac)
+		*name = "flac";
+	else if (nextdec == play_mp3)
+		*name = "mp3";
+	else if (nextdec == play_opus)
+		*name = "opus";
+	else
+		*name = "vorbis";
+
+	nextfd = fd;
+	memset(&nextindex, 0, sizeof(nextindex));
+	nextindex.duration = -1;
+	if (player_playnext(errstr) == -1)
+		return -1;
+
+	ring_drain();
+	return 0;
+}
 
-		while (!attached)
-			sleep(1);
-	}
-#endif
+/* the imsg channel to main is expected on fd 3 */
+void
+player_init(int bufms, int profile, int rate)
+{
+	ring.ms = bufms;
+	ring.profile = profile;
+	ring.outrate = rate;
 
 	if (audio_open(player_onmove) == -1)
 		fatal("audio_open");
 
+	if ((ring.formats = audio_formats()) == 0)
+		fatalx("audio_formats: no usable sample format");
+
 	if ((player_nfds = audio_nfds()) <= 0)
 		fatal("audio_nfds: invalid number of file descriptors: %d",
 		    player_nfds);
@@ -320,6 +866,30 @@ player(int debug, int verbose)
 
 	imsgbuf = xmalloc(sizeof(*imsgbuf));
 	imsg_init(imsgbuf, 3);
+}
+
+int
+player(int debug, int verbose, int bufms, int profile, int rate)
+{
+	int64_t s;
+	int r;
+
+	log_init(debug, LOG_DAEMON);
+	log_setverbose(verbose);
+
+	setproctitle("player");
+	log_procinit("player");
+
+#if 0
+	{
+		static int attached;
+
+		while (!attached)
+			sleep(1);
+	}
+#endif
+
+	player_init(bufms, profile, rate);
 
 	signal(SIGINT, player_signal_handler);
 	signal(SIGTERM, player_signal_handler);
@@ -333,6 +903,17 @@ player(int debug, int verbose)
 	while (!halted) {
 		const char *errstr = NULL;
 
+		/* play the tail of the last track before idling */
+		draining = 1;
+		while (nextfd == -1 && ring.len > 0) {
+			s = -1;
+			if (!player_output(&s, 1))
+				break;
+			if (s != -1)
+				ring_discard();
+		}
+		draining = 0;
+
 		while (nextfd == -1)
 			player_dispatch(NULL, 1);
 
@@ -21,17 +21,58 @@
 
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <mpg123.h>
 
 #include "amused.h"
+#include "input.h"
 #include "log.h"
+#include "pcm.h"
+
+/* how often, in seconds of audio, to refine an estimated duration */
+#define REFINE_EVERY	10
+
+static long	rate;
+
+static const struct {
+	int	fmt;
+	int	enc;
+} encodings[] = {
+	{ PCM_S8,	MPG123_ENC_SIGNED_8 },
+	{ PCM_S16,	MPG123_ENC_SIGNED_16 },
+	{ PCM_S24_3,	MPG123_ENC_SIGNED_24 },
+	{ PCM_S32,	MPG123_ENC_SIGNED_32 },
+	{ PCM_F32,	MPG123_ENC_FLOAT_32 },
+};
+
+/* have mpg123 decode straight to what the device takes */
+static void
+set_encoding(mpg123_handle *mh)
+{
+	const long	*rates;
+	size_t		 i, nrates;
+	int		 fmt;
+
+	fmt = pcm_choose(PCM_S16, player_formats());
+	for (i = 0; i < sizeof(encodings) / sizeof(encodings[0]); ++i)
+		if (encodings[i].fmt == fmt)
+			break;
+	if (i == sizeof(encodings) / sizeof(encodings[0]))
+		return;
+
+	mpg123_rates(&rates, &nrates);
+	mpg123_format_none(mh);
+	while (nrates-- > 0)
+		mpg123_format(mh, rates[nrates], MPG123_MONO | MPG123_STEREO,
+		    encodings[i].enc);
+}
 
 static int
 setup(mpg123_handle *mh)
 {
-	long	rate;
+	size_t	i;
 	int	chan, enc;
 
 	if (mpg123_getformat(mh, &rate, &chan, &enc) != MPG123_OK) {
@@ -39,39 +80,184 @@ setup(mpg123_handle *mh)
 		return 0;
 	}
 
-	if (player_setup(mpg123_encsize(enc) * 8, rate, chan) == -1)
-		err(1, "player_setup");
+	for (i = 0; i < sizeof(encodings) / sizeof(encodings[0]); ++i)
+		if (encodings[i].enc == enc)
+			break;
+	if (i == sizeof(encodings) / sizeof(encodings[0])) {
+		log_warnx("unsupported mpg123 encoding %x", enc);
+		return 0;
+	}
+
+	if (player_setup(encodings[i].fmt, rate, chan) != encodings[i].fmt) {
+		log_warnx("can't play %s", pcm_name(encodings[i].fmt));
+		return 0;
+	}
 
 	return 1;
 }
 
+static ssize_t
+readcb(void *handle, void *buf, size_t len)
+{
+	return input_read(handle, buf, len);
+}
+
+static off_t
+seekcb(void *handle, off_t off, int whence)
+{
+	if (input_seek(handle, off, whence) == -1)
+		return -1;
+	return input_tell(handle);
+}
+
+/*
+ * Whether mpg123_length() is exact, as is the case for CBR files
+ * or when there's a Xing/VBRI/LAME header, or just a guess.
+ */
+static int
+length_accurate(mpg123_handle *mh)
+{
+	long val = 0;
+
+	if (mpg123_getstate(mh, MPG123_ACCURATE, &val, NULL) != MPG123_OK)
+		return 0;
+	return val;
+}
+
+/*
+ * Extrapolate the duration from the ratio between the samples
+ * decoded and the bytes consumed so far.
+ */
+static void
+refine_length(mpg123_handle *mh, int64_t size, int64_t *reported)
+{
+	off_t	 samples, bytes;
+	int64_t	 est;
+
+	samples = mpg123_tell(mh);
+	bytes = mpg123_tell_stream(mh);
+	if (samples <= 0 || bytes <= 0 || size <= 0)
+		return;
+
+	est = (double)samples * size / bytes;
+	if (est > *reported - rate && est < *reported + rate)
+		return;
+
+	*reported = est;
+	player_setduration(est);
+}
+
+/* hand mpg123 the coarse frame index cached from a previous play */
+static int
+load_index(mpg123_handle *mh, const struct track_index *index)
+{
+	off_t	offs[TRACK_NSEEK];
+	size_t	i;
+
+	if (index->nseek == 0 || index->step == 0)
+		return 0;
+
+	for (i = 0; i < index->nseek; ++i)
+		offs[i] = index->seek[i];
+	return mpg123_set_index(mh, offs, index->step, index->nseek)
+	    == MPG123_OK;
+}
+
+/* save the length and a subset of mpg123's frame index */
+static void
+save_index(mpg123_handle *mh, int64_t length)
+{
+	struct track_index	 index;
+	off_t			*offs, step;
+	size_t			 fill, every, i;
+
+	memset(&index, 0, sizeof(index));
+	index.duration = length;
+
+	if (mpg123_index(mh, &offs, &step, &fill) == MPG123_OK &&
+	    fill > 0 && step > 0) {
+		every = (fill + TRACK_NSEEK - 1) / TRACK_NSEEK;
+		for (i = 0; i * every < fill; ++i)
+			index.seek[i] = offs[i * every];
+		index.nseek = i;
+		index.step = step * every;
+	}
+
+	player_saveindex(&index);
+}
+
 int
 play_mp3(int fd, const char **errstr)
 {
-	static char	 buf[4096];
-	size_t		 len;
-	mpg123_handle	*mh;
-	int64_t		 seek = -1;
-	int		 err, ret = -1;
-
-	if ((mh = mpg123_new(NULL, NULL)) == NULL)
-		fatal("mpg123_new");
-
-	if (mpg123_open_fd(mh, fd) != MPG123_OK) {
-		*errstr = "mpg123_open_fd failed";
-		close(fd);
+	static mpg123_handle *mh;
+	const struct track_index *cached;
+	struct input	 in;
+	size_t		 len, bufsz;
+	char		*buf;
+	int64_t		 seek = -1, size, length, next_refine;
+	int		 err, exact, need_scan, ret = -1;
+
+	/* the handle is kept for the following tracks */
+	if (mh == NULL) {
+		if ((mh = mpg123_new(NULL, NULL)) == NULL)
+			fatal("mpg123_new");
+		set_encoding(mh);
+		if (mpg123_replace_reader_handle(mh, readcb, seekcb, NULL)
+		    != MPG123_OK)
+			fatalx("mpg123_replace_reader_handle failed");
+	}
+
+	if (input_open(&in, fd) == -1 ||
+	    mpg123_open_handle(mh, &in) != MPG123_OK) {
+		*errstr = "mpg123_open_handle failed";
+		mpg123_close(mh);
+		input_close(&in);
 		return -1;
 	}
 
-	if (!setup(mh))
-		goto done;
+	bufsz = mpg123_outblock(mh);
+	buf = player_buffer(bufsz);
+
+	/* mpg123 needs the size to estimate the length using our reader */
+	if ((size = input_size(&in)) > 0)
+		mpg123_set_filesize(mh, size);
 
-	if (mpg123_scan(mh) != MPG123_OK)
+	if (!setup(mh))
 		goto done;
 
-	player_setduration(mpg123_length(mh));
+	/*
+	 * Don't mpg123_scan() upfront: it has to read the whole file.
+	 * If neither the cache nor the headers tell the exact length
+	 * report an estimate and improve it while decoding; the frame
+	 * index is built only when needed by a seek.
+	 */
+	need_scan = !length_accurate(mh);
+	if ((cached = player_index()) != NULL) {
+		exact = 1;
+		length = cached->duration;
+		if (load_index(mh, cached))
+			need_scan = 0;
+	} else {
+		exact = !need_scan;
+		if ((length = mpg123_length(mh)) < 0)
+			length = 0;
+		if (exact)
+			player_saveduration(length);
+	}
+	player_setduration(length);
+	next_refine = rate * REFINE_EVERY;
 
 	for (;;) {
+		if (seek != -1 && need_scan) {
+			if (mpg123_scan(mh) == MPG123_OK &&
+			    (length = mpg123_length(mh)) >= 0) {
+				player_setduration(length);
+				save_index(mh, length);
+			}
+			need_scan = 0;
+			exact = 1;
+		}
+
 		if (seek != -1) {
 			seek = mpg123_seek(mh, seek, SEEK_SET);
 			if (seek < 0) {
@@ -81,9 +267,12 @@ play_mp3(int fd, const char **errstr)
 			player_setpos(seek);
 		}
 
-		err = mpg123_read(mh, buf, sizeof(buf), &len);
+		err = mpg123_read(mh, buf, bufsz, &len);
 		switch (err) {
 		case MPG123_DONE:
+			/* now we know for sure */
+			if (!exact)
+				player_saveduration(mpg123_tell(mh));
 			ret = 0;
 			goto done;
 		case MPG123_NEW_FORMAT:
@@ -95,6 +284,11 @@ play_mp3(int fd, const char **errstr)
 				ret = 1;
 				goto done;
 			}
+			if (!exact && mpg123_tell(mh) >= next_refine) {
+				refine_length(mh, size, &length);
+				next_refine = mpg123_tell(mh) +
+				    rate * REFINE_EVERY;
+			}
 			break;
 		default:
 			log_warnx("skipping mp3 decoding error");
@@ -103,7 +297,7 @@ play_mp3(int fd, const char **errstr)
 	}
 
 done:
-	mpg123_delete(mh);
-	close(fd);
+	mpg123_close(mh);
+	input_close(&in);
 	return ret;
 }
@@ -27,10 +27,18 @@
 #include <FLAC/stream_decoder.h>
 
 #include "amused.h"
+#include "input.h"
 #include "log.h"
+#include "pcm.h"
 
 struct write_args {
 	FLAC__StreamDecoder *decoder;
+	struct input in;
+	pcm_interleave_fn interleave;
+	int fmt;		/* what the device takes */
+	unsigned int bps;
+	unsigned int chans;
+	size_t bpf;
 	int seek_failed;
 };
 
@@ -47,58 +55,91 @@ sample_seek(struct write_args *wa, int64_t seek)
 	return ok;
 }
 
+static FLAC__StreamDecoderReadStatus
+readcb(const FLAC__StreamDecoder *decoder, FLAC__byte buf[], size_t *len,
+    void *data)
+{
+	struct write_args *wa = data;
+
+	if (*len == 0)
+		return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+
+	*len = input_read(&wa->in, buf, *len);
+	if (*len == 0)
+		return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+	return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+static FLAC__StreamDecoderSeekStatus
+seekcb(const FLAC__StreamDecoder *decoder, FLAC__uint64 off, void *data)
+{
+	struct write_args *wa = data;
+
+	if (input_seek(&wa->in, off, SEEK_SET) == -1)
+		return FLAC__STREAM_DECODER_SEEK_STATUS_ERROR;
+	return FLAC__STREAM_DECODER_SEEK_STATUS_OK;
+}
+
+static FLAC__StreamDecoderTellStatus
+tellcb(const FLAC__StreamDecoder *decoder, FLAC__uint64 *off, void *data)
+{
+	struct write_args *wa = data;
+	int64_t pos;
+
+	if ((pos = input_tell(&wa->in)) == -1)
+		return FLAC__STREAM_DECODER_TELL_STATUS_ERROR;
+	*off = pos;
+	return FLAC__STREAM_DECODER_TELL_STATUS_OK;
+}
+
+static FLAC__StreamDecoderLengthStatus
+lengthcb(const FLAC__StreamDecoder *decoder, FLAC__uint64 *len, void *data)
+{
+	struct write_args *wa = data;
+	int64_t size;
+
+	if ((size = input_size(&wa->in)) == -1)
+		return FLAC__STREAM_DECODER_LENGTH_STATUS_ERROR;
+	*len = size;
+	return FLAC__STREAM_DECODER_LENGTH_STATUS_OK;
+}
+
+static FLAC__bool
+eofcb(const FLAC__StreamDecoder *decoder, void *data)
+{
+	struct write_args *wa = data;
+
+	return input_eof(&wa->in);
+}
+
 static FLAC__StreamDecoderWriteStatus
 writecb(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
     const int32_t * const *src, void *data)
 {
 	struct write_args *wa = data;
-	static uint8_t buf[BUFSIZ];
+	uint8_t *buf;
 	int64_t seek;
-	int c, i, bps, chans;
-	size_t len;
-
-	bps = frame->header.bits_per_sample;
-	chans = frame->header.channels;
-
-	for (i = 0, len = 0; i < frame->header.blocksize; ++i) {
-		if (len + 4*chans >= sizeof(buf)) {
-			if (!play(buf, len, &seek))
-				goto quit;
-			if (seek != -1) {
-				if (sample_seek(wa, seek))
-					break;
-				else
-					goto quit;
-			}
-			len = 0;
-		}
-
-		for (c = 0; c < chans; ++c) {
-			switch (bps) {
-			case 8:
-				buf[len++] = src[c][i] & 0xff;
-				break;
-			case 16:
-				buf[len++] = src[c][i] & 0xff;
-				buf[len++] = (src[c][i] >> 8) & 0xff;
-				break;
-			case 24:
-			case 32:
-				buf[len++] = src[c][i] & 0xff;
-				buf[len++] = (src[c][i] >> 8) & 0xff;
-				buf[len++] = (src[c][i] >> 16) & 0xff;
-				buf[len++] = (src[c][i] >> 24) & 0xff;
-				break;
-			default:
-				log_warnx("unsupported flac bps=%d", bps);
-				goto quit;
-			}
+	size_t blocksize;
+
+	/* the format may change only in theory, so check it here */
+	if (frame->header.bits_per_sample != wa->bps ||
+	    frame->header.channels != wa->chans) {
+		wa->bps = frame->header.bits_per_sample;
+		wa->chans = frame->header.channels;
+		wa->interleave = pcm_interleaver(wa->bps, wa->fmt, wa->chans);
+		if (wa->interleave == NULL) {
+			log_warnx("unsupported flac bps=%u", wa->bps);
+			goto quit;
 		}
+		wa->bpf = pcm_width(wa->fmt) * wa->chans;
 	}
 
-	if (len != 0 && !play(buf, len, &seek))
-		goto quit;
+	blocksize = frame->header.blocksize;
+	buf = player_buffer(blocksize * wa->bpf);
+	wa->interleave(buf, src, wa->chans, 0, blocksize);
 
+	if (!play(buf, blocksize * wa->bpf, &seek))
+		goto quit;
 	if (seek != -1 && !sample_seek(wa, seek))
 		goto quit;
 
@@ -111,7 +152,10 @@ static void
 metacb(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *meta,
     void *d)
 {
+	struct write_args *wa = d;
+	const struct track_index *index;
 	uint32_t sample_rate;
+	int64_t total;
 	int channels, bits;
 
 	if (meta->type == FLAC__METADATA_TYPE_STREAMINFO) {
@@ -119,10 +163,19 @@ metacb(const FLAC__StreamDecoder *decoder, const FLAC__StreamMetadata *meta,
 		sample_rate = meta->data.stream_info.sample_rate;
 		channels = meta->data.stream_info.channels;
 
-		if (player_setup(bits, sample_rate, channels) == -1)
+		wa->fmt = player_setup(pcm_format(bits), sample_rate,
+		    channels);
+		if (wa->fmt == -1)
 			err(1, "player_setup");
-
-		player_setduration(meta->data.stream_info.total_samples);
+		wa->bps = 0;	/* pick the kernel again */
+
+		/* zero if the encoder didn't know it */
+		total = meta->data.stream_info.total_samples;
+		if (total != 0)
+			player_saveduration(total);
+		else if ((index = player_index()) != NULL)
+			total = index->duration;
+		player_setduration(total);
 	}
 }
 
@@ -137,32 +190,33 @@ errcb(const FLAC__StreamDecoder *decoder,
 int
 play_flac(int fd, const char **errstr)
 {
-	FILE *f;
+	static FLAC__StreamDecoder *decoder;
 	struct write_args wa;
 	int s, ok = 1;
-	FLAC__StreamDecoder *decoder = NULL;
 	FLAC__StreamDecoderInitStatus init_status;
 
-	if ((f = fdopen(fd, "r")) == NULL) {
-		*errstr = "fdopen failed";
-		close(fd);
+	memset(&wa, 0, sizeof(wa));
+	if (input_open(&wa.in, fd) == -1) {
+		*errstr = "can't read the file";
+		input_close(&wa.in);
 		return -1;
 	}
 
-	decoder = FLAC__stream_decoder_new();
+	/* the decoder is kept for the following tracks */
+	if (decoder == NULL)
+		decoder = FLAC__stream_decoder_new();
 	if (decoder == NULL) {
 		*errstr = "FLAC__stream_decoder_new() failed";
-		fclose(f);
+		input_close(&wa.in);
 		return -1;
 	}
 
 	FLAC__stream_decoder_set_md5_checking(decoder, 1);
 
-	memset(&wa, 0, sizeof(wa));
 	wa.decoder = decoder;
 
-	init_status = FLAC__stream_decoder_init_FILE(decoder, f, writecb,
-	    metacb, errcb, &wa);
+	init_status = FLAC__stream_decoder_init_stream(decoder, readcb,
+	    seekcb, tellcb, lengthcb, eofcb, writecb, metacb, errcb, &wa);
 	if (init_status != FLAC__STREAM_DECODER_INIT_STATUS_OK)
 		errx(1, "flac decoder: %s",
 		    FLAC__StreamDecoderInitStatusString[init_status]);
@@ -170,8 +224,8 @@ play_flac(int fd, const char **errstr)
 	ok = FLAC__stream_decoder_process_until_end_of_stream(decoder);
 
 	s = FLAC__stream_decoder_get_state(decoder);
-	FLAC__stream_decoder_delete(decoder);
-	fclose(f);
+	FLAC__stream_decoder_finish(decoder);
+	input_close(&wa.in);
 
 	if (s == FLAC__STREAM_DECODER_ABORTED && !wa.seek_failed)
 		return 1;
@@ -28,30 +28,64 @@
 #include <vorbis/vorbisfile.h>
 
 #include "amused.h"
+#include "input.h"
+#include "pcm.h"
+
+/* bytes converted at a time */
+#define VORBIS_OUT	16384
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
 
 #ifndef nitems
 #define nitems(x) (sizeof(x)/sizeof(x[0]))
 #endif
 
+static size_t
+readcb(void *buf, size_t size, size_t nmemb, void *data)
+{
+	if (size == 0)
+		return 0;
+	return input_read(data, buf, size * nmemb) / size;
+}
+
+static int
+seekcb(void *data, ogg_int64_t off, int whence)
+{
+	return input_seek(data, off, whence);
+}
+
+static long
+tellcb(void *data)
+{
+	return input_tell(data);
+}
+
 int
 play_oggvorbis(int fd, const char **errstr)
 {
-	static char pcmout[4096];
-	FILE *f;
+	uint8_t *out;
+	struct input in;
+	ov_callbacks cb = { readcb, seekcb, NULL, tellcb };
 	OggVorbis_File vf;
 	vorbis_info *vi;
-	int64_t seek = -1;
-	int current_section, ret = 0;
+	const struct track_index *index;
+	pcm_finterleave_fn convert;
+	float **pcm;
+	size_t i, n, bpf;
+	int64_t seek = -1, total;
+	int current_section, section = 0, fmt, ret = 0;
 
-	if ((f = fdopen(fd, "r")) == NULL) {
-		*errstr = "fdopen failed";
-		close(fd);
+	if (input_open(&in, fd) == -1) {
+		*errstr = "can't read the file";
+		input_close(&in);
 		return -1;
 	}
 
-	if (ov_open_callbacks(f, &vf, NULL, 0, OV_CALLBACKS_NOCLOSE) < 0) {
+	if (ov_open_callbacks(&in, &vf, NULL, 0, cb) < 0) {
 		*errstr = "input is not an Ogg bitstream";
-		fclose(f);
+		input_close(&in);
 		return -1;
 	}
 
@@ -61,11 +95,19 @@ play_oggvorbis(int fd, const char **errstr)
 	 * previous revision of this file.
 	 */
 	vi = ov_info(&vf, -1);
-	if (player_setup(16, vi->rate, vi->channels) == -1)
+	if ((fmt = player_setup(PCM_F32, vi->rate, vi->channels)) == -1)
 		err(1, "player_setup");
+	convert = pcm_finterleaver(fmt, vi->channels);
+	bpf = pcm_width(fmt) * vi->channels;
 
-	player_setduration(ov_time_total(&vf, -1) * vi->rate);
+	/* saves the link walk the next time */
+	if ((index = player_index()) != NULL)
+		total = index->duration;
+	else if ((total = ov_pcm_total(&vf, -1)) >= 0)
+		player_saveduration(total);
+	player_setduration(total);
 
+	out = player_buffer(VORBIS_OUT);
 	for (;;) {
 		long r;
 
@@ -76,20 +118,40 @@ play_oggvorbis(int fd, const char **errstr)
 			player_setpos(seek);
 		}
 
-		r = ov_read(&vf, pcmout, sizeof(pcmout), 0, 2, 1,
+		r = ov_read_float(&vf, &pcm, VORBIS_OUT / bpf,
 		    &current_section);
 		if (r == 0)
 			break;
 		else if (r > 0) {
-			/* TODO: deal with sample rate changes */
-			if (!play(pcmout, r, &seek)) {
-				ret = 1;
-				break;
+			/* the links of a chained stream may differ */
+			if (current_section != section) {
+				section = current_section;
+				vi = ov_info(&vf, section);
+				fmt = player_setup(PCM_F32, vi->rate,
+				    vi->channels);
+				if (fmt == -1)
+					err(1, "player_setup");
+				convert = pcm_finterleaver(fmt, vi->channels);
+				bpf = pcm_width(fmt) * vi->channels;
+			}
+
+			/* the new link may have more channels than out fits */
+			for (i = 0; i < (size_t)r; i += n) {
+				n = MIN(r - i, VORBIS_OUT / bpf);
+				convert(out, (const float * const *)pcm,
+				    vi->channels, i, n);
+				if (!play(out, n * bpf, &seek)) {
+					ret = 1;
+					goto done;
+				}
+				if (seek != -1)
+					break;
 			}
 		}
 	}
 
+done:
 	ov_clear(&vf);
-	fclose(f);
+	input_close(&in);
 	return ret;
 }
@@ -22,40 +22,114 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <opusfile.h>
 
 #include "amused.h"
+#include "input.h"
+#include "log.h"
+#include "pcm.h"
 
 #ifndef nitems
 #define nitems(x) (sizeof(x)/sizeof(x[0]))
 #endif
 
+/* opusfile always decodes at 48kHz */
+#define OPUS_RATE	48000
+
+static int
+readcb(void *data, unsigned char *buf, int len)
+{
+	return input_read(data, buf, len);
+}
+
+static int
+seekcb(void *data, opus_int64 off, int whence)
+{
+	return input_seek(data, off, whence);
+}
+
+static opus_int64
+tellcb(void *data)
+{
+	return input_tell(data);
+}
+
+/*
+ * Where to take each channel from, to turn the Vorbis order of the
+ * mapping family 1 into the one of audio_channels().  The layouts
+ * not listed are downmixed.
+ */
+static const int map4[] = { 0, 1, 2, 3 };		/* quad */
+static const int map6[] = { 0, 2, 3, 4, 1, 5 };		/* 5.1 */
+static const int map8[] = { 0, 2, 5, 6, 1, 7, 3, 4 };	/* 7.1 */
+
+static const int *
+opus_map(OggOpusFile *of, int li, int chans)
+{
+	if (op_head(of, li)->mapping_family != 1 ||
+	    (unsigned int)chans > audio_channels())
+		return NULL;
+
+	switch (chans) {
+	case 4:
+		return map4;
+	case 6:
+		return map6;
+	case 8:
+		return map8;
+	default:
+		return NULL;
+	}
+}
+
+static void
+opus_remap(float *pcm, int frames, int chans, const int *map)
+{
+	float	 tmp[8];
+	int	 i, c;
+
+	for (i = 0; i < frames; ++i, pcm += chans) {
+		for (c = 0; c < chans; ++c)
+			tmp[c] = pcm[map[c]];
+		memcpy(pcm, tmp, chans * sizeof(*pcm));
+	}
+}
+
 int
 play_opus(int fd, const char **errstr)
 {
-	static int16_t pcm[BUFSIZ];
-	static uint8_t out[BUFSIZ * 2];
+	static float pcm[5760 * 2];	/* 120ms of stereo */
+	uint8_t *out;
+	const float *planes[1] = { pcm };
+	const int *map = NULL;
+	pcm_finterleave_fn convert = NULL;
+	struct input in;
+	const struct track_index *index;
 	OggOpusFile *of;
-	void *f;
-	int64_t seek = -1;
+	int64_t seek = -1, total;
 	int r, ret = 0;
-	OpusFileCallbacks cb = {NULL, NULL, NULL, NULL};
-	int i, li, prev_li = -1, duration_set = 0;
+	OpusFileCallbacks cb = { readcb, seekcb, tellcb, NULL };
+	int li, prev_li = -1, chans = 2, downmix = 0, mix, duration_set = 0;
+	int fmt = PCM_F32;
 
-	if ((f = op_fdopen(&cb, fd, "r")) == NULL) {
-		*errstr = "fdopen failed";
-		close(fd);
+	if (input_open(&in, fd) == -1) {
+		*errstr = "can't read the file";
+		input_close(&in);
 		return -1;
 	}
 
-	of = op_open_callbacks(f, &cb, NULL, 0, &r);
+	of = op_open_callbacks(&in, &cb, NULL, 0, &r);
 	if (of == NULL) {
-		fclose(f);
+		input_close(&in);
 		return -1;
 	}
 
+	/* no layout is wider than float */
+	out = player_buffer(sizeof(pcm));
 	for (;;) {
 		if (seek != -1) {
 			r = op_pcm_seek(of, seek);
@@ -64,8 +138,10 @@ play_opus(int fd, const char **errstr)
 			player_setpos(seek);
 		}
 
-		/* NB: will downmix multichannels files into two channels */
-		r = op_read_stereo(of, pcm, nitems(pcm));
+		if (downmix)
+			r = op_read_float_stereo(of, pcm, nitems(pcm));
+		else
+			r = op_read_float(of, pcm, nitems(pcm), NULL);
 		if (r == OP_HOLE) /* corrupt file segment? */
 			continue;
 		if (r < 0) {
@@ -78,31 +154,68 @@ play_opus(int fd, const char **errstr)
 
 		li = op_current_link(of);
 		if (li != prev_li) {
-			const OpusHead *head;
-
 			prev_li = li;
-			head = op_head(of, li);
-			if (head->input_sample_rate &&
-			    player_setup(16, head->input_sample_rate, 2) == -1)
-				err(1, "player_setup");
+
+			/*
+			 * Play the channels of the link as they are if
+			 * the device takes them in a known order, or
+			 * downmix them.
+			 */
+			chans = op_channel_count(of, li);
+			map = NULL;
+			mix = 0;
+			if (chans > 2 && (map = opus_map(of, li, chans)) == NULL)
+				mix = 1;
+			if (!mix && (fmt = player_setup(PCM_F32, OPUS_RATE,
+			    chans)) == -1) {
+				if (chans <= 2)
+					err(1, "player_setup");
+				log_debug("%s: can't play %d channels",
+				    __func__, chans);
+				mix = 1;
+			}
+			if (mix) {
+				map = NULL;
+				chans = 2;
+				fmt = player_setup(PCM_F32, OPUS_RATE, 2);
+				if (fmt == -1)
+					err(1, "player_setup");
+			}
+
+			/* the samples are interleaved already */
+			convert = pcm_finterleaver(fmt, 1);
 
 			if (!duration_set) {
 				duration_set = 1;
-				player_setduration(op_pcm_total(of, -1));
+				if ((index = player_index()) != NULL)
+					total = index->duration;
+				else if ((total = op_pcm_total(of, -1)) >= 0)
+					player_saveduration(total);
+				player_setduration(total);
 			}
-		}
 
-		for (i = 0; i < 2*r; ++i) {
-			out[2*i+0] = pcm[i] & 0xFF;
-			out[2*i+1] = (pcm[i] >> 8) & 0xFF;
+			/* what was just read has the wrong layout */
+			if (mix != downmix) {
+				downmix = mix;
+				if (op_pcm_seek(of, op_pcm_tell(of) - r) != 0) {
+					*errstr = "opus seek failed";
+					ret = -1;
+					break;
+				}
+				continue;
+			}
 		}
 
-		if (!play(out, 4*r, &seek)) {
+		if (map != NULL)
+			opus_remap(pcm, r, chans, map);
+		convert(out, planes, 1, 0, r * chans);
+		if (!play(out, r * chans * pcm_width(fmt), &seek)) {
 			ret = 1;
 			break;
 		}
 	}
 
 	op_free(of);
+	input_close(&in);
 	return ret;
 }
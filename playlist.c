@@ -18,7 +18,9 @@
 
 #include <sys/types.h>
 
+#include <ctype.h>
 #include <regex.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
@@ -29,7 +31,38 @@
 
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+/*
+ * Trigram index for playlist_jump.  To keep it small, songs are
+ * grouped in blocks of IDX_BLOCK by a monotonic id and the posting
+ * lists hold block numbers: the candidate blocks are then verified
+ * with the regexp.
+ *
+ * Removing a song shifts the ones after it, so a song with a given
+ * id can be at most `drops' positions before it.  Once too many
+ * songs are removed the index is just rebuilt.
+ */
+#define IDX_BLOCK	64
+#define IDX_MAXDROPS	IDX_BLOCK
+
+struct posting {
+	uint32_t	 key;		/* trigram | IDX_USED */
+	uint32_t	 len;
+	uint32_t	 cap;
+	uint32_t	*blocks;
+};
+#define IDX_USED	0x1000000
+
+struct playlist_index {
+	struct posting	*tab;
+	size_t		 size;		/* power of two */
+	size_t		 used;
+	size_t		 ipos;		/* songs indexed so far */
+	size_t		 nextid;
+	size_t		 drops;
+};
+
 struct playlist	 playlist;
+uint64_t	 playlist_gen;
 enum play_state	 play_state;
 int		 repeat_one;
 int		 repeat_all = 1;
@@ -39,28 +72,541 @@ const char	*current_song;
 int64_t		 current_position;
 int64_t		 current_duration;
 
+static struct playlist_delta	 pending;
+
+static void
+merge(struct playlist_delta *p, int change, size_t first, size_t count)
+{
+	if (p->change == PLAYLIST_SAME || change == PLAYLIST_TRUNCATE ||
+	    change == PLAYLIST_REPLACE) {
+		p->change = change;
+		p->first = first;
+		p->count = count;
+	} else if (change == PLAYLIST_APPEND &&
+	    p->change == PLAYLIST_APPEND &&
+	    first == p->first + p->count)
+		p->count += count;
+	else if (change == PLAYLIST_APPEND &&
+	    p->change == PLAYLIST_TRUNCATE)
+		p->change = PLAYLIST_REPLACE;
+	else if (change == PLAYLIST_APPEND &&
+	    p->change == PLAYLIST_REPLACE)
+		;
+	else
+		p->change = PLAYLIST_RESYNC;
+}
+
+/* record a change of the global playlist */
+static void
+changed(int change, size_t first, size_t count)
+{
+	playlist_gen++;
+	merge(&pending, change, first, count);
+	pending.gen = playlist_gen;
+}
+
+/* the changes since the last call */
+void
+playlist_delta(struct playlist_delta *d)
+{
+	pending.gen = playlist_gen;
+	memcpy(d, &pending, sizeof(*d));
+
+	memset(&pending, 0, sizeof(pending));
+	pending.base = playlist_gen;
+}
+
+/* an empty delta that the next playlist_delta() can be merged into */
+void
+playlist_delta_init(struct playlist_delta *d)
+{
+	memset(d, 0, sizeof(*d));
+	d->base = pending.base;
+	d->gen = pending.base;
+}
+
+/* extend d with the changes that follow it */
+void
+playlist_delta_merge(struct playlist_delta *d,
+    const struct playlist_delta *next)
+{
+	if (d->gen != next->base)
+		d->change = PLAYLIST_RESYNC;
+	else if (next->change != PLAYLIST_SAME)
+		merge(d, next->change, next->first, next->count);
+	d->gen = next->gen;
+}
+
+/* current_song has to survive the playlist, it's copied here */
+static char	*songbuf;
+static size_t	 songbufsize;
+
 static void
 setsong(ssize_t i)
 {
-	free((char *)current_song);
-	if (i == -1)
+	const char	*song;
+	size_t		 len;
+
+	if (i == -1) {
 		current_song = NULL;
-	else
-		current_song = xstrdup(playlist.songs[i]);
+		return;
+	}
+
+	song = playlist_song(&playlist, i);
+	len = strlen(song) + 1;
+	if (len > songbufsize) {
+		free(songbuf);
+		songbuf = xmalloc(len);
+		songbufsize = len;
+	}
+	memcpy(songbuf, song, len);
+	current_song = songbuf;
+}
+
+const char *
+playlist_song(const struct playlist *p, size_t i)
+{
+	return p->arena + p->offs[i];
+}
+
+static uint32_t
+songhash(const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	for (; *s != '\0'; ++s)
+		h = (h ^ (unsigned char)*s) * 16777619U;
+	return h;
+}
+
+static uint32_t
+trigram(const char *s)
+{
+	return (tolower((unsigned char)s[0]) << 16) |
+	    (tolower((unsigned char)s[1]) << 8) |
+	    tolower((unsigned char)s[2]);
+}
+
+/* case folding may not be just tolower() outside of ASCII */
+static int
+trigram_ok(const char *s)
+{
+	return (unsigned char)s[0] < 0x80 && (unsigned char)s[1] < 0x80 &&
+	    (unsigned char)s[2] < 0x80;
+}
+
+static size_t
+idx_slot(struct playlist_index *idx, uint32_t key)
+{
+	uint32_t h;
+
+	h = key * 2654435761U;
+	h ^= h >> 15;
+	return h & (idx->size - 1);
+}
+
+static struct posting *
+idx_posting(struct playlist_index *idx, uint32_t key, int create)
+{
+	struct posting	*tab, *p;
+	size_t		 i, size;
+
+	key |= IDX_USED;
+	for (i = idx_slot(idx, key);; i = (i + 1) & (idx->size - 1)) {
+		p = &idx->tab[i];
+		if (p->key == key)
+			return p;
+		if (p->key == 0)
+			break;
+	}
+
+	if (!create)
+		return NULL;
+
+	if ((idx->used + 1) * 4 > idx->size * 3) {
+		tab = idx->tab;
+		size = idx->size;
+
+		idx->size *= 2;
+		idx->tab = xcalloc(idx->size, sizeof(*idx->tab));
+		for (i = 0; i < size; ++i) {
+			if (tab[i].key == 0)
+				continue;
+			p = idx->tab + idx_slot(idx, tab[i].key);
+			while (p->key != 0) {
+				if (++p == idx->tab + idx->size)
+					p = idx->tab;
+			}
+			*p = tab[i];
+		}
+		free(tab);
+		return idx_posting(idx, key & ~IDX_USED, create);
+	}
+
+	idx->used++;
+	p->key = key;
+	return p;
+}
+
+static void
+idx_add(struct playlist_index *idx, const char *path, uint32_t block)
+{
+	struct posting	*p;
+	size_t		 newcap;
+
+	for (; path[0] != '\0' && path[1] != '\0' && path[2] != '\0'; ++path) {
+		if (!trigram_ok(path))
+			continue;
+
+		p = idx_posting(idx, trigram(path), 1);
+		if (p->len > 0 && p->blocks[p->len - 1] == block)
+			continue;
+
+		if (p->len == p->cap) {
+			newcap = MAX(4, p->cap * 2);
+			p->blocks = xreallocarray(p->blocks, newcap,
+			    sizeof(*p->blocks));
+			p->cap = newcap;
+		}
+		p->blocks[p->len++] = block;
+	}
+}
+
+static void
+idx_free(struct playlist_index *idx)
+{
+	size_t i;
+
+	if (idx == NULL)
+		return;
+
+	for (i = 0; i < idx->size; ++i)
+		free(idx->tab[i].blocks);
+	free(idx->tab);
+	free(idx);
+}
+
+/* index the songs added since the last time */
+static struct playlist_index *
+idx_update(struct playlist *p)
+{
+	struct playlist_index *idx = p->index;
+
+	if (idx != NULL && idx->drops > IDX_MAXDROPS) {
+		idx_free(idx);
+		idx = p->index = NULL;
+	}
+
+	if (idx == NULL) {
+		idx = p->index = xcalloc(1, sizeof(*idx));
+		idx->size = 1024;
+		idx->tab = xcalloc(idx->size, sizeof(*idx->tab));
+	}
+
+	for (; idx->ipos < p->len; idx->ipos++, idx->nextid++)
+		idx_add(idx, playlist_song(p, idx->ipos),
+		    idx->nextid / IDX_BLOCK);
+	return idx;
+}
+
+static int
+blocks_has(const struct posting *p, uint32_t block)
+{
+	size_t lo = 0, hi = p->len, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (p->blocks[mid] == block)
+			return 1;
+		if (p->blocks[mid] < block)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+/*
+ * Collect the posting lists for the trigrams any match must contain.
+ * That's only possible for patterns that are literal but for `.'
+ * and the anchors; returns -1 otherwise, or if they're too short.
+ */
+static int
+idx_query(struct playlist_index *idx, const char *re, struct posting ***ret,
+    size_t *nret)
+{
+	struct posting	**ps = NULL, *p;
+	const char	*s, *e;
+	size_t		 n = 0, i;
+
+	if (strpbrk(re, "[\\*") != NULL)
+		return -1;
+
+	for (s = re; *s != '\0'; s = e) {
+		if ((e = strpbrk(s, ".^$")) == NULL)
+			e = s + strlen(s);
+		for (; s + 2 < e; ++s) {
+			if (!trigram_ok(s))
+				continue;
+			p = idx_posting(idx, trigram(s), 0);
+			for (i = 0; i < n; ++i)
+				if (ps[i] == p)
+					break;
+			if (i != n)
+				continue;
+			ps = xreallocarray(ps, n + 1, sizeof(*ps));
+			ps[n++] = p;
+		}
+		if (*e != '\0')
+			e++;
+	}
+
+	if (n == 0)
+		return -1;
+
+	*ret = ps;
+	*nret = n;
+	return 0;
+}
+
+/*
+ * Call fn, in order, on the songs of the blocks that have all the
+ * trigrams in ps, until it returns non-zero.
+ */
+static void
+idx_walk(struct playlist *p, struct posting **ps, size_t nps,
+    int (*fn)(struct playlist *, size_t, void *), void *arg)
+{
+	struct playlist_index	*idx = p->index;
+	struct posting		*drv;
+	size_t			 i, j, k, lo, hi, from = 0;
+
+	/* a trigram nobody has */
+	for (i = 0; i < nps; ++i)
+		if (ps[i] == NULL)
+			return;
+
+	/* walk the shortest list, and check the others */
+	drv = ps[0];
+	for (i = 1; i < nps; ++i)
+		if (ps[i]->len < drv->len)
+			drv = ps[i];
+
+	for (j = 0; j < drv->len; ++j) {
+		for (k = 0; k < nps; ++k)
+			if (ps[k] != drv && !blocks_has(ps[k], drv->blocks[j]))
+				break;
+		if (k != nps)
+			continue;
+
+		lo = (size_t)drv->blocks[j] * IDX_BLOCK;
+		hi = lo + IDX_BLOCK;
+		lo = lo > idx->drops ? lo - idx->drops : 0;
+		lo = MAX(lo, from);
+		if (hi > p->len)
+			hi = p->len;
+		for (i = lo; i < hi; ++i)
+			if (fn(p, i, arg))
+				return;
+		from = MAX(from, hi);
+	}
+}
+
+struct regmatch {
+	regex_t		*re;
+	ssize_t		 found;
+};
+
+static int
+song_regmatch(struct playlist *p, size_t i, void *arg)
+{
+	struct regmatch	*m = arg;
+
+	if (regexec(m->re, playlist_song(p, i), 0, NULL, 0) != 0)
+		return 0;
+	m->found = i;
+	return 1;
+}
+
+/* first song matching the regexp, or -1 */
+static ssize_t
+playlist_search(struct playlist *p, regex_t *re, const char *arg)
+{
+	struct playlist_index	 *idx;
+	struct posting		**ps;
+	struct regmatch		  m;
+	size_t			  nps, i;
+
+	m.re = re;
+	m.found = -1;
+
+	idx = idx_update(p);
+	if (idx_query(idx, arg, &ps, &nps) == -1) {
+		for (i = 0; i < p->len; ++i)
+			if (song_regmatch(p, i, &m))
+				break;
+		return m.found;
+	}
+
+	idx_walk(p, ps, nps, song_regmatch, &m);
+	free(ps);
+	return m.found;
+}
+
+/*
+ * Songs matching all the words of a query, for playlist_match: the
+ * ones with all of them in the file name come first.
+ */
+#define MATCH_MAXWORDS	8
+
+struct wordmatch {
+	char	*words[MATCH_MAXWORDS];
+	size_t	 nwords;
+	size_t	*offs;
+	size_t	 n;
+	size_t	*rest;
+	size_t	 nrest;
+	size_t	 max;
+};
+
+/* case-insensitive strstr, as the trigrams are only folded in ASCII */
+static const char *
+word_find(const char *s, const char *word)
+{
+	size_t i;
+
+	for (; *s != '\0'; ++s) {
+		for (i = 0; word[i] != '\0'; ++i)
+			if (tolower((unsigned char)s[i]) != word[i])
+				break;
+		if (word[i] == '\0')
+			return s;
+	}
+	return NULL;
+}
+
+static int
+song_wordmatch(struct playlist *p, size_t i, void *arg)
+{
+	struct wordmatch	*m = arg;
+	const char		*song, *base;
+	size_t			 w;
+	int			 inbase = 1;
+
+	song = playlist_song(p, i);
+	if ((base = strrchr(song, '/')) == NULL)
+		base = song;
+
+	for (w = 0; w < m->nwords; ++w) {
+		if (word_find(base, m->words[w]) != NULL)
+			continue;
+		if (word_find(song, m->words[w]) == NULL)
+			return 0;
+		inbase = 0;
+	}
+
+	if (inbase)
+		m->offs[m->n++] = i;
+	else if (m->nrest < m->max)
+		m->rest[m->nrest++] = i;
+
+	/* the later songs can't rank better */
+	return m->n == m->max;
+}
+
+/*
+ * Fill offs with the offsets of at most max songs that contain all
+ * the whitespace-separated words of query, ignoring the case.
+ * Returns how many were found.
+ */
+size_t
+playlist_match(struct playlist *p, const char *query, size_t *offs,
+    size_t max)
+{
+	struct playlist_index	 *idx;
+	struct posting		**ps = NULL, *ps1;
+	struct wordmatch	  m;
+	char			 *q, *s, *word;
+	size_t			  nps = 0, i, w;
+
+	if (max == 0)
+		return 0;
+
+	memset(&m, 0, sizeof(m));
+	m.offs = offs;
+	m.max = max;
+	m.rest = xcalloc(max, sizeof(*m.rest));
+
+	q = xstrdup(query);
+	for (s = q; *s != '\0'; ++s)
+		*s = tolower((unsigned char)*s);
+
+	idx = idx_update(p);
+	s = q;
+	while ((word = strsep(&s, " \t")) != NULL) {
+		if (*word == '\0')
+			continue;
+		if (m.nwords == MATCH_MAXWORDS)
+			break;
+		m.words[m.nwords++] = word;
+
+		for (; word[0] != '\0' && word[1] != '\0' && word[2] != '\0';
+		    ++word) {
+			if (!trigram_ok(word))
+				continue;
+			ps1 = idx_posting(idx, trigram(word), 0);
+			for (i = 0; i < nps; ++i)
+				if (ps[i] == ps1)
+					break;
+			if (i != nps)
+				continue;
+			ps = xreallocarray(ps, nps + 1, sizeof(*ps));
+			ps[nps++] = ps1;
+		}
+	}
+
+	if (m.nwords == 0)
+		goto done;
+
+	if (nps == 0) {
+		for (i = 0; i < p->len; ++i)
+			if (song_wordmatch(p, i, &m))
+				break;
+	} else
+		idx_walk(p, ps, nps, song_wordmatch, &m);
+
+	for (w = 0; w < m.nrest && m.n < max; ++w)
+		offs[m.n++] = m.rest[w];
+
+done:
+	free(ps);
+	free(q);
+	free(m.rest);
+	return m.n;
+}
+
+/* make the index cover the songs pushed since the last time */
+void
+playlist_index(struct playlist *p)
+{
+	idx_update(p);
 }
 
 void
 playlist_swap(struct playlist *p, ssize_t off)
 {
 	ssize_t i = -1;
+	uint32_t h;
 
 	if (off > p->len)
 		off = -1;
 
 	if (current_song != NULL && off < 0) {
 		/* try to match the currently played song */
+		h = songhash(current_song);
 		for (i = 0; i < p->len; ++i) {
-			if (!strcmp(current_song, p->songs[i]))
+			if (p->hashes[i] == h &&
+			    !strcmp(current_song, playlist_song(p, i)))
 				break;
 		}
 		if (i == p->len)
@@ -74,9 +620,8 @@ playlist_swap(struct playlist *p, ssize_t off)
 	else if (off >= 0)
 		play_off = off;
 
-	playlist.len = p->len;
-	playlist.cap = p->cap;
-	playlist.songs = p->songs;
+	memcpy(&playlist, p, sizeof(playlist));
+	changed(PLAYLIST_REPLACE, 0, playlist.len);
 
 	if (play_state == STATE_STOPPED)
 		setsong(play_off);
@@ -85,22 +630,37 @@ playlist_swap(struct playlist *p, ssize_t off)
 void
 playlist_push(struct playlist *playlist, const char *path)
 {
-	size_t newcap;
+	size_t len, newcap;
 
 	if (playlist->len == playlist->cap) {
 		newcap = MAX(16, playlist->cap * 1.5);
-		playlist->songs = xrecallocarray(playlist->songs,
-		    playlist->cap, newcap, sizeof(*playlist->songs));
+		playlist->offs = xreallocarray(playlist->offs, newcap,
+		    sizeof(*playlist->offs));
+		playlist->hashes = xreallocarray(playlist->hashes, newcap,
+		    sizeof(*playlist->hashes));
 		playlist->cap = newcap;
 	}
 
-	playlist->songs[playlist->len++] = xstrdup(path);
+	len = strlen(path) + 1;
+	if (len > playlist->arenacap - playlist->arenalen) {
+		newcap = MAX(4096, playlist->arenacap * 1.5);
+		if (newcap - playlist->arenalen < len)
+			newcap = playlist->arenalen + len;
+		playlist->arena = xreallocarray(playlist->arena, newcap, 1);
+		playlist->arenacap = newcap;
+	}
+
+	memcpy(playlist->arena + playlist->arenalen, path, len);
+	playlist->hashes[playlist->len] = songhash(path);
+	playlist->offs[playlist->len++] = playlist->arenalen;
+	playlist->arenalen += len;
 }
 
 void
 playlist_enqueue(const char *path)
 {
 	playlist_push(&playlist, path);
+	changed(PLAYLIST_APPEND, playlist.len - 1, 1);
 }
 
 const char *
@@ -125,7 +685,33 @@ playlist_advance(void)
 
 	setsong(play_off);
 	play_state = STATE_PLAYING;
-	return playlist.songs[play_off];
+	return playlist_song(&playlist, play_off);
+}
+
+/* the song that follows the current one, without advancing */
+const char *
+playlist_peek(void)
+{
+	ssize_t off;
+
+	if (repeat_one)
+		return current_song;
+
+	if (playlist.len == 0)
+		return NULL;
+
+	off = play_off + 1;
+	if (off >= (ssize_t)playlist.len) {
+		if (!repeat_all)
+			return NULL;
+		off = 0;
+	}
+
+	/* the current song is going to be consumed */
+	if (consume && off == play_off)
+		return NULL;
+
+	return playlist_song(&playlist, off);
 }
 
 const char *
@@ -150,7 +736,7 @@ playlist_previous(void)
 
 	setsong(play_off);
 	play_state = STATE_PLAYING;
-	return playlist.songs[play_off];
+	return playlist_song(&playlist, play_off);
 }
 
 void
@@ -162,15 +748,11 @@ playlist_reset(void)
 void
 playlist_free(struct playlist *playlist)
 {
-	size_t i;
-
-	for (i = 0; i < playlist->len; ++i)
-		free(playlist->songs[i]);
-	free(playlist->songs);
-	playlist->songs = NULL;
-
-	playlist->len = 0;
-	playlist->cap = 0;
+	free(playlist->offs);
+	free(playlist->hashes);
+	free(playlist->arena);
+	idx_free(playlist->index);
+	memset(playlist, 0, sizeof(*playlist));
 }
 
 void
@@ -178,47 +760,55 @@ playlist_truncate(void)
 {
 	playlist_free(&playlist);
 	play_off = -1;
+	changed(PLAYLIST_TRUNCATE, 0, 0);
 }
 
 void
-playlist_dropcurrent(void)
+playlist_remove(struct playlist *p, size_t i)
 {
-	size_t i;
+	if (i >= p->len)
+		return;
+
+	p->len--;
+	memmove(p->offs + i, p->offs + i + 1, (p->len - i) * sizeof(*p->offs));
+	memmove(p->hashes + i, p->hashes + i + 1,
+	    (p->len - i) * sizeof(*p->hashes));
 
+	if (p->index != NULL && i < p->index->ipos) {
+		p->index->ipos--;
+		p->index->drops++;
+	}
+}
+
+void
+playlist_dropcurrent(void)
+{
 	if (play_off == -1 || playlist.len == 0)
 		return;
 
-	free(playlist.songs[play_off]);
 	setsong(-1);
-
-	playlist.len--;
-	for (i = play_off; i < playlist.len; ++i)
-		playlist.songs[i] = playlist.songs[i+1];
+	playlist_remove(&playlist, play_off);
+	changed(PLAYLIST_REMOVE, play_off, 1);
 	play_off--;
-
-	playlist.songs[playlist.len] = NULL;
 }
 
 const char *
 playlist_jump(const char *arg)
 {
-	size_t i;
+	ssize_t i;
 	regex_t re;
 
 	if (regcomp(&re, arg, REG_ICASE | REG_NOSUB) != 0)
 		return NULL;
 
-	for (i = 0; i < playlist.len; ++i) {
-		if (regexec(&re, playlist.songs[i], 0, NULL, 0) == 0)
-			break;
-	}
+	i = playlist_search(&playlist, &re, arg);
 	regfree(&re);
 
-	if (i == playlist.len)
+	if (i == -1)
 		return NULL;
 
 	play_state = STATE_PLAYING;
 	play_off = i;
 	setsong(play_off);
-	return playlist.songs[i];
+	return playlist_song(&playlist, i);
 }
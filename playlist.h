@@ -17,10 +17,23 @@
 #ifndef PLAYLIST_H
 #define PLAYLIST_H
 
+struct playlist_index;
+
+/*
+ * The paths are stored back to back in a single arena, the songs
+ * are just offsets into it.  Dropping songs leaves holes that are
+ * reclaimed only when the whole playlist is freed.  The search index
+ * is built lazily and then kept up to date.
+ */
 struct playlist {
-	size_t	 len;
-	size_t	 cap;
-	char	**songs;
+	size_t			 len;
+	size_t			 cap;
+	size_t			*offs;
+	uint32_t		*hashes;
+	char			*arena;
+	size_t			 arenalen;
+	size_t			 arenacap;
+	struct playlist_index	*index;
 };
 
 enum play_state {
@@ -29,7 +42,30 @@ enum play_state {
 	STATE_PAUSED,
 };
 
+/*
+ * Every change to the playlist bumps its generation.  The changes
+ * since the last notification are merged in a delta that monitors
+ * can apply on their copy, provided they're at generation `base'.
+ */
+enum playlist_change {
+	PLAYLIST_SAME,
+	PLAYLIST_APPEND,	/* count songs at first */
+	PLAYLIST_REMOVE,	/* the song at first */
+	PLAYLIST_TRUNCATE,
+	PLAYLIST_REPLACE,
+	PLAYLIST_RESYNC,	/* can't be described, fetch it again */
+};
+
+struct playlist_delta {
+	int		change;
+	uint64_t	base;
+	uint64_t	gen;
+	uint64_t	first;
+	uint64_t	count;
+};
+
 extern struct playlist	playlist;
+extern uint64_t		playlist_gen;
 
 extern enum play_state	 play_state;
 extern int		 repeat_one;
@@ -40,15 +76,25 @@ extern const char	*current_song;
 extern int64_t		 current_position;
 extern int64_t		 current_duration;
 
+const char		*playlist_song(const struct playlist *, size_t);
 void			 playlist_swap(struct playlist *, ssize_t);
 void			 playlist_push(struct playlist *, const char *);
 void			 playlist_enqueue(const char *);
 const char		*playlist_advance(void);
+const char		*playlist_peek(void);
 const char		*playlist_previous(void);
 void			 playlist_reset(void);
 void			 playlist_free(struct playlist *);
 void			 playlist_truncate(void);
+void			 playlist_remove(struct playlist *, size_t);
 void			 playlist_dropcurrent(void);
+void			 playlist_delta(struct playlist_delta *);
+void			 playlist_delta_init(struct playlist_delta *);
+void			 playlist_delta_merge(struct playlist_delta *,
+			    const struct playlist_delta *);
 const char		*playlist_jump(const char *);
+size_t			 playlist_match(struct playlist *, const char *,
+			    size_t *, size_t);
+void			 playlist_index(struct playlist *);
 
 #endif
@@ -0,0 +1,361 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ev.h"
+#include "log.h"
+#include "playlist.h"
+#include "prefetch.h"
+#include "xmalloc.h"
+
+/* how much of every file to bring in memory */
+#define PREFETCH_BYTES	(1024 * 1024)
+
+/* the following tracks and the previous one */
+#define NSLOTS		(PREFETCH_TRACKS + 1)
+
+/* a slot is in use when it has a path */
+static struct slot {
+	char		*path;
+	int		 fd;		/* -1 if it can't be played */
+	struct stat	 sb;
+} slots[NSLOTS];
+
+static unsigned int	 timer;
+
+/*
+ * The open(2) and fstat(2) are done by a helper thread, one file at
+ * a time, since they may wait on a slow or sleeping disk; the result
+ * is announced with a byte on the pipe and put in a slot by main.
+ */
+static struct job {
+	char		*path;		/* NULL if idle */
+	int		 fd;
+	struct stat	 sb;
+	int		 done;
+} job;
+
+static pthread_t	 thread;
+static pthread_mutex_t	 mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 jobcv = PTHREAD_COND_INITIALIZER;
+static int		 notify[2] = { -1, -1 };
+
+/* the tracks that may come next, most likely first */
+static size_t
+upcoming(const char **paths)
+{
+	const char	*song;
+	ssize_t		 off;
+	size_t		 i, n = 0;
+	int		 k;
+
+	if (playlist.len == 0)
+		return 0;
+
+	if (repeat_one && current_song != NULL)
+		paths[n++] = current_song;
+
+	/* the next one, the previous one, then the ones after */
+	for (k = 0; k <= PREFETCH_TRACKS && n < NSLOTS; ++k) {
+		if (k == 1)
+			off = play_off - 1;
+		else
+			off = play_off + (k == 0 ? 1 : k);
+
+		if (off < 0 || off >= (ssize_t)playlist.len) {
+			if (!repeat_all)
+				continue;
+			off = (off + playlist.len) % playlist.len;
+		}
+		if (off == play_off)
+			continue;
+
+		song = playlist_song(&playlist, off);
+		for (i = 0; i < n; ++i)
+			if (!strcmp(paths[i], song))
+				break;
+		if (i == n)
+			paths[n++] = song;
+	}
+
+	return n;
+}
+
+static struct slot *
+lookup(const char *path)
+{
+	size_t		 i;
+
+	for (i = 0; i < NSLOTS; ++i)
+		if (slots[i].path != NULL && !strcmp(slots[i].path, path))
+			return &slots[i];
+	return NULL;
+}
+
+static void
+slot_clear(struct slot *slot)
+{
+	free(slot->path);
+	slot->path = NULL;
+	if (slot->fd != -1)
+		close(slot->fd);
+	slot->fd = -1;
+}
+
+/* runs in the helper thread */
+static void
+job_open(const char *path, int *fd, struct stat *sb)
+{
+	if ((*fd = open(path, O_RDONLY)) == -1) {
+		log_warn("open %s", path);
+		return;
+	}
+
+	if (fstat(*fd, sb) == -1) {
+		log_warn("failed to stat %s", path);
+		goto bad;
+	}
+
+	if (!S_ISREG(sb->st_mode)) {
+		log_info("skipping non-regular file: %s", path);
+		goto bad;
+	}
+
+#if HAVE_POSIX_FADVISE
+	posix_fadvise(*fd, 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+#endif
+	return;
+
+ bad:
+	close(*fd);
+	*fd = -1;
+}
+
+static void *
+worker(void *arg)
+{
+	struct stat	 sb;
+	char		*path;
+	int		 fd;
+
+	pthread_mutex_lock(&mtx);
+	for (;;) {
+		while (job.path == NULL || job.done)
+			pthread_cond_wait(&jobcv, &mtx);
+		path = job.path;
+		pthread_mutex_unlock(&mtx);
+
+		job_open(path, &fd, &sb);
+
+		pthread_mutex_lock(&mtx);
+		job.fd = fd;
+		memcpy(&job.sb, &sb, sizeof(sb));
+		job.done = 1;
+		while (write(notify[1], "", 1) == -1 && errno == EINTR)
+			;
+	}
+
+	/* not reached */
+	return NULL;
+}
+
+/* drop the slots of the tracks that aren't coming up anymore */
+static void
+prune(const char **paths, size_t n)
+{
+	size_t		 i, j;
+
+	for (i = 0; i < NSLOTS; ++i) {
+		if (slots[i].path == NULL)
+			continue;
+		for (j = 0; j < n; ++j)
+			if (!strcmp(slots[i].path, paths[j]))
+				break;
+		if (j == n)
+			slot_clear(&slots[i]);
+	}
+}
+
+/* the helper thread is done with a file */
+static void
+prefetch_done(int fd, int ev, void *arg)
+{
+	const char	*paths[NSLOTS];
+	struct slot	*slot = NULL;
+	char		 ch;
+	size_t		 i, n;
+
+	if (read(fd, &ch, 1) == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+		fatal("read");
+	}
+
+	pthread_mutex_lock(&mtx);
+	if (!job.done) {
+		pthread_mutex_unlock(&mtx);
+		return;
+	}
+
+	n = upcoming(paths);
+	prune(paths, n);
+
+	for (i = 0; i < n; ++i)
+		if (!strcmp(paths[i], job.path))
+			break;
+	if (i == n || lookup(job.path) != NULL) {
+		/* not wanted anymore */
+		free(job.path);
+		if (job.fd != -1)
+			close(job.fd);
+	} else {
+		for (i = 0; i < NSLOTS; ++i)
+			if (slots[i].path == NULL)
+				slot = &slots[i];
+		slot->path = job.path;
+		slot->fd = job.fd;
+		memcpy(&slot->sb, &job.sb, sizeof(slot->sb));
+	}
+	job.path = NULL;
+	job.done = 0;
+	pthread_mutex_unlock(&mtx);
+
+	prefetch_schedule();
+}
+
+static int
+prefetch_init(void)
+{
+	int		 r;
+
+	if (pipe(notify) == -1) {
+		log_warn("pipe");
+		return -1;
+	}
+	if (fcntl(notify[0], F_SETFD, FD_CLOEXEC) == -1 ||
+	    fcntl(notify[1], F_SETFD, FD_CLOEXEC) == -1) {
+		log_warn("fcntl");
+		goto err;
+	}
+	if ((r = pthread_create(&thread, NULL, worker, NULL)) != 0) {
+		log_warnx("pthread_create: %s", strerror(r));
+		goto err;
+	}
+	if (ev_add(notify[0], POLLIN, prefetch_done, NULL) == -1)
+		fatal("ev_add");
+	return 0;
+
+ err:
+	close(notify[0]);
+	close(notify[1]);
+	notify[0] = notify[1] = -1;
+	return -1;
+}
+
+/*
+ * Hand the first missing track to the helper thread; the next one
+ * is started once it's done.
+ */
+static void
+prefetch_run(int fd, int ev, void *arg)
+{
+	static int	 failed;
+	const char	*paths[NSLOTS];
+	size_t		 i, n;
+
+	timer = 0;
+	if (failed || (notify[0] == -1 && prefetch_init() == -1)) {
+		failed = 1;
+		return;
+	}
+
+	n = upcoming(paths);
+	prune(paths, n);
+
+	pthread_mutex_lock(&mtx);
+	if (job.path != NULL) {
+		/* prefetch_done will call us again */
+		pthread_mutex_unlock(&mtx);
+		return;
+	}
+
+	for (i = 0; i < n; ++i)
+		if (lookup(paths[i]) == NULL)
+			break;
+	if (i < n) {
+		job.path = xstrdup(paths[i]);
+		pthread_cond_signal(&jobcv);
+	}
+	pthread_mutex_unlock(&mtx);
+}
+
+/* refresh the prefetched tracks once back in the event loop */
+void
+prefetch_schedule(void)
+{
+	static const struct timeval tv;
+
+	if (timer != 0 && ev_timer_pending(timer))
+		return;
+	if ((timer = ev_timer(&tv, prefetch_run, NULL)) == 0)
+		log_warn("ev_timer");
+}
+
+/*
+ * Hand over the file descriptor of path, if it was opened already.
+ * Returns -1 if it wasn't or PREFETCH_BAD if it can't be played.
+ */
+int
+prefetch_take(const char *path, struct stat *sb)
+{
+	struct slot	*slot;
+	int		 fd;
+
+	if ((slot = lookup(path)) == NULL)
+		return -1;
+
+	if ((fd = slot->fd) == -1)
+		fd = PREFETCH_BAD;
+	else
+		memcpy(sb, &slot->sb, sizeof(*sb));
+
+	slot->fd = -1;	/* it's the caller's now */
+	slot_clear(slot);
+	return fd;
+}
@@ -0,0 +1,427 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <endian.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define RS_SSE2		1
+#endif
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RS_NEON		1
+#endif
+
+#include "log.h"
+#include "pcm.h"
+#include "resample.h"
+#include "xmalloc.h"
+
+#ifndef M_PI
+#define M_PI		3.14159265358979323846
+#endif
+
+#define RS_TAPS		32	/* per phase when upsampling */
+#define RS_MAXTAPS	128
+#define RS_MAXPHASES	1024
+#define RS_CHUNK	1024	/* input frames processed at a time */
+#define RS_MAXCHANS	8
+
+/*
+ * The rate ratio is reduced to up/down: every output frame k is the
+ * dot product of the taps of phase (k * down) % up with the last
+ * ntaps input frames.
+ */
+static struct {
+	int		 fmt;
+	unsigned int	 width;
+	float		 scale;		/* full range of the samples */
+	unsigned int	 chans;
+	unsigned int	 inrate;
+	unsigned int	 outrate;
+	unsigned int	 up;
+	unsigned int	 down;
+	unsigned int	 ntaps;
+	float		*taps;		/* up phases of ntaps each */
+
+	float		*hist[RS_MAXCHANS];
+	size_t		 hlen;		/* frames in hist */
+	size_t		 pos;		/* newest frame of the next output */
+	unsigned int	 phase;
+
+	uint8_t		*out;
+	size_t		 outcap;
+} rs;
+
+static unsigned int
+gcd(unsigned int a, unsigned int b)
+{
+	unsigned int	 t;
+
+	while (b != 0) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+#if RS_SSE2
+static float
+dot(const float *a, const float *b, size_t n)
+{
+	__m128		 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+	float		 v[4];
+	size_t		 i;
+
+	/* n is always a multiple of 8 */
+	for (i = 0; i < n; i += 8) {
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i),
+		    _mm_loadu_ps(b + i)));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4),
+		    _mm_loadu_ps(b + i + 4)));
+	}
+	_mm_storeu_ps(v, _mm_add_ps(acc0, acc1));
+	return v[0] + v[1] + v[2] + v[3];
+}
+#elif RS_NEON
+static float
+dot(const float *a, const float *b, size_t n)
+{
+	float32x4_t	 acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0);
+	float32x2_t	 s;
+	size_t		 i;
+
+	for (i = 0; i < n; i += 8) {
+		acc0 = vmlaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+		acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4),
+		    vld1q_f32(b + i + 4));
+	}
+	acc0 = vaddq_f32(acc0, acc1);
+	s = vadd_f32(vget_low_f32(acc0), vget_high_f32(acc0));
+	return vget_lane_f32(vpadd_f32(s, s), 0);
+}
+#else
+static float
+dot(const float *a, const float *b, size_t n)
+{
+	float		 acc[4] = { 0, 0, 0, 0 };
+	size_t		 i;
+
+	for (i = 0; i < n; i += 4) {
+		acc[0] += a[i] * b[i];
+		acc[1] += a[i + 1] * b[i + 1];
+		acc[2] += a[i + 2] * b[i + 2];
+		acc[3] += a[i + 3] * b[i + 3];
+	}
+	return acc[0] + acc[1] + acc[2] + acc[3];
+}
+#endif
+
+/*
+ * Windowed sinc low-pass at the upsampled rate, cut a bit below the
+ * lower of the two Nyquist frequencies, split in its phases.  The
+ * taps of each phase are stored reversed so that they can be
+ * multiplied with the history in order.
+ */
+static void
+make_taps(void)
+{
+	double		 fc, c, x, w, sum;
+	size_t		 len, i;
+	unsigned int	 p, j;
+
+	len = (size_t)rs.up * rs.ntaps;
+	fc = 0.45 / (rs.up > rs.down ? rs.up : rs.down);
+	c = (len - 1) / 2.0;
+
+	free(rs.taps);
+	rs.taps = xcalloc(len, sizeof(*rs.taps));
+
+	for (p = 0; p < rs.up; ++p) {
+		sum = 0;
+		for (j = 0; j < rs.ntaps; ++j) {
+			i = p + (size_t)j * rs.up;
+			x = i - c;
+			w = 0.42 - 0.5 * cos(2 * M_PI * i / (len - 1)) +
+			    0.08 * cos(4 * M_PI * i / (len - 1));
+			if (x == 0)
+				x = 2 * fc;
+			else
+				x = sin(2 * M_PI * fc * x) / (M_PI * x);
+			rs.taps[p * rs.ntaps + rs.ntaps - 1 - j] = x * w;
+			sum += x * w;
+		}
+
+		/* unity gain for every phase */
+		for (j = 0; j < rs.ntaps && sum != 0; ++j)
+			rs.taps[p * rs.ntaps + j] /= sum;
+	}
+}
+
+void
+resample_reset(void)
+{
+	unsigned int	 c;
+
+	for (c = 0; c < rs.chans; ++c)
+		memset(rs.hist[c], 0, (rs.ntaps - 1) * sizeof(float));
+	rs.hlen = rs.ntaps - 1;
+	rs.pos = rs.ntaps - 1;
+	rs.phase = 0;
+}
+
+/*
+ * Prepare to convert from inrate to outrate.  Keeps the state if
+ * nothing changed, so that consecutive tracks are joined without
+ * gaps.
+ */
+int
+resample_setup(int fmt, unsigned int chans, unsigned int inrate,
+    unsigned int outrate)
+{
+	unsigned int	 g, up, down, c;
+
+	if (fmt == rs.fmt && chans == rs.chans && inrate == rs.inrate &&
+	    outrate == rs.outrate)
+		return 0;
+
+	if (chans == 0 || chans > RS_MAXCHANS || pcm_width(fmt) == 0) {
+		log_warnx("%s: can't resample %u channels of %s",
+		    __func__, chans, pcm_name(fmt));
+		return -1;
+	}
+
+	g = gcd(inrate, outrate);
+	up = outrate / g;
+	down = inrate / g;
+	if (up > RS_MAXPHASES) {
+		log_warnx("%s: can't resample from %u to %u", __func__,
+		    inrate, outrate);
+		return -1;
+	}
+
+	for (c = 0; c < rs.chans; ++c) {
+		free(rs.hist[c]);
+		rs.hist[c] = NULL;
+	}
+	rs.fmt = fmt;
+	rs.width = pcm_width(fmt);
+	switch (fmt) {
+	case PCM_S8:
+		rs.scale = 128.0f;
+		break;
+	case PCM_S16:
+		rs.scale = 32768.0f;
+		break;
+	case PCM_S32:
+		rs.scale = 2147483648.0f;
+		break;
+	case PCM_F32:
+		rs.scale = 1.0f;
+		break;
+	default:
+		rs.scale = 8388608.0f;
+		break;
+	}
+	rs.chans = chans;
+	rs.inrate = inrate;
+	rs.outrate = outrate;
+	rs.up = up;
+	rs.down = down;
+
+	/* more taps when downsampling, to keep the same steepness */
+	rs.ntaps = RS_TAPS * ((down + up - 1) / up);
+	if (rs.ntaps > RS_MAXTAPS)
+		rs.ntaps = RS_MAXTAPS;
+	make_taps();
+
+	for (c = 0; c < chans; ++c)
+		rs.hist[c] = xcalloc(rs.ntaps - 1 + RS_CHUNK, sizeof(float));
+	resample_reset();
+
+	log_debug("%s: %u -> %u Hz, %u phases of %u taps", __func__,
+	    inrate, outrate, up, rs.ntaps);
+	return 0;
+}
+
+static void
+load(const uint8_t *in, size_t n)
+{
+	float		 scale, f;
+	size_t		 i;
+	unsigned int	 c;
+	int32_t		 v32;
+	int16_t		 v16;
+
+	scale = 1.0f / rs.scale;
+	for (i = 0; i < n; ++i) {
+		for (c = 0; c < rs.chans; ++c) {
+			switch (rs.fmt) {
+			case PCM_S8:
+				f = (int8_t)*in * scale;
+				break;
+			case PCM_S16:
+				memcpy(&v16, in, sizeof(v16));
+				f = v16 * scale;
+				break;
+			case PCM_S24_3:
+#if BYTE_ORDER == BIG_ENDIAN
+				v32 = (uint32_t)in[0] << 24 |
+				    (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8;
+#else
+				v32 = (uint32_t)in[2] << 24 |
+				    (uint32_t)in[1] << 16 | (uint32_t)in[0] << 8;
+#endif
+				f = (v32 >> 8) * scale;
+				break;
+			case PCM_F32:
+				memcpy(&f, in, sizeof(f));
+				break;
+			default:
+				memcpy(&v32, in, sizeof(v32));
+				f = v32 * scale;
+				break;
+			}
+			in += rs.width;
+			rs.hist[c][rs.hlen + i] = f;
+		}
+	}
+	rs.hlen += n;
+}
+
+static void
+store(uint8_t *out, const float *v)
+{
+	double		 max, x;
+	unsigned int	 c;
+	int32_t		 v32;
+	int16_t		 v16;
+	int8_t		 v8;
+
+	max = rs.scale;
+	for (c = 0; c < rs.chans; ++c) {
+		if (rs.fmt == PCM_F32) {
+			memcpy(out, &v[c], sizeof(v[c]));
+			out += sizeof(v[c]);
+			continue;
+		}
+
+		x = v[c] * max;
+		if (x >= max - 1)
+			v32 = max - 1;
+		else if (x <= -max)
+			v32 = -max;
+		else
+			v32 = lrint(x);
+
+		switch (rs.fmt) {
+		case PCM_S8:
+			v8 = v32;
+			*out = v8;
+			break;
+		case PCM_S16:
+			v16 = v32;
+			memcpy(out, &v16, sizeof(v16));
+			break;
+		case PCM_S24_3:
+#if BYTE_ORDER == BIG_ENDIAN
+			out[0] = v32 >> 16;
+			out[1] = v32 >> 8;
+			out[2] = v32;
+#else
+			out[0] = v32;
+			out[1] = v32 >> 8;
+			out[2] = v32 >> 16;
+#endif
+			break;
+		default:
+			memcpy(out, &v32, sizeof(v32));
+			break;
+		}
+		out += rs.width;
+	}
+}
+
+/*
+ * Consume up to a chunk of frames of in and return how many bytes
+ * were used.  The converted frames are left in *out, valid until the
+ * next call.
+ */
+size_t
+resample(const uint8_t *in, size_t len, const uint8_t **out, size_t *outlen)
+{
+	const float	*taps;
+	float		 v[RS_MAXCHANS];
+	size_t		 bpf, n, maxout, shift, o = 0;
+	unsigned int	 c;
+
+	bpf = rs.width * rs.chans;
+	n = len / bpf;
+	if (n > RS_CHUNK)
+		n = RS_CHUNK;
+
+	maxout = ((n + 1) * rs.up) / rs.down + 1;
+	if (maxout * bpf > rs.outcap) {
+		free(rs.out);
+		rs.outcap = maxout * bpf;
+		rs.out = xmalloc(rs.outcap);
+	}
+
+	load(in, n);
+
+	while (rs.pos < rs.hlen) {
+		taps = rs.taps + (size_t)rs.phase * rs.ntaps;
+		for (c = 0; c < rs.chans; ++c)
+			v[c] = dot(taps, rs.hist[c] + rs.pos + 1 - rs.ntaps,
+			    rs.ntaps);
+		store(rs.out + o * bpf, v);
+		o++;
+
+		rs.phase += rs.down;
+		rs.pos += rs.phase / rs.up;
+		rs.phase %= rs.up;
+	}
+
+	/* keep the frames the next outputs still need */
+	shift = rs.hlen - (rs.ntaps - 1);
+	for (c = 0; c < rs.chans; ++c)
+		memmove(rs.hist[c], rs.hist[c] + shift,
+		    (rs.ntaps - 1) * sizeof(float));
+	rs.hlen -= shift;
+	rs.pos -= shift;
+
+	*out = rs.out;
+	*outlen = o * bpf;
+	return n * bpf;
+}
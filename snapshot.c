@@ -0,0 +1,285 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ev.h"
+#include "log.h"
+#include "playlist.h"
+#include "snapshot.h"
+#include "xmalloc.h"
+
+#define SNAP_MAGIC	"amusedsn"
+#define SNAP_VERSION	1
+#define SNAP_EVERY	30	/* seconds between the checks */
+
+#define SNAP_REPEAT_ONE	0x1
+#define SNAP_REPEAT_ALL	0x2
+#define SNAP_CONSUME	0x4
+
+/*
+ * The header is followed by the arrays of the playlist as they are
+ * in memory: the offsets, the hashes and then the arena.  It's
+ * written last, so a snapshot cut short is not picked up.
+ */
+struct snap_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	offsize;	/* sizeof(size_t) of the writer */
+	uint64_t	len;
+	uint64_t	arenalen;
+	int64_t		play_off;
+	int64_t		position;
+	uint32_t	flags;
+	uint32_t	pad;
+};
+
+static void		 snap_tick(int, int, void *);
+
+static int		 snapfd = -1;
+static uint64_t		 saved_gen;
+static struct snap_hdr	 saved;
+static char		*resume_song;
+static int64_t		 resume_pos;
+
+static void
+snap_hdr(struct snap_hdr *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic));
+	hdr->version = SNAP_VERSION;
+	hdr->offsize = sizeof(size_t);
+	hdr->len = playlist.len;
+	hdr->arenalen = playlist.arenalen;
+	hdr->play_off = play_off;
+	if (resume_song != NULL)
+		hdr->position = resume_pos;
+	else if (play_state != STATE_STOPPED && current_position > 0)
+		hdr->position = current_position;
+	if (repeat_one)
+		hdr->flags |= SNAP_REPEAT_ONE;
+	if (repeat_all)
+		hdr->flags |= SNAP_REPEAT_ALL;
+	if (consume)
+		hdr->flags |= SNAP_CONSUME;
+}
+
+static int
+snap_read(void *buf, size_t len, off_t *off)
+{
+	if (pread(snapfd, buf, len, *off) != (ssize_t)len)
+		return -1;
+	*off += len;
+	return 0;
+}
+
+static int
+snap_write(const void *buf, size_t len, off_t *off)
+{
+	if (pwrite(snapfd, buf, len, *off) != (ssize_t)len)
+		return -1;
+	*off += len;
+	return 0;
+}
+
+static int
+snap_load(void)
+{
+	struct snap_hdr	 hdr;
+	struct playlist	 p;
+	struct stat	 sb;
+	off_t		 off = 0;
+	uint64_t	 i;
+
+	if (fstat(snapfd, &sb) == -1)
+		return -1;
+	if (sb.st_size == 0)
+		return 0;
+
+	if (snap_read(&hdr, sizeof(hdr), &off) == -1 ||
+	    memcmp(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != SNAP_VERSION ||
+	    hdr.offsize != sizeof(size_t) ||
+	    hdr.len > SIZE_MAX / sizeof(size_t) ||
+	    (uint64_t)sb.st_size != sizeof(hdr) + hdr.len *
+	    (sizeof(size_t) + sizeof(uint32_t)) + hdr.arenalen ||
+	    hdr.play_off < -1 || hdr.play_off >= (int64_t)hdr.len) {
+		log_warnx("ignoring the invalid snapshot");
+		return 0;
+	}
+
+	memset(&p, 0, sizeof(p));
+	if (hdr.len != 0) {
+		p.len = p.cap = hdr.len;
+		p.arenalen = p.arenacap = hdr.arenalen;
+		p.offs = xcalloc(p.len, sizeof(*p.offs));
+		p.hashes = xcalloc(p.len, sizeof(*p.hashes));
+		p.arena = xmalloc(p.arenalen);
+		if (snap_read(p.offs, p.len * sizeof(*p.offs), &off) == -1 ||
+		    snap_read(p.hashes, p.len * sizeof(*p.hashes), &off) == -1 ||
+		    snap_read(p.arena, p.arenalen, &off) == -1)
+			goto bad;
+
+		if (p.arenalen == 0 || p.arena[p.arenalen - 1] != '\0')
+			goto bad;
+		for (i = 0; i < p.len; ++i)
+			if (p.offs[i] >= p.arenalen)
+				goto bad;
+	}
+
+	repeat_one = !!(hdr.flags & SNAP_REPEAT_ONE);
+	repeat_all = !!(hdr.flags & SNAP_REPEAT_ALL);
+	consume = !!(hdr.flags & SNAP_CONSUME);
+	playlist_swap(&p, hdr.play_off);
+
+	if (hdr.position > 0 && play_off != -1) {
+		resume_song = xstrdup(playlist_song(&playlist, play_off));
+		resume_pos = hdr.position;
+	}
+
+	memcpy(&saved, &hdr, sizeof(saved));
+	saved_gen = playlist_gen;
+	log_debug("%s: %zu songs", __func__, playlist.len);
+	return 0;
+
+ bad:
+	log_warnx("ignoring the corrupted snapshot");
+	playlist_free(&p);
+	return 0;
+}
+
+static void
+snap_arm(void)
+{
+	static const struct timeval tv = { SNAP_EVERY, 0 };
+
+	if (ev_timer(&tv, snap_tick, NULL) == 0)
+		log_warn("ev_timer");
+}
+
+static void
+snap_tick(int fd, int ev, void *arg)
+{
+	snapshot_save();
+	snap_arm();
+}
+
+/*
+ * Called before pledge, so that the file can be kept open.  Nothing
+ * is saved if AMUSED_STATE is not set.
+ */
+void
+snapshot_init(void)
+{
+	const char	*path;
+
+	if ((path = getenv("AMUSED_STATE")) == NULL || *path == '\0')
+		return;
+
+	if ((snapfd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) == -1) {
+		log_warn("open %s", path);
+		return;
+	}
+
+	if (snap_load() == -1) {
+		log_warn("can't load %s", path);
+		close(snapfd);
+		snapfd = -1;
+		return;
+	}
+
+	snap_arm();
+}
+
+/*
+ * Write what changed since the last time: only the header if the
+ * playlist is the same.
+ */
+void
+snapshot_save(void)
+{
+	struct snap_hdr	 hdr, dead;
+	off_t		 off = 0;
+
+	if (snapfd == -1)
+		return;
+
+	snap_hdr(&hdr);
+	if (playlist_gen == saved_gen && !memcmp(&hdr, &saved, sizeof(hdr)))
+		return;
+
+	if (playlist_gen != saved_gen) {
+		memset(&dead, 0, sizeof(dead));
+		if (snap_write(&dead, sizeof(dead), &off) == -1 ||
+		    snap_write(playlist.offs, playlist.len *
+		    sizeof(*playlist.offs), &off) == -1 ||
+		    snap_write(playlist.hashes, playlist.len *
+		    sizeof(*playlist.hashes), &off) == -1 ||
+		    snap_write(playlist.arena, playlist.arenalen, &off) == -1 ||
+		    ftruncate(snapfd, off) == -1) {
+			log_warn("%s: write", __func__);
+			return;
+		}
+	}
+
+	off = 0;
+	if (snap_write(&hdr, sizeof(hdr), &off) == -1) {
+		log_warn("%s: write", __func__);
+		return;
+	}
+
+	memcpy(&saved, &hdr, sizeof(saved));
+	saved_gen = playlist_gen;
+}
+
+/*
+ * The position to seek to if song is the one that was playing when
+ * the snapshot was taken.  Only the first track played is resumed.
+ */
+int64_t
+snapshot_resume(const char *song)
+{
+	int64_t		 pos = 0;
+
+	if (resume_song != NULL && !strcmp(resume_song, song))
+		pos = resume_pos;
+
+	free(resume_song);
+	resume_song = NULL;
+	resume_pos = 0;
+	return pos;
+}
@@ -0,0 +1,189 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "amused.h"
+#include "log.h"
+#include "status.h"
+#include "xmalloc.h"
+
+#define STATUS_MAGIC	"amusedst"
+#define STATUS_VERSION	1
+#define STATUS_RETRIES	1000
+
+struct status_page {
+	char			magic[8];
+	uint32_t		version;
+	_Atomic uint32_t	seq;		/* odd while writing */
+	struct player_status	status;
+};
+
+static struct status_page	*page;
+
+static char *
+status_path(void)
+{
+	char	*path;
+
+	xasprintf(&path, "%s.status", csock);
+	return path;
+}
+
+void
+status_init(void)
+{
+	struct status_page	*p;
+	char			*path;
+	int			 fd;
+
+	path = status_path();
+	if ((fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600)) == -1) {
+		log_warn("open %s", path);
+		free(path);
+		return;
+	}
+
+	/* the lock tells the readers that we're still around */
+	if (flock(fd, LOCK_EX|LOCK_NB) == -1) {
+		log_warn("flock %s", path);
+		goto err;
+	}
+
+	if (ftruncate(fd, sizeof(*p)) == -1) {
+		log_warn("ftruncate %s", path);
+		goto err;
+	}
+
+	p = mmap(NULL, sizeof(*p), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		log_warn("mmap %s", path);
+		goto err;
+	}
+
+	memset(p, 0, sizeof(*p));
+	memcpy(p->magic, STATUS_MAGIC, sizeof(p->magic));
+	p->version = STATUS_VERSION;
+	page = p;
+	status_update();
+
+	/* fd is kept open to hold the lock */
+	free(path);
+	return;
+
+err:
+	close(fd);
+	free(path);
+}
+
+void
+status_update(void)
+{
+	uint32_t	 seq;
+
+	if (page == NULL)
+		return;
+
+	seq = atomic_load_explicit(&page->seq, memory_order_relaxed);
+	atomic_store_explicit(&page->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	main_status(&page->status);
+
+	atomic_store_explicit(&page->seq, seq + 2, memory_order_release);
+}
+
+/*
+ * Copy the status published by a running daemon.  Returns -1 if
+ * there is none, or it can't be read, and the socket has to be used.
+ */
+int
+status_read(struct player_status *ps)
+{
+	struct status_page	*p;
+	struct stat		 sb;
+	char			*path;
+	uint32_t		 seq;
+	int			 fd, i, ret = -1;
+
+	path = status_path();
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	free(path);
+	if (fd == -1)
+		return -1;
+
+	/* if we can get the lock there's nobody writing it */
+	if (flock(fd, LOCK_SH|LOCK_NB) == 0 || errno != EWOULDBLOCK ||
+	    fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(*p)) {
+		close(fd);
+		return -1;
+	}
+
+	p = mmap(NULL, sizeof(*p), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+
+	if (memcmp(p->magic, STATUS_MAGIC, sizeof(p->magic)) != 0 ||
+	    p->version != STATUS_VERSION)
+		goto done;
+
+	for (i = 0; i < STATUS_RETRIES; ++i) {
+		seq = atomic_load_explicit(&p->seq, memory_order_acquire);
+		if (seq & 1)
+			continue;
+
+		memcpy(ps, &p->status, sizeof(*ps));
+		atomic_thread_fence(memory_order_acquire);
+
+		if (atomic_load_explicit(&p->seq, memory_order_relaxed) == seq) {
+			ret = 0;
+			break;
+		}
+	}
+
+	if (ret == 0 && ps->path[sizeof(ps->path) - 1] != '\0')
+		ret = -1;
+
+done:
+	munmap(p, sizeof(*p));
+	return ret;
+}
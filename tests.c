@@ -88,6 +88,18 @@ main(void)
 	return 0;
 }
 #endif /* TEST_CRYPT_NEWHASH */
+#if TEST_DIRENT_D_TYPE
+#include <dirent.h>
+
+int
+main(void)
+{
+	struct dirent d;
+
+	d.d_type = DT_DIR;
+	return d.d_type != DT_DIR;
+}
+#endif /* TEST_DIRENT_D_TYPE */
 #if TEST_ENDIAN_H
 #ifdef __linux__
 # define _DEFAULT_SOURCE
@@ -100,6 +112,23 @@ main(void)
 	return !htole32(23);
 }
 #endif /* TEST_ENDIAN_H */
+#if TEST_EPOLL
+#include <sys/epoll.h>
+
+int
+main(void)
+{
+	struct epoll_event ev;
+	int fd;
+
+	if ((fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return 1;
+	ev.events = EPOLLIN;
+	ev.data.fd = 0;
+	epoll_ctl(fd, EPOLL_CTL_ADD, 0, &ev);
+	return epoll_wait(fd, &ev, 1, 0) == -1;
+}
+#endif /* TEST_EPOLL */
 #if TEST_ERR
 /*
  * Copyright (c) 2015 Ingo Schwarze <schwarze@openbsd.org>
@@ -243,6 +272,17 @@ main(void)
 	return progname == NULL;
 }
 #endif /* TEST_GETPROGNAME */
+#if TEST_LIB_DL
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stddef.h>
+
+int
+main(void)
+{
+	return dlsym(RTLD_NEXT, "malloc") == NULL;
+}
+#endif /* TEST_LIB_DL */
 #if TEST_LIB_IMSG
 #include <sys/types.h>
 #include <sys/queue.h>
@@ -277,6 +317,23 @@ main(void)
 	return 0;
 }
 #endif /* TEST_INFTIM */
+#if TEST_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+int
+main(void)
+{
+	struct kevent ev;
+	int fd;
+
+	if ((fd = kqueue()) == -1)
+		return 1;
+	EV_SET(&ev, 0, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	return kevent(fd, &ev, 1, NULL, 0, NULL) == -1;
+}
+#endif /* TEST_KQUEUE */
 #if TEST_LANDLOCK
 #include <linux/landlock.h>
 #include <stdlib.h>
@@ -459,6 +516,15 @@ main(void)
 	return !!pledge("stdio", NULL);
 }
 #endif /* TEST_PLEDGE */
+#if TEST_POSIX_FADVISE
+#include <fcntl.h>
+
+int
+main(void)
+{
+	return posix_fadvise(0, 0, 0, POSIX_FADV_WILLNEED) == -1;
+}
+#endif /* TEST_POSIX_FADVISE */
 #if TEST_PROGRAM_INVOCATION_SHORT_NAME
 #define _GNU_SOURCE         /* See feature_test_macros(7) */
 #include <errno.h>
@@ -1006,3 +1072,20 @@ main(void)
 	return 0;
 }
 #endif /* TEST_LIB_MD */
+#if TEST_LIB_Z
+#include <string.h>
+#include <zlib.h>
+
+int
+main(void)
+{
+	z_stream zs;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		return 1;
+	deflateEnd(&zs);
+	return 0;
+}
+#endif /* TEST_LIB_Z */
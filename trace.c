@@ -0,0 +1,239 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "trace.h"
+#include "xmalloc.h"
+
+#define TRACE_RING	4096
+
+static int			 tracefd = -1;
+static uint32_t			 lastid;
+static struct trace_event	 ring[TRACE_RING];
+static size_t			 ringlen;
+static size_t			 ringpos;	/* next to overwrite */
+
+static char			 out[8192];
+static size_t			 outlen;
+static int			 outerr;
+
+/* the time until each stage, as the name of the span ending there */
+static const char *spans[TRACE__LAST] = {
+	[TRACE_OPENED] =	"open",
+	[TRACE_SENT] =		"lookup",
+	[TRACE_RECV] =		"imsg",
+	[TRACE_START] =		"queued",
+	[TRACE_SNIFFED] =	"sniff",
+	[TRACE_SETUP] =		"decoder init",
+	[TRACE_CONFIGURED] =	"device setup",
+	[TRACE_WRITTEN] =	"first write",
+};
+
+/*
+ * Called before pledge, so that the file can be kept open.  Nothing
+ * is traced if AMUSED_TRACE is not set.
+ */
+void
+trace_init(void)
+{
+	const char	*path;
+
+	if ((path = getenv("AMUSED_TRACE")) == NULL || *path == '\0')
+		return;
+
+	if ((tracefd = open(path, O_WRONLY|O_CREAT|O_CLOEXEC, 0600)) == -1)
+		log_warn("open %s", path);
+}
+
+/* a new id for a track, or zero if not tracing */
+uint32_t
+trace_track(void)
+{
+	if (tracefd == -1)
+		return 0;
+	if (++lastid == 0)
+		lastid = 1;
+	return lastid;
+}
+
+void
+trace_mark(uint32_t track, int stage)
+{
+	struct trace_event	 ev;
+	struct timespec		 ts;
+
+	if (tracefd == -1 || track == 0)
+		return;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		fatal("clock_gettime");
+
+	memset(&ev, 0, sizeof(ev));
+	ev.usec = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+	ev.track = track;
+	ev.stage = stage;
+	ev.proc = TRACE_MAIN;
+	trace_add(&ev);
+}
+
+void
+trace_add(const struct trace_event *ev)
+{
+	if (tracefd == -1 || ev->track == 0 || ev->stage >= TRACE__LAST)
+		return;
+
+	memcpy(&ring[ringpos], ev, sizeof(*ev));
+	ringpos = (ringpos + 1) % TRACE_RING;
+	if (ringlen < TRACE_RING)
+		ringlen++;
+}
+
+static void
+trace_flush(void)
+{
+	size_t	 off = 0;
+	ssize_t	 w;
+
+	while (!outerr && off < outlen) {
+		if ((w = write(tracefd, out + off, outlen - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			outerr = 1;
+			break;
+		}
+		off += w;
+	}
+	outlen = 0;
+}
+
+static void
+trace_printf(const char *fmt, ...)
+{
+	va_list	 ap;
+	int	 r;
+
+	va_start(ap, fmt);
+	r = vsnprintf(out + outlen, sizeof(out) - outlen, fmt, ap);
+	va_end(ap);
+	if (r < 0 || (size_t)r >= sizeof(out))
+		fatalx("%s: line too long", __func__);
+
+	if ((size_t)r >= sizeof(out) - outlen) {
+		trace_flush();
+		va_start(ap, fmt);
+		(void)vsnprintf(out, sizeof(out), fmt, ap);
+		va_end(ap);
+	}
+	outlen += r;
+}
+
+static int
+trace_cmp(const void *a, const void *b)
+{
+	const struct trace_event *ea = a, *eb = b;
+
+	if (ea->track != eb->track)
+		return ea->track < eb->track ? -1 : 1;
+	if (ea->usec != eb->usec)
+		return ea->usec < eb->usec ? -1 : 1;
+	return ea->stage - eb->stage;
+}
+
+/*
+ * Rewrite the file with what's in the ring: every track is a row of
+ * both processes, with a span for the time spent to reach each stage
+ * from the previous one.
+ */
+void
+trace_dump(void)
+{
+	struct trace_event	*evs, *ev, *prev;
+	size_t			 i, start;
+
+	if (tracefd == -1)
+		return;
+
+	evs = xcalloc(ringlen ? ringlen : 1, sizeof(*evs));
+	start = (ringpos + TRACE_RING - ringlen) % TRACE_RING;
+	for (i = 0; i < ringlen; ++i)
+		memcpy(&evs[i], &ring[(start + i) % TRACE_RING],
+		    sizeof(*evs));
+	qsort(evs, ringlen, sizeof(*evs), trace_cmp);
+
+	outerr = 0;
+	if (lseek(tracefd, 0, SEEK_SET) == -1 || ftruncate(tracefd, 0) == -1) {
+		log_warn("%s: truncate", __func__);
+		free(evs);
+		return;
+	}
+
+	trace_printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	trace_printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	    "\"args\":{\"name\":\"main\"}},\n", TRACE_MAIN);
+	trace_printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	    "\"args\":{\"name\":\"player\"}}", TRACE_PLAYER);
+
+	for (i = 0; i < ringlen; ++i) {
+		ev = &evs[i];
+		prev = i > 0 && evs[i - 1].track == ev->track ?
+		    &evs[i - 1] : NULL;
+
+		if (prev == NULL || spans[ev->stage] == NULL) {
+			trace_printf(",\n{\"name\":\"track %u\",\"ph\":\"i\","
+			    "\"s\":\"t\",\"ts\":%lld,\"pid\":%d,\"tid\":%u}",
+			    ev->track, (long long)ev->usec, ev->proc,
+			    ev->track);
+			continue;
+		}
+
+		trace_printf(",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,"
+		    "\"dur\":%lld,\"pid\":%d,\"tid\":%u,"
+		    "\"args\":{\"track\":%u}}", spans[ev->stage],
+		    (long long)prev->usec, (long long)(ev->usec - prev->usec),
+		    ev->proc, ev->track, ev->track);
+	}
+
+	trace_printf("\n]}\n");
+	trace_flush();
+	if (outerr)
+		log_warn("%s: write", __func__);
+
+	free(evs);
+}
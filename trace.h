@@ -0,0 +1,69 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Timestamps of the stages of a track start, in both processes.  If
+ * AMUSED_TRACE is set, main gives every track it opens an id that
+ * travels with it to the player and keeps the last events of both
+ * in a ring, which is written to that file as Chrome trace-event
+ * JSON on SIGUSR1 and on exit.
+ */
+
+enum trace_stage {
+	TRACE_OPEN,		/* main: about to open the file */
+	TRACE_OPENED,		/* main: opened and stat'ed */
+	TRACE_SENT,		/* main: IMSG_PLAY or IMSG_PREPARE queued */
+	TRACE_RECV,		/* player: got the track */
+	TRACE_START,		/* player: player_playnext */
+	TRACE_SNIFFED,		/* player: the decoder is known */
+	TRACE_SETUP,		/* player: the decoder asks for the device */
+	TRACE_CONFIGURED,	/* player: the device is set up */
+	TRACE_WRITTEN,		/* player: first write of the track */
+	TRACE__LAST,
+};
+
+enum trace_proc {
+	TRACE_MAIN = 1,
+	TRACE_PLAYER,
+};
+
+struct trace_event {
+	int64_t		usec;		/* CLOCK_MONOTONIC */
+	uint32_t	track;		/* never zero */
+	uint8_t		stage;
+	uint8_t		proc;
+};
+
+void		trace_init(void);
+uint32_t	trace_track(void);
+void		trace_mark(uint32_t, int);
+void		trace_add(const struct trace_event *);
+void		trace_dump(void);
+
+#endif
@@ -0,0 +1,336 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ *
+ * Anyone is free to copy, modify, publish, use, compile, sell, or
+ * distribute this software, either in source code form or as a compiled
+ * binary, for any purpose, commercial or non-commercial, and by any
+ * means.
+ *
+ * In jurisdictions that recognize copyright laws, the author or authors
+ * of this software dedicate any and all copyright interest in the
+ * software to the public domain. We make this dedication for the benefit
+ * of the public at large and to the detriment of our heirs and
+ * successors. We intend this dedication to be an overt act of
+ * relinquishment in perpetuity of all present and future rights to this
+ * software under copyright law.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "walk.h"
+#include "xmalloc.h"
+
+/* the walk is bound by the disk more than by the cpu */
+#define WALK_THREADS	8
+
+/* the files found in a directory, NUL-separated */
+struct wgroup {
+	char			*buf;
+	size_t			 len;
+	size_t			 cap;
+};
+
+/*
+ * A directory to scan.  The workers take them in any order, but the
+ * results are handed over depth-first, with the subdirectories in
+ * sorted order, so that the same tree is always enqueued the same.
+ */
+struct wjob {
+	TAILQ_ENTRY(wjob)	 entry;		/* in jobs */
+	TAILQ_ENTRY(wjob)	 sibling;	/* in the parent's subdirs */
+	char			*path;
+	struct wgroup		*g;
+	TAILQ_HEAD(, wjob)	 subdirs;
+	int			 done;
+};
+TAILQ_HEAD(wjobs, wjob);
+
+enum wtype {
+	W_UNKNOWN,
+	W_DIR,
+	W_REG,
+	W_LNK,
+};
+
+struct went {
+	char			*name;
+	enum wtype		 type;
+};
+
+static pthread_mutex_t	 mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 jobcv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	 outcv = PTHREAD_COND_INITIALIZER;
+static struct wjobs	 jobs = TAILQ_HEAD_INITIALIZER(jobs);
+static int		 finished;
+
+static struct wjob *
+job_new(const char *path)
+{
+	struct wjob	*job;
+
+	job = xcalloc(1, sizeof(*job));
+	job->path = xstrdup(path);
+	TAILQ_INIT(&job->subdirs);
+	return job;
+}
+
+/* the same magic numbers as player_sniff */
+static int
+wanted(int dirfd, const char *name)
+{
+	char	buf[512];
+	ssize_t	r;
+	int	fd;
+
+	if ((fd = openat(dirfd, name, O_RDONLY|O_CLOEXEC)) == -1)
+		return 0;
+	r = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	if (r < 8)
+		return 0;
+
+	return memcmp(buf, "fLaC", 4) == 0 ||
+	    memcmp(buf, "ID3", 3) == 0 ||
+	    memcmp(buf, "\xFF\xFB", 2) == 0 ||
+	    memmem(buf, r, "OpusHead", 8) != NULL ||
+	    memmem(buf, r, "OggS", 4) != NULL;
+}
+
+static enum wtype
+wtype(struct dirent *dp)
+{
+#if HAVE_DIRENT_D_TYPE
+	switch (dp->d_type) {
+	case DT_DIR:
+		return W_DIR;
+	case DT_REG:
+		return W_REG;
+	case DT_LNK:
+		return W_LNK;
+	}
+#endif
+	return W_UNKNOWN;
+}
+
+static int
+went_cmp(const void *a, const void *b)
+{
+	const struct went *ea = a, *eb = b;
+
+	return strcmp(ea->name, eb->name);
+}
+
+static void
+group_add(struct wgroup *g, const char *path)
+{
+	size_t len;
+
+	len = strlen(path) + 1;
+	if (g->len + len > g->cap) {
+		g->cap = 2 * (g->len + len);
+		g->buf = xreallocarray(g->buf, g->cap, 1);
+	}
+	memcpy(g->buf + g->len, path, len);
+	g->len += len;
+}
+
+/*
+ * Read the directory of job.  The subdirectories are appended to its
+ * subdirs and the music files returned, if any.
+ */
+static struct wgroup *
+scan(struct wjob *job)
+{
+	const char	*path = job->path;
+	struct wjob	*sub;
+	DIR		*dirp;
+	struct dirent	*dp;
+	struct stat	 sb;
+	struct went	*ents = NULL;
+	struct wgroup	*g = NULL;
+	char		 full[PATH_MAX];
+	const char	*sep;
+	size_t		 i, n = 0, cap = 0;
+	int		 fd, r;
+
+	fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1 || (dirp = fdopendir(fd)) == NULL) {
+		log_warn("can't open %s", path);
+		if (fd != -1)
+			close(fd);
+		return NULL;
+	}
+
+	while ((dp = readdir(dirp)) != NULL) {
+		if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+			continue;
+		if (n == cap) {
+			cap = cap == 0 ? 64 : cap * 2;
+			ents = xreallocarray(ents, cap, sizeof(*ents));
+		}
+		ents[n].name = xstrdup(dp->d_name);
+		ents[n].type = wtype(dp);
+		n++;
+	}
+	qsort(ents, n, sizeof(*ents), went_cmp);
+
+	sep = path[strlen(path) - 1] == '/' ? "" : "/";
+	for (i = 0; i < n; ++i) {
+		if (ents[i].type == W_UNKNOWN || ents[i].type == W_LNK) {
+			if (fstatat(fd, ents[i].name, &sb, 0) == -1)
+				goto next;
+			if (S_ISREG(sb.st_mode))
+				ents[i].type = W_REG;
+			else if (S_ISDIR(sb.st_mode) &&
+			    ents[i].type == W_UNKNOWN)
+				ents[i].type = W_DIR;
+			else
+				goto next;
+		}
+
+		r = snprintf(full, sizeof(full), "%s%s%s", path, sep,
+		    ents[i].name);
+		if (r < 0 || (size_t)r >= sizeof(full)) {
+			log_warnx("path too long: %s%s%s", path, sep,
+			    ents[i].name);
+			goto next;
+		}
+
+		if (ents[i].type == W_DIR) {
+			sub = job_new(full);
+			TAILQ_INSERT_TAIL(&job->subdirs, sub, sibling);
+		} else if (wanted(fd, ents[i].name)) {
+			if (g == NULL)
+				g = xcalloc(1, sizeof(*g));
+			group_add(g, full);
+		}
+
+ next:
+		free(ents[i].name);
+	}
+
+	free(ents);
+	closedir(dirp);
+	return g;
+}
+
+static void *
+worker(void *arg)
+{
+	struct wgroup	*g;
+	struct wjob	*job, *sub;
+
+	pthread_mutex_lock(&mtx);
+	for (;;) {
+		while (TAILQ_EMPTY(&jobs) && !finished)
+			pthread_cond_wait(&jobcv, &mtx);
+		if (finished)
+			break;
+
+		job = TAILQ_FIRST(&jobs);
+		TAILQ_REMOVE(&jobs, job, entry);
+		pthread_mutex_unlock(&mtx);
+
+		g = scan(job);
+
+		pthread_mutex_lock(&mtx);
+		TAILQ_FOREACH(sub, &job->subdirs, sibling)
+			TAILQ_INSERT_TAIL(&jobs, sub, entry);
+		if (!TAILQ_EMPTY(&job->subdirs))
+			pthread_cond_broadcast(&jobcv);
+		job->g = g;
+		job->done = 1;
+		pthread_cond_broadcast(&outcv);
+	}
+	pthread_mutex_unlock(&mtx);
+
+	return NULL;
+}
+
+size_t
+walk(const char *root, void (*cb)(const char *, void *), void *arg)
+{
+	pthread_t	 threads[WALK_THREADS];
+	struct wgroup	*g;
+	struct wjob	*job, *sub, **stack;
+	size_t		 i, n = 0, depth = 0, cap = 16;
+	int		 nthreads, r;
+
+	finished = 0;
+	stack = xcalloc(cap, sizeof(*stack));
+	stack[depth++] = job = job_new(root);
+	TAILQ_INSERT_TAIL(&jobs, job, entry);
+
+	for (nthreads = 0; nthreads < WALK_THREADS; ++nthreads) {
+		r = pthread_create(&threads[nthreads], NULL, worker, NULL);
+		if (r != 0) {
+			if (nthreads == 0)
+				fatalx("pthread_create: %s", strerror(r));
+			break;
+		}
+	}
+
+	while (depth > 0) {
+		job = stack[--depth];
+
+		pthread_mutex_lock(&mtx);
+		while (!job->done)
+			pthread_cond_wait(&outcv, &mtx);
+		pthread_mutex_unlock(&mtx);
+
+		if ((g = job->g) != NULL) {
+			for (i = 0; i < g->len; i += strlen(g->buf + i) + 1) {
+				cb(g->buf + i, arg);
+				n++;
+			}
+			free(g->buf);
+			free(g);
+		}
+
+		/* the first subdirectory has to be on top */
+		TAILQ_FOREACH_REVERSE(sub, &job->subdirs, wjobs, sibling) {
+			if (depth == cap) {
+				cap *= 2;
+				stack = xreallocarray(stack, cap,
+				    sizeof(*stack));
+			}
+			stack[depth++] = sub;
+		}
+
+		free(job->path);
+		free(job);
+	}
+	free(stack);
+
+	pthread_mutex_lock(&mtx);
+	finished = 1;
+	pthread_cond_broadcast(&jobcv);
+	pthread_mutex_unlock(&mtx);
+
+	while (nthreads > 0)
+		pthread_join(threads[--nthreads], NULL);
+
+	return n;
+}
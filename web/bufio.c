@@ -25,6 +25,8 @@
 
 #include "config.h"
 
+#include <sys/uio.h>
+
 #include <assert.h>
 #include <errno.h>
 #include <poll.h>
@@ -37,6 +39,20 @@
 
 #include "bufio.h"
 
+/* references shorter than this are copied */
+#define BIO_MINREF	64
+
+#define BIO_IOVMAX	64
+
+/* how many free segments and blocks are kept around */
+#define BIO_POOLSEGS	1024
+#define BIO_POOLBLOCKS	64
+
+static struct bufseg	*freesegs;
+static size_t		 nfreesegs;
+static void		*freeblocks;
+static size_t		 nfreeblocks;
+
 int
 buf_init(struct buffer *buf)
 {
@@ -113,29 +129,111 @@ buf_free(struct buffer *buf)
 	memset(buf, 0, sizeof(*buf));
 }
 
+static struct bufseg *
+seg_new(int withblock)
+{
+	struct bufseg	*seg;
+
+	if ((seg = freesegs) != NULL) {
+		freesegs = seg->next;
+		nfreesegs--;
+	} else if ((seg = malloc(sizeof(*seg))) == NULL)
+		return (NULL);
+
+	memset(seg, 0, sizeof(*seg));
+	if (!withblock)
+		return (seg);
+
+	if ((seg->block = freeblocks) != NULL) {
+		memcpy(&freeblocks, seg->block, sizeof(freeblocks));
+		nfreeblocks--;
+	} else if ((seg->block = malloc(BIO_BLOCK)) == NULL) {
+		free(seg);
+		return (NULL);
+	}
+	seg->ptr = seg->block;
+	return (seg);
+}
+
+struct bufshared *
+bufshared_new(size_t len)
+{
+	struct bufshared	*sh;
+
+	if ((sh = malloc(sizeof(*sh) + len)) == NULL)
+		return (NULL);
+	sh->refs = 1;
+	sh->len = len;
+	return (sh);
+}
+
+void
+bufshared_unref(struct bufshared *sh)
+{
+	if (sh != NULL && --sh->refs == 0)
+		free(sh);
+}
+
+static void
+seg_free(struct bufseg *seg)
+{
+	bufshared_unref(seg->shared);
+
+	if (seg->block != NULL) {
+		if (nfreeblocks < BIO_POOLBLOCKS) {
+			memcpy(seg->block, &freeblocks, sizeof(freeblocks));
+			freeblocks = seg->block;
+			nfreeblocks++;
+		} else
+			free(seg->block);
+	}
+
+	if (nfreesegs < BIO_POOLSEGS) {
+		seg->next = freesegs;
+		freesegs = seg;
+		nfreesegs++;
+	} else
+		free(seg);
+}
+
+static void
+bufio_enqueue(struct bufio *bio, struct bufseg *seg)
+{
+	seg->next = NULL;
+	if (bio->wtail != NULL)
+		bio->wtail->next = seg;
+	else
+		bio->whead = seg;
+	bio->wtail = seg;
+}
+
 int
 bufio_init(struct bufio *bio)
 {
 	memset(bio, 0, sizeof(*bio));
 	bio->fd = -1;
 
-	if (buf_init(&bio->wbuf) == -1)
-		return (-1);
-	if (buf_init(&bio->rbuf) == -1) {
-		buf_free(&bio->wbuf);
+	if (buf_init(&bio->rbuf) == -1)
 		return (-1);
-	}
 	return (0);
 }
 
 void
 bufio_free(struct bufio *bio)
 {
+	struct bufseg	*seg;
+
 	if (bio->fd != -1)
 		close(bio->fd);
 
+	while ((seg = bio->whead) != NULL) {
+		bio->whead = seg->next;
+		seg_free(seg);
+	}
+	bio->wtail = NULL;
+	bio->chunk = NULL;
+
 	buf_free(&bio->rbuf);
-	buf_free(&bio->wbuf);
 }
 
 int
@@ -163,7 +261,7 @@ bufio_pollev(struct bufio *bio)
 	short		 ev;
 
 	ev = POLLIN;
-	if (bio->wbuf.len != 0)
+	if (bio->whead != NULL)
 		ev |= POLLOUT;
 
 	return (ev);
@@ -200,57 +298,202 @@ bufio_drain(struct bufio *bio, void *d, size_t len)
 	return (len);
 }
 
+/*
+ * What was composed since the chunk was opened becomes a single
+ * chunk, now that its size is known.
+ */
+static int
+bufio_close_chunk(struct bufio *bio)
+{
+	struct bufseg	*seg = bio->chunk, *prev;
+	int		 r;
+
+	if (seg == NULL)
+		return (0);
+	bio->chunk = NULL;
+
+	if (bio->chunklen == 0) {
+		/* nothing was added after the header */
+		if (bio->whead == seg) {
+			bio->whead = NULL;
+			bio->wtail = NULL;
+		} else {
+			for (prev = bio->whead; prev->next != seg;
+			    prev = prev->next)
+				/* nop */;
+			prev->next = NULL;
+			bio->wtail = prev;
+		}
+		seg_free(seg);
+		return (0);
+	}
+
+	r = snprintf((char *)seg->small, sizeof(seg->small), "%zx\r\n",
+	    bio->chunklen);
+	if (r < 0 || (size_t)r >= sizeof(seg->small))
+		return (-1);
+	seg->len = r;
+
+	if ((seg = seg_new(0)) == NULL)
+		return (-1);
+	seg->ptr = (const uint8_t *)"\r\n";
+	seg->len = 2;
+	bufio_enqueue(bio, seg);
+	return (0);
+}
+
+static int
+bufio_open_chunk(struct bufio *bio)
+{
+	struct bufseg	*seg;
+
+	if (!bio->chunked || bio->chunk != NULL)
+		return (0);
+
+	if ((seg = seg_new(0)) == NULL)
+		return (-1);
+	seg->ptr = seg->small;
+	bufio_enqueue(bio, seg);
+	bio->chunk = seg;
+	bio->chunklen = 0;
+	return (0);
+}
+
 ssize_t
 bufio_write(struct bufio *bio)
 {
-	struct buffer	*wbuf = &bio->wbuf;
+	struct iovec	 iov[BIO_IOVMAX];
+	struct bufseg	*seg;
 	ssize_t		 w;
+	size_t		 left;
+	int		 n = 0;
 
-	w = write(bio->fd, wbuf->buf, wbuf->len);
-	if (w == -1)
+	if (bufio_close_chunk(bio) == -1)
 		return (-1);
-	buf_drain(wbuf, w);
+
+	for (seg = bio->whead; seg != NULL && n < BIO_IOVMAX;
+	    seg = seg->next) {
+		iov[n].iov_base = (void *)seg->ptr;
+		iov[n].iov_len = seg->len;
+		n++;
+	}
+
+	if (n == 0)
+		return (0);
+
+	if ((w = writev(bio->fd, iov, n)) == -1)
+		return (-1);
+
+	for (left = w; left > 0; ) {
+		seg = bio->whead;
+		if (left < seg->len) {
+			seg->ptr += left;
+			seg->len -= left;
+			break;
+		}
+
+		left -= seg->len;
+		if ((bio->whead = seg->next) == NULL)
+			bio->wtail = NULL;
+		seg_free(seg);
+	}
+
 	return (w);
 }
 
 static int
 bufio_append(struct bufio *bio, const void *d, size_t len)
 {
-	struct buffer	*wbuf = &bio->wbuf;
-
-	if (len == 0)
-		return (0);
-
-	while (wbuf->cap - wbuf->len < len) {
-		if (buf_grow(wbuf) == -1)
-			return (-1);
+	struct bufseg	*seg;
+	const uint8_t	*s = d;
+	uint8_t		*end;
+	size_t		 avail;
+
+	while (len > 0) {
+		seg = bio->wtail;
+		if (seg == NULL || seg->block == NULL ||
+		    (end = (uint8_t *)seg->ptr + seg->len) ==
+		    seg->block + BIO_BLOCK) {
+			if ((seg = seg_new(1)) == NULL)
+				return (-1);
+			bufio_enqueue(bio, seg);
+			end = seg->block;
+		}
+
+		avail = seg->block + BIO_BLOCK - end;
+		if (avail > len)
+			avail = len;
+		memcpy(end, s, avail);
+		seg->len += avail;
+		s += avail;
+		len -= avail;
 	}
 
-	memcpy(wbuf->buf + wbuf->len, d, len);
-	wbuf->len += len;
 	return (0);
 }
 
 int
 bufio_compose(struct bufio *bio, const void *d, size_t len)
 {
-	char		 n[16];
-	int		 r;
-
-	if (bio->chunked) {
-		r = snprintf(n, sizeof(n), "%zx\r\n", len);
-		if (r < 0 || (size_t)r >= sizeof(n))
-			return (-1);
-		if (bufio_append(bio, n, r) == -1)
+	if (len == 0) {
+		/* the last chunk */
+		if (!bio->chunked)
+			return (0);
+		if (bufio_close_chunk(bio) == -1)
 			return (-1);
+		return (bufio_append(bio, "0\r\n\r\n", 5));
 	}
 
-	if (bufio_append(bio, d, len) == -1)
+	if (bufio_open_chunk(bio) == -1 ||
+	    bufio_append(bio, d, len) == -1)
 		return (-1);
+	if (bio->chunked)
+		bio->chunklen += len;
+	return (0);
+}
+
+/*
+ * Like bufio_compose but d is queued without being copied, so it
+ * has to stay around until written.
+ */
+int
+bufio_compose_ref(struct bufio *bio, const void *d, size_t len)
+{
+	struct bufseg	*seg;
 
+	if (len == 0)
+		return (0);
+	if (len < BIO_MINREF)
+		return (bufio_compose(bio, d, len));
+
+	if (bufio_open_chunk(bio) == -1 || (seg = seg_new(0)) == NULL)
+		return (-1);
+	seg->ptr = d;
+	seg->len = len;
+	bufio_enqueue(bio, seg);
 	if (bio->chunked)
-		return bufio_append(bio, "\r\n", 2);
+		bio->chunklen += len;
+	return (0);
+}
 
+/* queue a reference to sh, which is released once written */
+int
+bufio_compose_shared(struct bufio *bio, struct bufshared *sh)
+{
+	struct bufseg	*seg;
+
+	if (sh->len == 0)
+		return (0);
+
+	if (bufio_open_chunk(bio) == -1 || (seg = seg_new(0)) == NULL)
+		return (-1);
+	sh->refs++;
+	seg->shared = sh;
+	seg->ptr = sh->data;
+	seg->len = sh->len;
+	bufio_enqueue(bio, seg);
+	if (bio->chunked)
+		bio->chunklen += sh->len;
 	return (0);
 }
 
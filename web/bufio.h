@@ -30,10 +30,40 @@ struct buffer {
 	size_t		 cap;
 };
 
+/*
+ * The output is a queue of segments flushed with writev(2).  A
+ * segment either owns a block taken from a pool shared by all the
+ * clients, or references memory that outlives it, like the static
+ * assets, which is then never copied.
+ */
+#define BIO_BLOCK	16384
+
+/*
+ * A refcounted buffer that can be queued on several bufio at once,
+ * to send the same data to many clients without copying it.
+ */
+struct bufshared {
+	int		 refs;
+	size_t		 len;
+	uint8_t		 data[];
+};
+
+struct bufseg {
+	struct bufseg	*next;
+	const uint8_t	*ptr;		/* next byte to write */
+	size_t		 len;		/* bytes left to write */
+	uint8_t		*block;		/* BIO_BLOCK bytes, or NULL */
+	struct bufshared *shared;	/* or NULL */
+	uint8_t		 small[16];	/* for the chunk headers */
+};
+
 struct bufio {
 	int		 fd;
 	int		 chunked;
-	struct buffer	 wbuf;
+	struct bufseg	*whead;
+	struct bufseg	*wtail;
+	struct bufseg	*chunk;		/* header of the open chunk */
+	size_t		 chunklen;
 	struct buffer	 rbuf;
 };
 
@@ -44,6 +74,9 @@ void	buf_drain(struct buffer *, size_t);
 void	buf_drain_line(struct buffer *, const char *);
 void	buf_free(struct buffer *);
 
+struct bufshared *bufshared_new(size_t);
+void	bufshared_unref(struct bufshared *);
+
 int	bufio_init(struct bufio *);
 void	bufio_free(struct bufio *);
 int	bufio_reset(struct bufio *);
@@ -54,6 +87,8 @@ ssize_t	bufio_read(struct bufio *);
 size_t	bufio_drain(struct bufio *, void *, size_t);
 ssize_t	bufio_write(struct bufio *);
 int	bufio_compose(struct bufio *, const void *, size_t);
+int	bufio_compose_ref(struct bufio *, const void *, size_t);
+int	bufio_compose_shared(struct bufio *, struct bufshared *);
 int	bufio_compose_str(struct bufio *, const char *);
 int	bufio_compose_fmt(struct bufio *, const char *, ...)
 	    __attribute__((__format__ (printf, 2, 3)));
@@ -35,6 +35,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sha1.h>
+
+#if HAVE_LIB_Z
+#include <zlib.h>
+#endif
 
 #include "bufio.h"
 #include "http.h"
@@ -48,6 +53,155 @@
 
 #define HTTP_MAX_UPLOAD 4096
 
+#define CACHE_FOREVER	"public, max-age=31536000, immutable"
+
+/*
+ * Smaller than the default window and memory level: the pages are
+ * not that big and there may be several of them in flight.
+ */
+#define GZ_WBITS	(13 + 16)	/* + 16 for the gzip wrapper */
+#define GZ_MEMLEVEL	7
+#define GZ_BUFSIZ	4096
+
+#if HAVE_LIB_Z
+struct gzstream {
+	z_stream	 zs;
+	size_t		 len;
+	char		 in[GZ_BUFSIZ];
+};
+
+static char *
+gzip_data(const char *d, size_t len, size_t *gzlen)
+{
+	z_stream	 zs;
+	char		*gz;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		return (NULL);
+
+	*gzlen = deflateBound(&zs, len);
+	gz = xmalloc(*gzlen);
+
+	zs.next_in = (Bytef *)d;
+	zs.avail_in = len;
+	zs.next_out = (Bytef *)gz;
+	zs.avail_out = *gzlen;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&zs);
+		free(gz);
+		return (NULL);
+	}
+
+	*gzlen = zs.total_out;
+	deflateEnd(&zs);
+	return (gz);
+}
+
+static int
+gz_deflate(struct client *clt, int flush)
+{
+	struct gzstream	*gz = clt->gz;
+	char		 out[GZ_BUFSIZ];
+	size_t		 n;
+
+	gz->zs.next_in = (Bytef *)gz->in;
+	gz->zs.avail_in = gz->len;
+	do {
+		gz->zs.next_out = (Bytef *)out;
+		gz->zs.avail_out = sizeof(out);
+		if (deflate(&gz->zs, flush) == Z_STREAM_ERROR) {
+			log_warnx("deflate failed");
+			clt->err = 1;
+			return (-1);
+		}
+		n = sizeof(out) - gz->zs.avail_out;
+		if (n > 0 && bufio_compose(&clt->bio, out, n) == -1) {
+			clt->err = 1;
+			return (-1);
+		}
+	} while (gz->zs.avail_out == 0);
+	gz->len = 0;
+	return (0);
+}
+
+static int
+gz_write(struct client *clt, const char *d, size_t len)
+{
+	struct gzstream	*gz = clt->gz;
+	size_t		 n;
+
+	while (len > 0) {
+		if (gz->len == sizeof(gz->in) &&
+		    gz_deflate(clt, Z_NO_FLUSH) == -1)
+			return (-1);
+		n = sizeof(gz->in) - gz->len;
+		if (n > len)
+			n = len;
+		memcpy(gz->in + gz->len, d, n);
+		gz->len += n;
+		d += n;
+		len -= n;
+	}
+	return (0);
+}
+
+static int
+gz_start(struct client *clt)
+{
+	struct gzstream	*gz;
+
+	gz = xcalloc(1, sizeof(*gz));
+	if (deflateInit2(&gz->zs, Z_BEST_SPEED, Z_DEFLATED, GZ_WBITS,
+	    GZ_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+		log_warnx("deflateInit2 failed");
+		free(gz);
+		return (-1);
+	}
+	clt->gz = gz;
+	return (0);
+}
+
+static void
+gz_end(struct client *clt)
+{
+	if (clt->gz == NULL)
+		return;
+	deflateEnd(&clt->gz->zs);
+	free(clt->gz);
+	clt->gz = NULL;
+}
+#endif
+
+void
+http_asset_init(struct asset *a, const char *ctype, const char *data)
+{
+	SHA1_CTX	 ctx;
+	uint8_t		 hash[SHA1_DIGEST_LENGTH];
+	size_t		 i;
+
+	memset(a, 0, sizeof(*a));
+	a->ctype = ctype;
+	a->data = data;
+	a->len = strlen(data);
+
+	SHA1Init(&ctx);
+	SHA1Update(&ctx, (const uint8_t *)data, a->len);
+	SHA1Final(hash, &ctx);
+	for (i = 0; i < (sizeof(a->tag) - 1) / 2; ++i)
+		(void)snprintf(a->tag + i * 2, 3, "%02x", hash[i]);
+	(void)snprintf(a->etag, sizeof(a->etag), "\"%s\"", a->tag);
+
+#if HAVE_LIB_Z
+	a->gzdata = gzip_data(a->data, a->len, &a->gzlen);
+	if (a->gzdata != NULL && a->gzlen >= a->len) {
+		free(a->gzdata);
+		a->gzdata = NULL;
+	}
+#endif
+}
+
 int
 http_init(struct client *clt, int fd)
 {
@@ -58,6 +212,87 @@ http_init(struct client *clt, int fd)
 	return 0;
 }
 
+/* only whether gzip is there and not refused with q=0 */
+static int
+accepts_gzip(const char *line)
+{
+	const char	*q;
+	size_t		 len;
+
+	while (*line != '\0') {
+		line += strspn(line, " \t,");
+		len = strcspn(line, " \t;,");
+
+		if ((len == 4 && !strncasecmp(line, "gzip", 4)) ||
+		    (len == 1 && *line == '*')) {
+			line += len;
+			line += strspn(line, " \t");
+			if (*line != ';')
+				return (1);
+			line++;
+			line += strspn(line, " \t");
+			if (strncasecmp(line, "q=", 2) != 0)
+				return (1);
+			for (q = line + 2; *q == '0' || *q == '.'; ++q)
+				/* nop */ ;
+			return (*q != '\0' && *q != ',' && *q != ' ' &&
+			    *q != '\t');
+		}
+
+		line += strcspn(line, ",");
+	}
+
+	return (0);
+}
+
+/* weak comparison, as required for If-None-Match */
+static int
+etag_match(const char *list, const char *etag)
+{
+	size_t		 len;
+
+	len = strlen(etag);
+	list += strspn(list, " \t");
+	if (!strcmp(list, "*"))
+		return (1);
+
+	while (*list != '\0') {
+		list += strspn(list, " \t,");
+		if (!strncmp(list, "W/", 2))
+			list += 2;
+		if (!strncmp(list, etag, len) &&
+		    (list[len] == '\0' || list[len] == ',' ||
+		    list[len] == ' ' || list[len] == '\t'))
+			return (1);
+		list += strcspn(list, ",");
+	}
+
+	return (0);
+}
+
+/* whether the query contains v=<tag> */
+static int
+versioned(const char *query, const char *tag)
+{
+	size_t		 len;
+
+	if (query == NULL)
+		return (0);
+
+	len = strlen(tag);
+	while (*query != '\0') {
+		if (!strncmp(query, "v=", 2) &&
+		    !strncmp(query + 2, tag, len) &&
+		    (query[len + 2] == '\0' || query[len + 2] == '&'))
+			return (1);
+		query += strcspn(query, "&");
+		if (*query == '&')
+			query++;
+	}
+
+	return (0);
+}
+
 int
 http_parse(struct client *clt)
 {
@@ -103,10 +338,12 @@ http_parse(struct client *clt)
 			if (*http != '\0')
 				*http++ = '\0';
 
-			if ((query = strchr(line, '?')))
-				*query = '\0';
 			if ((frag = strchr(line, '#')))
 				*frag = '\0';
+			if ((query = strchr(line, '?'))) {
+				*query++ = '\0';
+				clt->req.query = xstrdup(query);
+			}
 
 			clt->req.path = xstrdup(line);
 
@@ -169,6 +406,25 @@ http_parse(struct client *clt)
 			req->secret = xstrdup(line);
 		}
 
+		if (!strncasecmp(line, "Sec-WebSocket-Extensions:", 25)) {
+			line += 25;
+			if (ws_deflate_offer(line))
+				req->flags |= R_WSDEFLATE;
+		}
+
+		if (!strncasecmp(line, "If-None-Match:", 14)) {
+			line += 14;
+			line += strspn(line, " \t");
+			free(req->etag);
+			req->etag = xstrdup(line);
+		}
+
+		if (!strncasecmp(line, "Accept-Encoding:", 16)) {
+			line += 16;
+			if (accepts_gzip(line))
+				req->flags |= R_GZIP;
+		}
+
 		buf_drain(rbuf, endln - rbuf->buf + 2);
 	}
 
@@ -239,19 +495,38 @@ http_reply(struct client *clt, int code, const char *reason,
 		clt->chunked = 0;
 	}
 
-	if (code >= 300 && code < 400) {
+	if (code == 304)
+		clt->chunked = 0;
+	else if (code >= 300 && code < 400) {
 		location = ctype;
 		ctype = "text/html;charset=UTF-8";
 	}
 
+	if (code != 200)
+		clt->gzip = GZ_NONE;
+#if !HAVE_LIB_Z
+	if (clt->gzip == GZ_STREAM)
+		clt->gzip = GZ_NONE;
+#endif
+
 	version = "HTTP/1.1";
 	if (clt->req.version == HTTP_1_0)
 		version = "HTTP/1.0";
 
 	if (http_fmt(clt, "%s %d %s\r\n"
 	    "Connection: close\r\n"
-	    "Cache-Control: no-store\r\n",
-	    version, code, reason) == -1)
+	    "Cache-Control: %s\r\n",
+	    version, code, reason,
+	    clt->cache != NULL ? clt->cache : "no-store") == -1)
+		goto err;
+	if (clt->etag != NULL &&
+	    http_fmt(clt, "ETag: %s\r\n", clt->etag) == -1)
+		goto err;
+	if (clt->vary &&
+	    http_writes(clt, "Vary: Accept-Encoding\r\n") == -1)
+		goto err;
+	if (clt->gzip != GZ_NONE &&
+	    http_writes(clt, "Content-Encoding: gzip\r\n") == -1)
 		goto err;
 	if (ctype != NULL &&
 	    http_fmt(clt, "Content-Type: %s\r\n", ctype) == -1)
@@ -267,12 +542,22 @@ http_reply(struct client *clt, int code, const char *reason,
 		    "Connection: Upgrade\r\n"
 		    "Sec-WebSocket-Accept: %s\r\n", b32) == -1)
 			goto err;
+		if ((clt->req.flags & R_WSDEFLATE) &&
+		    http_writes(clt, "Sec-WebSocket-Extensions: "
+		    "permessage-deflate; server_no_context_takeover\r\n") == -1)
+			goto err;
+		clt->wsdeflate = !!(clt->req.flags & R_WSDEFLATE);
 	}
 	if (http_write(clt, "\r\n", 2) == -1)
 		goto err;
 
 	bufio_set_chunked(&clt->bio, clt->chunked);
 
+#if HAVE_LIB_Z
+	if (clt->gzip == GZ_STREAM && gz_start(clt) == -1)
+		goto err;
+#endif
+
 	if (location) {
 		if (http_writes(clt, "<a href='") == -1 ||
 		    http_htmlescape(clt, location) == -1 ||
@@ -289,64 +574,85 @@ http_reply(struct client *clt, int code, const char *reason,
 	return -1;
 }
 
+/*
+ * Reply with the asset, or with a 304 if the client has it already.
+ * Links carrying the right ?v= can be cached forever, everything else
+ * has to be revalidated.
+ */
 int
-http_flush(struct client *clt)
+http_asset(struct client *clt, const struct asset *a)
+{
+	const char	*data = a->data;
+	size_t		 len = a->len;
+
+	clt->etag = a->etag;
+	clt->vary = a->gzdata != NULL;
+	clt->cache = "no-cache";
+	if (versioned(clt->req.query, a->tag))
+		clt->cache = CACHE_FOREVER;
+
+	if (clt->req.etag != NULL && etag_match(clt->req.etag, a->etag))
+		return (http_reply(clt, 304, "Not Modified", NULL));
+
+	if (a->gzdata != NULL && (clt->req.flags & R_GZIP)) {
+		clt->gzip = GZ_STATIC;
+		data = a->gzdata;
+		len = a->gzlen;
+	}
+
+	if (http_reply(clt, 200, "OK", a->ctype) == -1)
+		return (-1);
+	return (http_write_static(clt, data, len));
+}
+
+/*
+ * Compress the body of the next reply if the client supports it.
+ * Meant for the bigger pages, it's a no-op without zlib.
+ */
+void
+http_compress(struct client *clt)
+{
+#if HAVE_LIB_Z
+	clt->vary = 1;
+	if (clt->req.flags & R_GZIP)
+		clt->gzip = GZ_STREAM;
+#endif
+}
+
+int
+http_write(struct client *clt, const char *d, size_t len)
 {
 	if (clt->err)
 		return -1;
 
-	if (clt->len == 0)
-		return 0;
+#if HAVE_LIB_Z
+	if (clt->gz != NULL)
+		return (gz_write(clt, d, len));
+#endif
 
-	if (bufio_compose(&clt->bio, clt->buf, clt->len) == -1) {
+	if (bufio_compose(&clt->bio, d, len) == -1) {
 		clt->err = 1;
 		return -1;
 	}
-
-	clt->len = 0;
-
 	return 0;
 }
 
+/* d is not copied and has to outlive the client, i.e. static assets */
 int
-http_write(struct client *clt, const char *d, size_t len)
+http_write_static(struct client *clt, const char *d, size_t len)
 {
-	size_t		avail;
-
 	if (clt->err)
 		return -1;
 
-	if (!clt->bio.chunked) {
-		if (bufio_compose(&clt->bio, d, len) == -1) {
-			clt->err = 1;
-			return -1;
-		}
-		return 0;
-	}
-
-	if (clt->buf == NULL) {
-		clt->cap = 1024;
-		if ((clt->buf = malloc(clt->cap)) == NULL) {
-			clt->err = 1;
-			return -1;
-		}
-	}
+#if HAVE_LIB_Z
+	if (clt->gz != NULL)
+		return (gz_write(clt, d, len));
+#endif
 
-	while (len > 0) {
-		avail = clt->cap - clt->len;
-		if (avail > len)
-			avail = len;
-
-		memcpy(clt->buf + clt->len, d, avail);
-		clt->len += avail;
-		len -= avail;
-		d += avail;
-		if (clt->len == clt->cap) {
-			if (http_flush(clt) == -1)
-				return -1;
-		}
+	if (bufio_compose_ref(&clt->bio, d, len) == -1) {
+		clt->err = 1;
+		return -1;
 	}
-
 	return 0;
 }
 
@@ -418,7 +724,7 @@ http_htmlescape(struct client *clt, const char *str)
 			r = http_writes(clt, "&gt;");
 			break;
 		case '&':
-			r = http_writes(clt, "&gt;");
+			r = http_writes(clt, "&amp;");
 			break;
 		case '"':
 			r = http_writes(clt, "&quot;");
@@ -443,8 +749,13 @@ http_close(struct client *clt)
 {
 	if (clt->err)
 		return -1;
-	if (clt->len != 0 && http_flush(clt) == -1)
-		return -1;
+#if HAVE_LIB_Z
+	if (clt->gz != NULL) {
+		if (gz_deflate(clt, Z_FINISH) == -1)
+			return -1;
+		gz_end(clt);
+	}
+#endif
 	if (bufio_compose(&clt->bio, NULL, 0) == -1)
 		clt->err = 1;
 	return (clt->err ? -1 : 0);
@@ -453,8 +764,12 @@ http_close(struct client *clt)
 void
 http_free(struct client *clt)
 {
-	free(clt->buf);
+#if HAVE_LIB_Z
+	gz_end(clt);
+#endif
 	free(clt->req.path);
+	free(clt->req.query);
+	free(clt->req.etag);
 	free(clt->req.secret);
 	free(clt->req.ctype);
 	free(clt->req.body);
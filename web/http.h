@@ -38,6 +38,8 @@ struct bufio;
 
 struct request {
 	char	*path;
+	char	*query;
+	char	*etag;		/* If-None-Match */
 	int	 method;
 	int	 version;
 	char	*secret;
@@ -48,36 +50,64 @@ struct request {
 #define R_CONNUPGR  0x01
 #define R_UPGRADEWS 0x02
 #define R_WSVERSION 0x04
+#define R_GZIP      0x08
+#define R_WSDEFLATE 0x10
 	int	 flags;
 };
 
+/*
+ * A static resource served with an ETag derived from its content.
+ * The same tag is the version to put in the ?v= of the links to it,
+ * so that those can be cached forever.
+ */
+struct asset {
+	const char	*ctype;
+	const char	*data;
+	size_t		 len;
+	char		 tag[17];
+	char		 etag[19];	/* quoted tag */
+	char		*gzdata;	/* gzip'd data, if smaller */
+	size_t		 gzlen;
+};
+
 struct client;
+struct gzstream;
 typedef void (*route_fn)(struct client *);
 
 TAILQ_HEAD(clthead, client);
 struct client {
-	char		*buf;
-	size_t		len;
-	size_t		cap;
 	struct bufio	bio;
 	struct request	req;
 	int		err;
 	int		chunked;
 	int		ws;		/* if talking ws:// */
+	int		wsdeflate;	/* permessage-deflate */
 	int		reqdone;	/* done parsing the request */
 	int		done;		/* done handling the client */
 	route_fn	route;
 
+#define GZ_NONE		0
+#define GZ_STATIC	1		/* the body is already gzip'd */
+#define GZ_STREAM	2		/* compress while writing */
+	int		gzip;
+	int		vary;		/* depends on Accept-Encoding */
+	const char	*etag;
+	const char	*cache;		/* Cache-Control */
+	struct gzstream	*gz;
+
 	TAILQ_ENTRY(client) clients;
 };
 
+void	http_asset_init(struct asset *, const char *, const char *);
 int	http_init(struct client *, int);
 int	http_parse(struct client *);
 int	http_read(struct client *);
 void	http_postdata(struct client *, char **, size_t *);
 int	http_reply(struct client *, int, const char *, const char *);
-int	http_flush(struct client *);
+int	http_asset(struct client *, const struct asset *);
+void	http_compress(struct client *);
 int	http_write(struct client *, const char *, size_t);
+int	http_write_static(struct client *, const char *, size_t);
 int	http_writes(struct client *, const char *);
 int	http_fmt(struct client *, const char *, ...);
 int	http_urlescape(struct client *, const char *);
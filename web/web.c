@@ -48,6 +48,9 @@
 #define nitems(x) (sizeof(x)/sizeof(x[0]))
 #endif
 
+#define STR(x)		#x
+#define XSTR(x)		STR(x)
+
 #define FORM_URLENCODED		"application/x-www-form-urlencoded"
 
 #define ICON_REPEAT_ALL		"🔁"
@@ -59,20 +62,67 @@
 #define ICON_TOGGLE		"⏯"
 #define ICON_PLAY		"⏵"
 
+/* collapse bursts of events, i.e. seeks, sent to the browsers */
+#define MONITOR_COALESCE	200
+
 static struct clthead		 clients;
 static struct imsgbuf		 imsgbuf;
 static struct playlist		 playlist_tmp;
 static struct player_status	 player_status;
 static uint64_t			 position, duration;
 
+/*
+ * Our copy of the playlist is kept up to date with the deltas in
+ * the monitor events; it's fetched again only when they can't be
+ * applied.  The imsg id of IMSG_CTL_LIST tells what the reply is.
+ */
+#define LIST_FULL	0
+#define LIST_APPEND	1
+static uint64_t			 playlist_seen;	/* generation */
+static int			 resyncing = 1;
+static int			 appending;
+
+/*
+ * The pages only carry a window of the playlist around the current
+ * song, the rest is fetched as the user scrolls.  The HTML of the
+ * entries is rendered once and kept until our copy of the playlist
+ * changes; the current one is marked while sending them.
+ */
+#define PLAYLIST_BEFORE	50	/* entries shown before current */
+#define PLAYLIST_PAGE	200
+#define PLAYLIST_MAXPAGE 1000
+
+/*
+ * The searchbox asks us: our copy of the playlist carries a trigram
+ * index, built as the songs arrive and kept up to date with it.
+ */
+#define SEARCH_MAX	100
+#define SEARCH_MAXLEN	256
+
+static struct {
+	char		*html;
+	size_t		 len;
+	size_t		 cap;
+	size_t		*offs;		/* of each entry, plus the end */
+	size_t		 n;
+	size_t		 offscap;
+	int		 valid;
+} plcache;
+
+static struct buffer	events;
+
 static void client_ev(int, int, void *);
 
-const char *head = "<!doctype html>"
+static struct asset	css_asset, js_asset;
+static char		*head, *foot;
+
+/* the %s are the versions of the assets */
+const char *headfmt = "<!doctype html>"
 	"<html>"
 	"<head>"
 	"<meta name='viewport' content='width=device-width, initial-scale=1'/>"
 	"<title>Amused Web</title>"
-	"<link rel='stylesheet' href='/style.css?v=0'>"
+	"<link rel='stylesheet' href='/style.css?v=%s'>"
 	"</style>"
 	"</head>"
 	"<body>";
@@ -161,10 +211,42 @@ const char *js =
 	"var ws;"
 	"let pos=0, dur=0;"
 	"const playlist=document.querySelector('.playlist');"
+	"let first=+playlist.dataset.first, total=+playlist.dataset.total;"
+	"let curi=+playlist.dataset.current, busy=0, gen=0, q='';"
+	"function page(f, n, fn){"
+	" const g=++gen; busy=1;"
+	" fetch('/playlist/'+f+'/'+n)"
+	"  .then(r => r.text())"
+	"  .then(h => {busy=0; if (g==gen) {fn(h)}})"
+	"  .catch(x => {busy=0; console.log('failed to load:', x)});"
+	"};"
+	"function around(){"
+	" const f=Math.max(0, curi-"XSTR(PLAYLIST_BEFORE)");"
+	" page(f, "XSTR(PLAYLIST_PAGE)", h => {"
+	"  first=f; playlist.innerHTML=h; cur();"
+	" });"
+	"};"
+	"function more(){"
+	" if (busy || q) return;"
+	" const r=playlist.getBoundingClientRect(), n=playlist.children.length;"
+	" if (r.bottom < 2*innerHeight && first+n < total) {"
+	"  page(first+n, "XSTR(PLAYLIST_PAGE)","
+	"   h => playlist.insertAdjacentHTML('beforeend', h));"
+	" } else if (r.top > -innerHeight && first > 0) {"
+	"  const f=Math.max(0, first-"XSTR(PLAYLIST_PAGE)");"
+	"  page(f, first-f, h => {"
+	"   const y=document.documentElement.scrollHeight;"
+	"   playlist.insertAdjacentHTML('afterbegin', h); first=f;"
+	"   window.scrollBy(0, document.documentElement.scrollHeight-y);"
+	"  });"
+	" }"
+	"};"
+	"window.addEventListener('scroll', more);"
 	"function cur(e) {"
 	" if (e) {e.preventDefault()}"
 	" let cur = document.querySelector('#current');"
 	" if (cur) {cur.scrollIntoView(); window.scrollBy(0, -100);}"
+	" else if (e && curi >= 0) {around()}"
 	"};"
 	"function b(x){return x=='on'};"
 	"function c(p, c){"
@@ -177,7 +259,8 @@ const char *js =
 	" playlist.appendChild(l);"
 	"}"
 	"function d(t){"
-	" const [, type, payload] = t.split(/^(.):(.*)$/);"
+	" const [, type, p] = t.split(/^(.):(.*)$/s);"
+	" const payload = p.replace(/\\\\(.)/g, (m, e) => e=='n' ? '\\n' : e);"
 	" if (type=='s'){"
 	"  let s=payload.split(' ');"
 	"  pos=s[0], dur=s[1];"
@@ -199,13 +282,33 @@ const char *js =
 	" } else if (type=='c') {"
 	/* consume */
 	" } else if (type=='x') {"
-	"  playlist.innerHTML='';"
-	" } else if (type=='X') {"
-	"  dofilt();" /* done with the list */
-	" } else if (type=='A') {"
-	"  c(payload, true);"
-	" } else if (type=='a') {"
-	"  c(payload, false);"
+	"  gen++; first=0; total=0;"
+	"  if (q) {rs()} else {playlist.innerHTML=''}"
+	" } else if (type=='X') {" /* done with the list */
+	"  if (q) {rs()}"
+	" } else if (type=='L') {" /* replaced */
+	"  const s=payload.split(' ');"
+	"  gen++; total=+s[0]; curi=+s[1];"
+	"  if (q) {rs()} else {around()}"
+	" } else if (type=='i') {"
+	"  curi=parseInt(payload);"
+	"  const o=document.querySelector('#current');"
+	"  if (o) {o.removeAttribute('id')};"
+	"  const n=q ? playlist.querySelector('[data-off=\"'+curi+'\"]')"
+	"   : playlist.children[curi-first];"
+	"  if (n) {n.id='current'};"
+	" } else if (type=='d') {"
+	"  const i=parseInt(payload);"
+	"  total--;"
+	"  if (q) {rs()}"
+	"  else if (i < first) {first--}"
+	"  else {const n=playlist.children[i-first]; if (n) {n.remove()}}"
+	" } else if (type=='A' || type=='a') {"
+	"  total++;"
+	"  const n=playlist.children.length;"
+	"  if (q) {rs()}"
+	"  else if (first+n == total-1 && n < "XSTR(PLAYLIST_MAXPAGE)")"
+	"   c(payload, type=='A');"
 	" } else if (type=='C') {"
 	"  const t=document.querySelector('.controls>p>a');"
 	"  t.innerText = payload.replace(/.*\\//, '');"
@@ -222,7 +325,8 @@ const char *js =
 	"  alert('Websocket closed.  The interface won\\'t update itself.'"
 	"   + ' Please refresh the page');"
 	" });"
-	" ws.addEventListener('message', e => d(e.data))"
+	" ws.addEventListener('message',"
+	"  e => e.data.split('\\n').forEach(d));"
 	"};"
 	"w();"
 	"cur();"
@@ -245,18 +349,25 @@ const char *js =
 	"sb.className = 'searchbox';"
 	"const filter = document.createElement('input');"
 	"filter.type = 'search';"
-	"filter.setAttribute('aria-label', 'Filter Playlist');"
-	"filter.placeholder = 'Filter Playlist';"
+	"filter.setAttribute('aria-label', 'Search Playlist');"
+	"filter.placeholder = 'Search Playlist';"
 	"sb.append(filter);"
 	"document.querySelector('main').prepend(sb);"
+	/* the matches replace the window of the playlist until cleared */
 	"function dofilt() {"
-	" let t = filter.value.toLowerCase();"
-	" document.querySelectorAll('.playlist li').forEach(e => {"
-	"  if (e.querySelector('button').value.toLowerCase().indexOf(t) == -1)"
-	"    e.setAttribute('hidden', 'true');"
-	"  else"
-	"    e.removeAttribute('hidden');"
-	" });"
+	" const t = filter.value.trim();"
+	" if (t == q) return;"
+	" q = t;"
+	" if (q == '') {around(); return}"
+	" const g=++gen; busy=1;"
+	" fetch('/search?n="XSTR(SEARCH_MAX)"&q='+encodeURIComponent(q))"
+	"  .then(r => r.text())"
+	"  .then(h => {busy=0; if (g==gen) {playlist.innerHTML=h}})"
+	"  .catch(x => {busy=0; console.log('failed to search:', x)});"
+	"};"
+	"function research() {"
+	" if (!q) return;"
+	" q=''; dofilt();"
 	"};"
 	"function dbc(fn, wait) {"
 	" let tout;"
@@ -267,10 +378,11 @@ const char *js =
 	"  tout = setTimeout(later, wait);"
 	" };"
 	"};"
+	"const rs = dbc(research, 400);"
 	"filter.addEventListener('input', dbc(dofilt, 400));"
 	;
 
-const char *foot = "<script src='/app.js?v=0'></script></body></html>";
+const char *footfmt = "<script src='/app.js?v=%s'></script></body></html>";
 
 static int
 dial(const char *sock)
@@ -340,25 +452,74 @@ url_decode(char *url)
 	return (0);
 }
 
+/*
+ * The events are batched, one per line, and sent as a single frame
+ * by dispatch_flush once done with the messages from amused.  Paths
+ * may contain newlines, so those and the backslashes are escaped.
+ */
 static int
 dispatch_event(const char *msg)
 {
-	struct client	*clt;
 	size_t		 len;
-	int		 ret = 0;
+	const char	*esc;
+
+	if (events.len > 0 && buf_write(&events, "\n", 1) == -1)
+		goto err;
+
+	for (;;) {
+		len = strcspn(msg, "\\\n");
+		if (buf_write(&events, msg, len) == -1)
+			goto err;
+		msg += len;
+		if (*msg == '\0')
+			break;
+		esc = *msg == '\n' ? "\\n" : "\\\\";
+		if (buf_write(&events, esc, 2) == -1)
+			goto err;
+		msg++;
+	}
+	return (0);
+
+ err:
+	log_warn("buf_write");
+	return (-1);
+}
+
+/* encode the frame once and queue it on every client */
+static void
+dispatch_flush(void)
+{
+	struct client		*clt;
+	struct bufshared	*frame[2] = { NULL, NULL };
+	int			 idle, z;
+
+	if (events.len == 0)
+		return;
 
-	len = strlen(msg);
 	TAILQ_FOREACH(clt, &clients, clients) {
 		if (!clt->ws || clt->done || clt->err)
 			continue;
 
-		if (ws_compose(clt, WST_TEXT, msg, len) == -1)
-			ret = -1;
+		z = clt->wsdeflate;
+		if (frame[z] == NULL &&
+		    (frame[z] = ws_frame(WST_TEXT, events.buf, events.len,
+		    z)) == NULL) {
+			log_warn("ws_frame");
+			break;
+		}
 
-		ev_add(clt->bio.fd, POLLIN|POLLOUT, client_ev, clt);
+		idle = clt->bio.whead == NULL;
+		if (bufio_compose_shared(&clt->bio, frame[z]) == -1) {
+			clt->err = 1;
+			continue;
+		}
+		if (idle)
+			ev_add(clt->bio.fd, POLLIN|POLLOUT, client_ev, clt);
 	}
 
-	return (ret);
+	bufshared_unref(frame[0]);
+	bufshared_unref(frame[1]);
+	events.len = 0;
 }
 
 static int
@@ -417,30 +578,260 @@ dispatch_event_status(void)
 }
 
 static int
-dispatch_event_track(struct player_status *ps)
+dispatch_event_track(const char *path, int playing)
 {
 	char		 p[PATH_MAX + 2];
 	int		 r;
 
-	r = snprintf(p, sizeof(p), "%c:%s",
-	    ps->status == STATE_PLAYING ? 'A' : 'a', ps->path);
+	r = snprintf(p, sizeof(p), "%c:%s", playing ? 'A' : 'a', path);
 	if (r < 0 || (size_t)r >= sizeof(p))
 		return (-1);
 
 	return dispatch_event(p);
 }
 
+static void
+plcache_drop(void)
+{
+	plcache.len = 0;
+	plcache.n = 0;
+	plcache.valid = 0;
+}
+
+static void
+plcache_put(const char *str, size_t len)
+{
+	size_t	 cap;
+
+	if (plcache.len + len > plcache.cap) {
+		cap = plcache.cap ? plcache.cap : 4096;
+		while (cap < plcache.len + len)
+			cap *= 2;
+		plcache.html = xreallocarray(plcache.html, cap, 1);
+		plcache.cap = cap;
+	}
+	memcpy(plcache.html + plcache.len, str, len);
+	plcache.len += len;
+}
+
+static void
+plcache_puts(const char *str)
+{
+	plcache_put(str, strlen(str));
+}
+
+static void
+plcache_escape(const char *str)
+{
+	const char	*s;
+
+	for (s = str; *str != '\0'; ++str) {
+		switch (*str) {
+		case '<':
+			plcache_put(s, str - s);
+			plcache_puts("&lt;");
+			break;
+		case '>':
+			plcache_put(s, str - s);
+			plcache_puts("&gt;");
+			break;
+		case '&':
+			plcache_put(s, str - s);
+			plcache_puts("&amp;");
+			break;
+		case '"':
+			plcache_put(s, str - s);
+			plcache_puts("&quot;");
+			break;
+		case '\'':
+			plcache_put(s, str - s);
+			plcache_puts("&apos;");
+			break;
+		default:
+			continue;
+		}
+		s = str + 1;
+	}
+	plcache_put(s, str - s);
+}
+
+/* the entries always start with "<li>" */
+static void
+plcache_push(const char *path)
+{
+	if (plcache.n + 1 >= plcache.offscap) {
+		plcache.offscap = plcache.offscap ? plcache.offscap * 2 : 64;
+		plcache.offs = xreallocarray(plcache.offs, plcache.offscap,
+		    sizeof(*plcache.offs));
+	}
+
+	plcache.offs[plcache.n++] = plcache.len;
+	plcache_puts("<li><button type=submit name=jump value=\"");
+	plcache_escape(path);
+	plcache_puts("\">");
+	plcache_escape(path);
+	plcache_puts("</button></li>");
+	plcache.offs[plcache.n] = plcache.len;
+}
+
+static void
+plcache_update(void)
+{
+	size_t	 i;
+
+	if (plcache.valid)
+		return;
+
+	plcache_drop();
+	for (i = 0; i < playlist.len; ++i)
+		plcache_push(playlist_song(&playlist, i));
+	plcache.valid = 1;
+}
+
+/* next path in a IMSG_CTL_LIST reply, NULL at the end */
+static const char *
+list_next(struct ibuf *ibuf)
+{
+	const char	*path;
+	uint16_t	 len;
+
+	if (ibuf_size(ibuf) == 0)
+		return NULL;
+
+	if (ibuf_get_h16(ibuf, &len) == -1 || len == 0 ||
+	    ibuf_size(ibuf) < len)
+		fatalx("corrupted IMSG_CTL_LIST");
+	path = ibuf_data(ibuf);
+	if (path[len - 1] != '\0' || ibuf_skip(ibuf, len) == -1)
+		fatalx("corrupted IMSG_CTL_LIST");
+	return path;
+}
+
+static void
+list_append(struct player_list *pl, struct ibuf *ibuf)
+{
+	const char	*path;
+	uint64_t	 i;
+
+	if (ibuf_size(ibuf) == 0) {
+		appending = 0;
+		dispatch_event("X:");
+		return;
+	}
+
+	for (i = pl->first; (path = list_next(ibuf)) != NULL; ++i) {
+		dispatch_event_track(path, (int64_t)i == play_off);
+		playlist_push(&playlist, path);
+		if (plcache.valid)
+			plcache_push(path);
+	}
+	playlist_index(&playlist);
+}
+
+static void
+playlist_resync(void)
+{
+	if (resyncing)
+		return;
+	resyncing = 1;
+	appending = 0;
+	imsg_compose(&imsgbuf, IMSG_CTL_LIST, LIST_FULL, 0, -1, NULL, 0);
+}
+
+static void
+dispatch_event_off(int type, int64_t off)
+{
+	char	 buf[32];
+	int	 r;
+
+	r = snprintf(buf, sizeof(buf), "%c:%lld", type, (long long)off);
+	if (r < 0 || (size_t)r >= sizeof(buf)) {
+		log_warn("snprintf");
+		return;
+	}
+	dispatch_event(buf);
+}
+
+/* tell the browsers to load again their window of the playlist */
+static void
+dispatch_event_list(void)
+{
+	char	 buf[64];
+	int	 r;
+
+	r = snprintf(buf, sizeof(buf), "L:%zu %lld", playlist.len,
+	    (long long)play_off);
+	if (r < 0 || (size_t)r >= sizeof(buf)) {
+		log_warn("snprintf");
+		return;
+	}
+	dispatch_event(buf);
+}
+
+/* apply the playlist changes carried by a monitor event */
+static void
+playlist_update(struct player_event *ev)
+{
+	struct player_range range;
+
+	if (resyncing || ev->gen < playlist_seen)
+		return;
+
+	if (ev->gen > playlist_seen) {
+		if (ev->base != playlist_seen || appending) {
+			playlist_resync();
+			return;
+		}
+
+		switch (ev->change) {
+		case PLAYLIST_APPEND:
+			if (ev->first != playlist.len) {
+				playlist_resync();
+				return;
+			}
+			range.offset = ev->first;
+			range.count = ev->count;
+			imsg_compose(&imsgbuf, IMSG_CTL_LIST, LIST_APPEND, 0,
+			    -1, &range, sizeof(range));
+			appending = 1;
+			break;
+		case PLAYLIST_REMOVE:
+			if (ev->first >= playlist.len) {
+				playlist_resync();
+				return;
+			}
+			playlist_remove(&playlist, ev->first);
+			plcache_drop();
+			dispatch_event_off('d', ev->first);
+			break;
+		case PLAYLIST_TRUNCATE:
+			playlist_truncate();
+			plcache_drop();
+			dispatch_event("x:");
+			dispatch_event("X:");
+			break;
+		default:
+			playlist_resync();
+			return;
+		}
+		playlist_seen = ev->gen;
+	}
+
+	if (ev->current != play_off) {
+		play_off = ev->current;
+		dispatch_event_off('i', play_off);
+	}
+}
+
 static void
 imsg_dispatch(int fd, int ev, void *d)
 {
-	static ssize_t		 off;
-	static int		 off_found;
 	char			 seekmsg[128];
 	struct imsg		 imsg;
 	struct ibuf		 ibuf;
-	struct player_status	 ps;
+	struct player_list	 pl;
 	struct player_event	 event;
-	const char		*msg;
+	const char		*msg, *path;
 	ssize_t			 n;
 	size_t			 datalen;
 	int			 r;
@@ -478,13 +869,14 @@ imsg_dispatch(int fd, int ev, void *d)
 
 		case IMSG_CTL_ADD:
 			playlist_free(&playlist_tmp);
-			imsg_compose(&imsgbuf, IMSG_CTL_SHOW, 0, 0, -1,
-			    NULL, 0);
+			resyncing = 0;
+			playlist_resync();
 			break;
 
 		case IMSG_CTL_MONITOR:
 			if (imsg_get_data(&imsg, &event, sizeof(event)) == -1)
 				fatalx("corrupted IMSG_CTL_MONITOR");
+			playlist_update(&event);
 			switch (event.event) {
 			case IMSG_CTL_PLAY:
 			case IMSG_CTL_PAUSE:
@@ -498,8 +890,6 @@ imsg_dispatch(int fd, int ev, void *d)
 			case IMSG_CTL_PREV:
 			case IMSG_CTL_JUMP:
 			case IMSG_CTL_COMMIT:
-				imsg_compose(&imsgbuf, IMSG_CTL_SHOW, 0, 0, -1,
-				    NULL, 0);
 				imsg_compose(&imsgbuf, IMSG_CTL_STATUS, 0, 0,
 				    -1, NULL, 0);
 				break;
@@ -523,32 +913,29 @@ imsg_dispatch(int fd, int ev, void *d)
 			}
 			break;
 
-		case IMSG_CTL_SHOW:
-			if (imsg_get_len(&imsg) == 0) {
-				if (playlist_tmp.len == 0) {
-					dispatch_event("x:");
-					off = -1;
-				} else if (playlist_tmp.len == off)
-					off = -1;
-				dispatch_event("X:");
-				playlist_swap(&playlist_tmp, off);
+		case IMSG_CTL_LIST:
+			if (imsg_get_ibuf(&imsg, &ibuf) == -1 ||
+			    ibuf_get(&ibuf, &pl, sizeof(pl)) == -1)
+				fatalx("corrupted IMSG_CTL_LIST");
+			if (imsg_get_id(&imsg) == LIST_APPEND) {
+				if (appending)
+					list_append(&pl, &ibuf);
+				break;
+			}
+			if (ibuf_size(&ibuf) == 0) {
+				resyncing = 0;
+				playlist_seen = pl.gen;
+				if (pl.current >= (int64_t)playlist_tmp.len)
+					pl.current = -1;
+				playlist_swap(&playlist_tmp, pl.current);
 				memset(&playlist_tmp, 0, sizeof(playlist_tmp));
-				off = 0;
-				off_found = 0;
+				plcache_drop();
+				dispatch_event_list();
 				break;
 			}
-			if (imsg_get_data(&imsg, &ps, sizeof(ps)) == -1)
-				fatalx("corrupted IMSG_CTL_SHOW");
-			if (ps.path[sizeof(ps.path) - 1] != '\0')
-				fatalx("corrupted IMSG_CTL_SHOW");
-			if (playlist_tmp.len == 0)
-				dispatch_event("x:");
-			dispatch_event_track(&ps);
-			playlist_push(&playlist_tmp, ps.path);
-			if (ps.status == STATE_PLAYING)
-				off_found = 1;
-			if (!off_found)
-				off++;
+			while ((path = list_next(&ibuf)) != NULL)
+				playlist_push(&playlist_tmp, path);
+			playlist_index(&playlist_tmp);
 			break;
 
 		case IMSG_CTL_STATUS:
@@ -563,6 +950,8 @@ imsg_dispatch(int fd, int ev, void *d)
 		}
 	}
 
+	dispatch_flush();
+
 	ev = POLLIN;
 	if (imsgbuf.w.queued)
 		ev |= POLLOUT;
@@ -578,30 +967,49 @@ route_notfound(struct client *clt)
 }
 
 static void
-render_playlist(struct client *clt)
+render_entries(struct client *clt, size_t first, size_t count)
 {
-	ssize_t			 i;
-	const char		*path;
-	int			 current;
+	const char	*html;
+	size_t		 last, cur;
 
-	http_writes(clt, "<section class='playlist-wrapper'>");
-	http_writes(clt, "<form action=jump method=post"
-	    " enctype='"FORM_URLENCODED"'>");
-	http_writes(clt, "<ul class=playlist>");
+	plcache_update();
 
-	for (i = 0; i < playlist.len; ++i) {
-		current = play_off == i;
+	if (first >= plcache.n)
+		return;
+	if (count > plcache.n - first)
+		count = plcache.n - first;
+	last = first + count;
+	html = plcache.html;
+
+	if (play_off < 0 || (size_t)play_off < first ||
+	    (size_t)play_off >= last) {
+		http_write(clt, html + plcache.offs[first],
+		    plcache.offs[last] - plcache.offs[first]);
+		return;
+	}
 
-		path = playlist.songs[i];
+	cur = play_off;
+	http_write(clt, html + plcache.offs[first],
+	    plcache.offs[cur] - plcache.offs[first]);
+	http_writes(clt, "<li id=current>");
+	http_write(clt, html + plcache.offs[cur] + 4,
+	    plcache.offs[last] - plcache.offs[cur] - 4);
+}
 
-		http_fmt(clt, "<li%s>", current ? " id=current" : "");
-		http_writes(clt, "<button type=submit name=jump value=\"");
-		http_htmlescape(clt, path);
-		http_writes(clt, "\">");
-		http_htmlescape(clt, path);
-		http_writes(clt, "</button></li>");
-	}
+static void
+render_playlist(struct client *clt)
+{
+	size_t			 first = 0;
 
+	if (play_off > PLAYLIST_BEFORE)
+		first = play_off - PLAYLIST_BEFORE;
+
+	http_writes(clt, "<section class='playlist-wrapper'>");
+	http_writes(clt, "<form action=jump method=post"
+	    " enctype='"FORM_URLENCODED"'>");
+	http_fmt(clt, "<ul class=playlist data-first=%zu data-total=%zu"
+	    " data-current=%lld>", first, playlist.len, (long long)play_off);
+	render_entries(clt, first, PLAYLIST_PAGE);
 	http_writes(clt, "</ul>");
 	http_writes(clt, "</form>");
 	http_writes(clt, "</section>");
@@ -650,10 +1058,11 @@ render_controls(struct client *clt)
 static void
 route_home(struct client *clt)
 {
+	http_compress(clt);
 	if (http_reply(clt, 200, "OK", "text/html;charset=UTF-8") == -1)
 		return;
 
-	if (http_write(clt, head, strlen(head)) == -1)
+	if (http_write_static(clt, head, strlen(head)) == -1)
 		return;
 
 	if (http_writes(clt, "<main>") == -1)
@@ -665,7 +1074,85 @@ route_home(struct client *clt)
 	if (http_writes(clt, "</main>") == -1)
 		return;
 
-	http_write(clt, foot, strlen(foot));
+	http_write_static(clt, foot, strlen(foot));
+}
+
+static void
+route_playlist(struct client *clt)
+{
+	char		 buf[64], *count;
+	const char	*errstr;
+	size_t		 first, n;
+
+	if (strlcpy(buf, clt->req.path + 10, sizeof(buf)) >= sizeof(buf) ||
+	    (count = strchr(buf, '/')) == NULL) {
+		route_notfound(clt);
+		return;
+	}
+	*count++ = '\0';
+
+	first = strtonum(buf, 0, LLONG_MAX, &errstr);
+	if (errstr == NULL)
+		n = strtonum(count, 1, PLAYLIST_MAXPAGE, &errstr);
+	if (errstr != NULL) {
+		route_notfound(clt);
+		return;
+	}
+
+	http_compress(clt);
+	if (http_reply(clt, 200, "OK", "text/html;charset=UTF-8") == -1)
+		return;
+	render_entries(clt, first, n);
+}
+
+static void
+route_search(struct client *clt)
+{
+	char		 q[SEARCH_MAXLEN];
+	char		*query, *field;
+	const char	*path, *errstr;
+	size_t		 offs[SEARCH_MAX], i, n, max = SEARCH_MAX;
+
+	q[0] = '\0';
+	query = clt->req.query;
+	while (query != NULL && (field = strsep(&query, "&")) != NULL) {
+		if (url_decode(field) == -1)
+			goto badreq;
+
+		if (!strncmp(field, "q=", 2)) {
+			if (strlcpy(q, field + 2, sizeof(q)) >= sizeof(q))
+				goto badreq;
+		} else if (!strncmp(field, "n=", 2)) {
+			max = strtonum(field + 2, 1, SEARCH_MAX, &errstr);
+			if (errstr != NULL)
+				goto badreq;
+		}
+	}
+
+	n = playlist_match(&playlist, q, offs, max);
+
+	http_compress(clt);
+	if (http_reply(clt, 200, "OK", "text/html;charset=UTF-8") == -1)
+		return;
+
+	for (i = 0; i < n; ++i) {
+		path = playlist_song(&playlist, offs[i]);
+		if (http_fmt(clt, "<li%s data-off=%zu>",
+		    (ssize_t)offs[i] == play_off ? " id=current" : "",
+		    offs[i]) == -1 ||
+		    http_writes(clt, "<button type=submit name=jump value=\"")
+		    == -1 ||
+		    http_htmlescape(clt, path) == -1 ||
+		    http_writes(clt, "\">") == -1 ||
+		    http_htmlescape(clt, path) == -1 ||
+		    http_writes(clt, "</button></li>") == -1)
+			return;
+	}
+	return;
+
+ badreq:
+	http_reply(clt, 400, "Bad Request", "text/plain");
+	http_writes(clt, "Bad Request.\n");
 }
 
 static void
@@ -855,14 +1342,12 @@ static void
 route_assets(struct client *clt)
 {
 	if (!strcmp(clt->req.path, "/style.css")) {
-		http_reply(clt, 200, "OK", "text/css");
-		http_write(clt, css, strlen(css));
+		http_asset(clt, &css_asset);
 		return;
 	}
 
 	if (!strcmp(clt->req.path, "/app.js")) {
-		http_reply(clt, 200, "OK", "application/javascript");
-		http_write(clt, js, strlen(js));
+		http_asset(clt, &js_asset);
 		return;
 	}
 
@@ -887,6 +1372,9 @@ route_dispatch(struct client *clt)
 		{ METHOD_POST,	"/a/ctrls",	&route_controls },
 		{ METHOD_POST,	"/a/mode",	&route_mode },
 
+		{ METHOD_GET,	"/playlist/*",	&route_playlist },
+		{ METHOD_GET,	"/search",	&route_search },
+
 		{ METHOD_GET,	"/ws",		&route_init_ws },
 
 		{ METHOD_GET,	"/style.css",	&route_assets },
@@ -1009,6 +1497,7 @@ int
 main(int argc, char **argv)
 {
 	struct addrinfo	 hints, *res, *res0;
+	struct player_monitor mon;
 	const char	*cause = NULL;
 	const char	*host = NULL;
 	const char	*port = "9090";
@@ -1062,14 +1551,23 @@ main(int argc, char **argv)
 
 	signal(SIGPIPE, SIG_IGN);
 
+	http_asset_init(&css_asset, "text/css", css);
+	http_asset_init(&js_asset, "application/javascript", js);
+	xasprintf(&head, headfmt, css_asset.tag);
+	xasprintf(&foot, footfmt, js_asset.tag);
+	if (buf_init(&events) == -1)
+		fatal("buf_init");
+
 	if (ev_init() == -1)
 		fatal("ev_init");
 
 	amused_sock = dial(sock);
 	imsg_init(&imsgbuf, amused_sock);
-	imsg_compose(&imsgbuf, IMSG_CTL_SHOW, 0, 0, -1, NULL, 0);
+	imsg_compose(&imsgbuf, IMSG_CTL_LIST, 0, 0, -1, NULL, 0);
 	imsg_compose(&imsgbuf, IMSG_CTL_STATUS, 0, 0, -1, NULL, 0);
-	imsg_compose(&imsgbuf, IMSG_CTL_MONITOR, 0, 0, -1, NULL, 0);
+	memset(&mon, 0, sizeof(mon));
+	mon.coalesce = MONITOR_COALESCE;
+	imsg_compose(&imsgbuf, IMSG_CTL_MONITOR, 0, 0, -1, &mon, sizeof(mon));
 	ev_add(amused_sock, POLLIN|POLLOUT, imsg_dispatch, NULL);
 
 	memset(&hints, 0, sizeof(hints));
@@ -26,18 +26,34 @@
 #include "config.h"
 
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sha1.h>
 
+#if HAVE_LIB_Z
+#include <zlib.h>
+#endif
+
 #include "bufio.h"
 #include "http.h"
+#include "log.h"
 #include "ws.h"
 
 #define WS_GUID	"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
+/* the clients have no reason to send us anything big */
+#define WS_MAX_READ	65536
+
+/* smaller messages are not worth compressing */
+#define WS_DEFLATE_MIN	256
+
+#define WS_RSV1		0x40
+
 static int
 tob64(unsigned char ch)
 {
@@ -126,13 +142,160 @@ ws_accept_hdr(const char *secret, char *out, size_t olen)
 	return (b64encode(hash, sizeof(hash), out, olen));
 }
 
+/*
+ * Whether the Sec-WebSocket-Extensions header has a permessage-deflate
+ * offer we can accept.  We always compress with a full window and no
+ * context takeover, and don't care what the client uses since it
+ * doesn't send messages.
+ */
+int
+ws_deflate_offer(const char *line)
+{
+#if HAVE_LIB_Z
+	size_t		 len;
+	int		 ok;
+
+	while (*line != '\0') {
+		line += strspn(line, " \t,");
+		len = strcspn(line, " \t;,");
+		ok = len == 18 && !strncasecmp(line, "permessage-deflate", 18);
+		line += len;
+
+		/* the parameters */
+		while (*line != '\0' && *line != ',') {
+			line += strspn(line, " \t;");
+			len = strcspn(line, " \t;,");
+			if (len >= 22 &&
+			    !strncasecmp(line, "server_max_window_bits", 22) &&
+			    strncmp(line + 22, "=15", len - 22) != 0)
+				ok = 0;
+			line += len;
+			line += strspn(line, " \t");
+		}
+
+		if (ok)
+			return (1);
+	}
+#endif
+
+	return (0);
+}
+
+static size_t
+ws_hdr(uint8_t *hdr, int type, int rsv1, size_t len)
+{
+	uint64_t	 extlen;
+	uint16_t	 shortlen;
+	size_t		 n = 2;
+
+	hdr[0] = (type & 0x0F) | 0x80;
+	if (rsv1)
+		hdr[0] |= WS_RSV1;
+
+	if (len < 126)
+		hdr[1] = len;
+	else if (len <= 0xFFFF) {
+		hdr[1] = 126;
+		shortlen = htons(len);
+		memcpy(hdr + n, &shortlen, sizeof(shortlen));
+		n += sizeof(shortlen);
+	} else {
+		hdr[1] = 127;
+		extlen = htobe64(len);
+		memcpy(hdr + n, &extlen, sizeof(extlen));
+		n += sizeof(extlen);
+	}
+
+	return (n);
+}
+
+#if HAVE_LIB_Z
+/*
+ * Compress a message for permessage-deflate.  The stream is reset
+ * every time, as promised with server_no_context_takeover, so the
+ * result can be sent to any client.
+ */
+static uint8_t *
+ws_deflate(const void *data, size_t len, size_t *outlen)
+{
+	static z_stream	 zs;
+	static int	 init;
+	uint8_t		*out;
+	size_t		 cap;
+
+	if (!init) {
+		if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		    -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			log_warnx("deflateInit2 failed");
+			return (NULL);
+		}
+		init = 1;
+	} else if (deflateReset(&zs) != Z_OK)
+		return (NULL);
+
+	cap = deflateBound(&zs, len) + 6;
+	if ((out = malloc(cap)) == NULL)
+		return (NULL);
+
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = len;
+	zs.next_out = out;
+	zs.avail_out = cap;
+	if (deflate(&zs, Z_SYNC_FLUSH) != Z_OK || zs.avail_in != 0) {
+		free(out);
+		return (NULL);
+	}
+
+	/* drop the 00 00 ff ff trailer of the sync flush */
+	*outlen = cap - zs.avail_out - 4;
+	return (out);
+}
+#endif
+
+/*
+ * Encode a whole frame once, so that it can be queued on any number
+ * of clients with bufio_compose_shared.  With compress, the payload
+ * is sent deflated when that makes it smaller.
+ */
+struct bufshared *
+ws_frame(int type, const void *data, size_t len, int compress)
+{
+	struct bufshared	*sh;
+	uint8_t			 hdr[10], *z = NULL;
+	size_t			 n, zlen;
+
+#if HAVE_LIB_Z
+	if (compress && len >= WS_DEFLATE_MIN &&
+	    (z = ws_deflate(data, len, &zlen)) != NULL && zlen >= len) {
+		free(z);
+		z = NULL;
+	}
+#endif
+
+	if (z != NULL) {
+		data = z;
+		len = zlen;
+	}
+
+	n = ws_hdr(hdr, type, z != NULL, len);
+	if ((sh = bufshared_new(n + len)) != NULL) {
+		memcpy(sh->data, hdr, n);
+		memcpy(sh->data + n, data, len);
+	}
+
+	free(z);
+	return (sh);
+}
+
 int
 ws_read(struct client *clt, int *type, size_t *len)
 {
 	struct buffer	*rbuf = &clt->bio.rbuf;
-	size_t		 i;
+	size_t		 i, hlen, plen;
+	uint64_t	 extlen;
 	uint32_t	 mask;
-	uint8_t		 first, second, op, plen;
+	uint16_t	 shortlen;
+	uint8_t		 first, second, op;
 
 	*type = WST_UNKNOWN, *len = 0;
 
@@ -161,9 +324,32 @@ ws_read(struct client *clt, int *type, size_t *len)
 
 	op = first & 0x0F;
 	plen = second & 0x7F;
+	hlen = sizeof(first) + sizeof(second);
 
-	/* don't support extended payload length for now */
-	if (plen >= 126) {
+	if (plen == 126) {
+		if (rbuf->len < hlen + sizeof(shortlen)) {
+			errno = EAGAIN;
+			return (-1);
+		}
+		memcpy(&shortlen, &rbuf->buf[hlen], sizeof(shortlen));
+		hlen += sizeof(shortlen);
+		plen = ntohs(shortlen);
+	} else if (plen == 127) {
+		if (rbuf->len < hlen + sizeof(extlen)) {
+			errno = EAGAIN;
+			return (-1);
+		}
+		memcpy(&extlen, &rbuf->buf[hlen], sizeof(extlen));
+		hlen += sizeof(extlen);
+		extlen = be64toh(extlen);
+		if (extlen > WS_MAX_READ) {
+			errno = E2BIG;
+			return (-1);
+		}
+		plen = extlen;
+	}
+
+	if (plen > WS_MAX_READ) {
 		errno = E2BIG;
 		return (-1);
 	}
@@ -180,12 +366,12 @@ ws_read(struct client *clt, int *type, size_t *len)
 		break;
 	}
 
-	if (rbuf->len < sizeof(first) + sizeof(second) + sizeof(mask) + plen) {
+	if (rbuf->len < hlen + sizeof(mask) + plen) {
 		errno = EAGAIN;
 		return (-1);
 	}
 
-	buf_drain(rbuf, 2); /* header */
+	buf_drain(rbuf, hlen); /* header */
 	memcpy(&mask, rbuf->buf, sizeof(mask));
 	buf_drain(rbuf, 4);
 
@@ -200,33 +386,11 @@ int
 ws_compose(struct client *clt, int type, const void *data, size_t len)
 {
 	struct bufio	*bio = &clt->bio;
-	uint16_t	 extlen = 0;
-	uint8_t		 first, second;
-
-	first = (type & 0x0F) | 0x80;
-
-	if (len < 126)
-		second = len;
-	else {
-		second = 126;
-
-		/*
-		 * for the extended length, the most significant bit
-		 * must be zero.  We could use the 64 bit field but
-		 * it's a waste.
-		 */
-		if (len > 0x7FFF) {
-			errno = ERANGE;
-			return (-1);
-		}
-		extlen = htons(len);
-	}
-
-	if (bufio_compose(bio, &first, 1) == -1 ||
-	    bufio_compose(bio, &second, 1) == -1)
-		goto err;
+	uint8_t		 hdr[10];
+	size_t		 n;
 
-	if (extlen != 0 && bufio_compose(bio, &extlen, sizeof(extlen)) == -1)
+	n = ws_hdr(hdr, type, 0, len);
+	if (bufio_compose(bio, hdr, n) == -1)
 		goto err;
 
 	if (bufio_compose(bio, data, len) == -1)
@@ -33,8 +33,11 @@ enum {
 	WST_PONG = 0x0A,
 };
 
+struct bufshared;
 struct client;
 
 int	ws_accept_hdr(const char *, char *, size_t);
+int	ws_deflate_offer(const char *);
+struct bufshared *ws_frame(int, const void *, size_t, int);
 int	ws_read(struct client *, int *, size_t *);
 int	ws_compose(struct client *, int, const void *, size_t);